@@ -196,52 +196,35 @@ int main(int argc, char ** argv)
 
         // could use a plain pointer here, but
         // I like smart pointers
-        std::unique_ptr<double[]> buf_ia(new double[naux]);
-        std::unique_ptr<double[]> buf_jb(new double[naux]);
-        std::unique_ptr<double[]> buf_ib(new double[naux]);
-        std::unique_ptr<double[]> buf_ja(new double[naux]);
-        double * buf_iap = buf_ia.get();
-        double * buf_jbp = buf_jb.get();
-        double * buf_ibp = buf_ib.get();
-        double * buf_jap = buf_ja.get();
+        // ((ia|jb) for all a and b, for a single pair i, j)
+        size_t blocksize = static_cast<size_t>(nvir)*nvir;
+        std::unique_ptr<double[]> buf_ij(new double[blocksize]);
+        double * buf_ijp = buf_ij.get();
 
         // calculate MP2 with density fitting
         double e2s = 0;
         double e2t = 0;
 
         for(int i = 0; i < nocc; i++)
-        for(int a = 0; a < nvir; a++)
         {
-            int ia = ten->CalcIndex(QGEN_QOV, i, a);
-            ten->GetBatch(QGEN_QOV, buf_iap, naux, ia);
-
             for(int j = 0; j < nocc; j++)
-            for(int b = 0; b < nvir; b++)
             {
-                int jb = ten->CalcIndex(QGEN_QOV, j, b);
-                ten->GetBatch(QGEN_QOV, buf_jbp, naux, jb);
-    
-                int ib = ten->CalcIndex(QGEN_QOV, i, b);
-                int ja = ten->CalcIndex(QGEN_QOV, j, a);
-    
-                ten->GetBatch(QGEN_QOV, buf_ibp, naux, ib);
-                ten->GetBatch(QGEN_QOV, buf_jap, naux, ja);
-    
-                double iajb = 0;
-                double ibja = 0;
-    
-                // contract
-                for(int q = 0; q < naux; q++)
+                // (ia|jb) = sum_Q (ia|Q)(Q|jb) for all a, b
+                ten->GetFourIndex(QGEN_QOV, QGEN_QOV, buf_ijp, blocksize,
+                                  i, 1, 0, nvir, j, 1, 0, nvir);
+
+                for(int a = 0; a < nvir; a++)
+                for(int b = 0; b < nvir; b++)
                 {
-                    iajb += buf_iap[q]*buf_jb[q];
-                    ibja += buf_ibp[q]*buf_ja[q];
+                    double iajb = buf_ijp[a*nvir+b];
+                    double ibja = buf_ijp[b*nvir+a];
+
+                    // remember that a,b goes from [0,nvir) so we have to 
+                    // factor in the occupied orbitals for orben
+                    double denom = orben[i]+orben[j]-orben[nocc+a]-orben[nocc+b]; 
+                    e2s += (iajb*iajb)/denom;
+                    e2t += (iajb*(iajb-ibja))/denom;
                 }
-                
-                // remember that a,b goes from [0,nvir) so we have to 
-                // factor in the occupied orbitals for orben
-                double denom = orben[i]+orben[j]-orben[nocc+a]-orben[nocc+b]; 
-                e2s += (iajb*iajb)/denom;
-                e2t += (iajb*(iajb-ibja))/denom;
             }
         }
        
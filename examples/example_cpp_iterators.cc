@@ -268,6 +268,15 @@ int main(int argc, char ** argv)
              << "         Opposite spin: " << e2s << "\n"
              << "                 TOTAL: " << e2s+e2t << "\n"; 
 
+        // The same thing, done by the library in blocks
+        double esame, eopp;
+        double e2 = ten->DFMP2Energy(orben.data(), esame, eopp);
+
+        *out << "MP2 Correlation Energy (DFMP2Energy)\n"
+             << "             Same spin: " << esame << "\n"
+             << "         Opposite spin: " << eopp << "\n"
+             << "                 TOTAL: " << e2 << "\n"; 
+
         // even if not verbose, print the timints
         if(!verbose)
             panache::output::SetOutput(&*out);
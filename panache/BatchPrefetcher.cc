@@ -0,0 +1,117 @@
+/*! \file
+ * \brief Reading batches of a three-index tensor ahead of use (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <algorithm>
+
+#include "panache/BatchPrefetcher.h"
+#include "panache/Exception.h"
+
+namespace panache
+{
+
+BatchPrefetcher::BatchPrefetcher(FetchFunc ff, double * buf, size_t bufsize,
+                                 int batchsize, int nindex, int depth)
+    : ff_(ff), bufsize_(bufsize), nindex_(nindex), nextstart_(0), cur_(-1)
+{
+    if(depth < 1)
+        throw RuntimeError("Error - prefetch depth must be at least 1");
+
+    size_t nper = bufsize / static_cast<size_t>(std::max(batchsize, 1));
+    nper_ = static_cast<int>(std::min(nper, static_cast<size_t>(std::max(nindex, 1))));
+
+    // If the buffer can't hold a batch, read synchronously so
+    // that the error comes from the read itself. Otherwise, there
+    // is no point in having more buffers than batches.
+    if(nper_ == 0)
+        depth = 1;
+    else
+        depth = std::max(1, std::min(depth, (nindex + nper_ - 1) / nper_));
+
+    slots_.resize(depth);
+    slots_[0].buf = buf;
+
+    if(depth > 1)
+    {
+        extrabuf_ = std::unique_ptr<double[]>(new double[(depth-1)*bufsize_]);
+
+        for(int i = 1; i < depth; i++)
+            slots_[i].buf = extrabuf_.get() + (i-1)*bufsize_;
+
+        for(int i = 0; i < depth; i++)
+            Issue_(i);
+    }
+}
+
+
+BatchPrefetcher::~BatchPrefetcher()
+{
+    Wait_();
+}
+
+
+int BatchPrefetcher::Depth(void) const
+{
+    return static_cast<int>(slots_.size());
+}
+
+
+void BatchPrefetcher::Issue_(int slot)
+{
+    Slot & s = slots_[slot];
+    s.start = nextstart_;
+
+    if(nextstart_ >= nindex_)
+    {
+        s.fut = std::future<int>();
+        return;
+    }
+
+    s.fut = std::async(std::launch::async, ff_, s.buf, nextstart_);
+    nextstart_ += std::min(nper_, nindex_ - nextstart_);
+}
+
+
+void BatchPrefetcher::Wait_(void)
+{
+    for(auto & it : slots_)
+        if(it.fut.valid())
+            it.fut.wait();
+}
+
+
+int BatchPrefetcher::Next(double ** data, int * start)
+{
+    if(slots_.size() == 1)
+    {
+        if(nextstart_ >= nindex_)
+            return 0;
+
+        int n = ff_(slots_[0].buf, nextstart_);
+        *data = slots_[0].buf;
+        *start = nextstart_;
+        nextstart_ += n;
+        return n;
+    }
+
+    // the buffer handed out last time is free to be refilled
+    if(cur_ >= 0)
+        Issue_(cur_);
+
+    int next = (cur_ + 1) % static_cast<int>(slots_.size());
+    Slot & s = slots_[next];
+
+    if(!s.fut.valid())
+        return 0;
+
+    cur_ = next;
+
+    int n = s.fut.get();
+    *data = s.buf;
+    *start = s.start;
+    return n;
+}
+
+} // close namespace panache
+
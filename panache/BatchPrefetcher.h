@@ -0,0 +1,110 @@
+/*! \file
+ * \brief Reading batches of a three-index tensor ahead of use (header)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_BATCHPREFETCHER_H
+#define PANACHE_BATCHPREFETCHER_H
+
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+
+namespace panache
+{
+
+/*!
+ * \brief Reads consecutive batches of a tensor, optionally in the background
+ *
+ * With a depth of one, each batch is read when it is asked for. With
+ * a larger depth, up to (depth - 1) batches are read by background threads
+ * while the caller works on the current one (ie, depth = 2 is double buffering,
+ * depth = 3 is triple buffering).
+ *
+ * The buffer passed in to the constructor is used for the first batch, and
+ * (depth - 1) more buffers of the same size are allocated.
+ *
+ * Exceptions thrown while reading in the background are rethrown from Next().
+ */
+class BatchPrefetcher
+{
+public:
+    /*!
+     * \brief A function that reads a batch into a buffer
+     *
+     * Takes the buffer and the starting index, and returns the
+     * number of indices that were read.
+     */
+    typedef std::function<int(double *, int)> FetchFunc;
+
+    /*!
+     * \brief Constructor
+     *
+     * Reading of the first batches starts immediately
+     *
+     * \param [in] ff Function that reads the batches
+     * \param [in] buf Buffer to use for the first batch
+     * \param [in] bufsize Size of \p buf (in number of doubles)
+     * \param [in] batchsize Number of doubles for each index
+     * \param [in] nindex Total number of indices to read
+     * \param [in] depth Number of buffers to use (at least 1)
+     */
+    BatchPrefetcher(FetchFunc ff, double * buf, size_t bufsize,
+                    int batchsize, int nindex, int depth);
+
+    /*!
+     * \brief Destructor
+     *
+     * Waits for any background reads to finish
+     */
+    ~BatchPrefetcher();
+
+    BatchPrefetcher(const BatchPrefetcher &) = delete;
+    BatchPrefetcher & operator=(const BatchPrefetcher &) = delete;
+
+    /*!
+     * \brief Get the next batch
+     *
+     * The buffer returned by the previous call is reused, and
+     * so can't be used after calling this.
+     *
+     * \param [out] data Pointer to the data for the batch
+     * \param [out] start First index in the batch
+     * \return Number of indices in the batch, or zero if there are no more
+     */
+    int Next(double ** data, int * start);
+
+    /// Number of buffers in use
+    int Depth(void) const;
+
+private:
+    /// A buffer, and the read that is filling it
+    struct Slot
+    {
+        double * buf;          //!< Where the batch goes
+        int start;             //!< First index of the batch
+        std::future<int> fut;  //!< Background read (if depth > 1)
+    };
+
+    FetchFunc ff_;         //!< Reads a batch
+    size_t bufsize_;       //!< Size of each buffer
+    int nper_;             //!< Number of indices that fit in a buffer
+    int nindex_;           //!< Total number of indices
+    int nextstart_;        //!< Start of the next batch to be read
+    int cur_;              //!< Slot handed out last (-1 if none)
+
+    std::unique_ptr<double[]> extrabuf_; //!< Storage for the extra buffers
+    std::vector<Slot> slots_;            //!< Buffers in use (ring)
+
+    /// Start reading the next batch into a slot
+    void Issue_(int slot);
+
+    /// Wait for all outstanding reads
+    void Wait_(void);
+};
+
+} // close namespace panache
+
+#endif
+
@@ -6,11 +6,16 @@
 #include "panache/CHTensor.h"
 #include "panache/BasisSet.h"
 #include "panache/Output.h"
+#include "panache/Hash.h"
 #include "panache/storedqtensor/StoredQTensor.h"
 #include "panache/storedqtensor/StoredQTensorFactory.h"
 
 namespace panache {
 
+// Number of cholesky vectors per basis function
+// assumed when planning
+#define CHOLESKY_PLAN_VECTORS_PER_BF 5
+
 CHTensor::CHTensor(SharedBasisSet primary, double delta,
                    const std::string & directory,
                    int bsorder,
@@ -25,6 +30,28 @@ CHTensor::CHTensor(SharedBasisSet primary, double delta,
 }
 
 
+void CHTensor::AddOriginOptions(QTensorOrigin & origin) const
+{
+    Hasher h;
+    h.Add(delta_);
+    origin.options = h.Value();
+}
+
+
+void CHTensor::PlanQso(QTensorPlan & plan) const
+{
+    // The number of cholesky vectors is only known after the
+    // decomposition, so this is a rough guess
+    plan.naux = std::min(nsotri_, CHOLESKY_PLAN_VECTORS_PER_BF*nso_);
+
+    // the diagonal, and a row of integrals for each vector
+    plan.nintegrals = static_cast<double>(plan.naux + 1)*nsotri_;
+    plan.metricflops = 0.0;
+
+    // all vectors are kept in memory until the decomposition is done
+    plan.peakmemory += sizeof(double)*(static_cast<size_t>(plan.naux) + 1)*nsotri_;
+}
+
 UniqueStoredQTensor CHTensor::GenQso(int storeflags) const
 {
     // Since main options can only be set in the constructor, there is no danger
@@ -32,7 +59,9 @@ UniqueStoredQTensor CHTensor::GenQso(int storeflags) const
     // be equivalent, except for storage options
 
     // Can't do full initialization yet. Will be done in GenCHQso (virtual function)
-    auto qso = StoredQTensorFactory(storeflags | QSTORAGE_BYQ | QSTORAGE_PACKED, "qso", directory_);
+    auto qso = StoredQTensorFactory(storeflags | QSTORAGE_BYQ | QSTORAGE_PACKED, "qso", directory_,
+                                    Origin(false), MemoryAvailable());
+    ApplyMemoryLimit(qso.get());
 
     // already existed
     if(qso->filled())
@@ -28,7 +28,8 @@ public:
      *
      * \param [in] primary The primary basis set
      * \param [in] delta Maximum error in the Cholesky procedure
-     * \param [in] directory Full path to a directory to put scratch files
+     * \param [in] directory Full path to a directory to put scratch files (or several, separated
+     *                       by ':', to stripe tensors stored on disk across)
      * \param [in] bsorder Basis function ordering flag
      * \param [in] nthreads Max number of threads to use
      */ 
@@ -40,6 +41,8 @@ public:
 
 protected:
     virtual UniqueStoredQTensor GenQso(int storeflags) const;
+    virtual void AddOriginOptions(QTensorOrigin & origin) const;
+    virtual void PlanQso(QTensorPlan & plan) const;
 
 private:
     double delta_;
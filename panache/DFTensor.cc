@@ -8,6 +8,7 @@
 #include "panache/Output.h"
 #include "panache/BasisSet.h"
 #include "panache/BasisSetParser.h"
+#include "panache/Hash.h"
 #include "panache/storedqtensor/StoredQTensor.h"
 #include "panache/storedqtensor/StoredQTensorFactory.h"
 
@@ -55,6 +56,29 @@ DFTensor::DFTensor(SharedBasisSet primary,
     Init_();
 }
 
+void DFTensor::AddOriginOptions(QTensorOrigin & origin) const
+{
+    Hasher h;
+    h.Add(static_cast<int64_t>(origin.inputhash));
+    HashBasisSet(h, *auxiliary_);
+
+    origin.inputhash = h.Value();
+    origin.options = optflag_;
+}
+
+void DFTensor::PlanQso(QTensorPlan & plan) const
+{
+    double naux = naux_;
+    plan.naux = naux_;
+
+    // three-center integrals, and two-center for the metric
+    plan.nintegrals = naux*nsotri_ + naux*(naux+1)/2;
+    plan.metricflops = 2.0*naux*naux*nsotri_;
+
+    // the metric, and copies while taking its inverse
+    plan.peakmemory += 3*sizeof(double)*static_cast<size_t>(naux_)*naux_;
+}
+
 UniqueStoredQTensor DFTensor::GenQso(int storeflags) const
 {
     // Since main options can only be set in the constructor, there is no danger
@@ -63,7 +87,9 @@ UniqueStoredQTensor DFTensor::GenQso(int storeflags) const
 
     // Always gen qso as packed and by q
     auto qso = StoredQTensorFactory(naux_, nso_, nso_, 
-                                    storeflags | QSTORAGE_PACKED | QSTORAGE_BYQ, "qso", directory_);
+                                    storeflags | QSTORAGE_PACKED | QSTORAGE_BYQ, "qso", directory_,
+                                    Origin(false), MemoryAvailable());
+    ApplyMemoryLimit(qso.get());
 
     // already existed
     if(qso->filled())
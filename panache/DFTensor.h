@@ -30,7 +30,8 @@ public:
      *
      * \param [in] primary The primary basis set
      * \param [in] auxiliary The auxiliary (DF) basis set
-     * \param [in] directory Full path to a directory to put scratch files
+     * \param [in] directory Full path to a directory to put scratch files (or several, separated
+     *                       by ':', to stripe tensors stored on disk across)
      * \param [in] bsorder Basis function ordering flag
      * \param [in] optflag Flag controlling the type of metric to use
      *             and other options. Set to zero for default (coulomb/eiginv)
@@ -51,7 +52,8 @@ public:
      *
      * \param [in] primary The primary basis set
      * \param [in] auxpath Path to auxiliary basis set file (G98 format)
-     * \param [in] directory Full path to a directory to put scratch files
+     * \param [in] directory Full path to a directory to put scratch files (or several, separated
+     *                       by ':', to stripe tensors stored on disk across)
      * \param [in] optflag Flag controlling the type of metric to use
      *                     and other options. Set to zero for default (coulomb/eiginv)
      * \param [in] bsorder Basis function ordering flag
@@ -66,6 +68,8 @@ public:
 
 protected:
     virtual UniqueStoredQTensor GenQso(int storeflags) const;
+    virtual void AddOriginOptions(QTensorOrigin & origin) const;
+    virtual void PlanQso(QTensorPlan & plan) const;
 
 private:
     int naux_;   //!< Number of auxiliary basis functions
@@ -21,6 +21,7 @@
  */
 
 #include <algorithm>
+#include <cmath>
 #include <utility>
 
 #include "panache/ERI.h"
@@ -26,13 +26,16 @@
     /*! \name Flags specifing how tensors should be stored */
     ///@{
     #define QSTORAGE_PACKED  1     //!< Internal use only
-    #define QSTORAGE_ONFLY   2     //!< Generate on-the-fly (not yet implemented)
+    #define QSTORAGE_ONFLY   2     //!< Don't store. Recompute integrals on every read, so read in large batches (density fitting only)
     #define QSTORAGE_BYQ     4     //!< Store with Q as the first (slowest) index
     #define QSTORAGE_INMEM   8     //!< Store in memory (core)
     #define QSTORAGE_ONDISK  16    //!< Store on disk
     #define QSTORAGE_KEEPDISK  32  //!< Don't erase the file on disk when done. If QSTORAGE_INMEM, writes to disk when done.
     #define QSTORAGE_READDISK  64  //!< Read the file previously saved with QSTORAGE_KEEPDISK
     #define QSTORAGE_FASTDF    128 //!< Postpone metric multiplication until after MO transformation
+    #define QSTORAGE_FLOAT     256 //!< Store transformed tensors in single precision (Qso is always double)
+    #define QSTORAGE_MMAP      512 //!< Store on disk, accessed through a memory mapping
+    #define QSTORAGE_HYBRID   1024 //!< Store in memory as far as the memory limit allows, and the rest on disk
 
     #ifdef PANACHE_CYCLOPS
     #define QSTORAGE_CYCLOPS 2048  //!< Use Cyclops library
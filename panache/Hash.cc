@@ -0,0 +1,89 @@
+/*! \file
+ * \brief Simple hashing of data and inputs (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <cstring>
+
+#include "panache/Hash.h"
+#include "panache/BasisSet.h"
+
+namespace panache
+{
+
+// 64-bit FNV parameters
+#define HASH_OFFSET_BASIS 14695981039346656037ULL
+#define HASH_PRIME 1099511628211ULL
+
+
+Hasher::Hasher() : h_(HASH_OFFSET_BASIS)
+{
+}
+
+
+void Hasher::Add(const void * data, size_t nbytes)
+{
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+
+    // whole words, then whatever is left
+    for(; nbytes >= sizeof(uint64_t); nbytes -= sizeof(uint64_t), p += sizeof(uint64_t))
+    {
+        uint64_t w;
+        std::memcpy(&w, p, sizeof(uint64_t));
+        h_ = (h_ ^ w) * HASH_PRIME;
+    }
+
+    for(; nbytes > 0; nbytes--, p++)
+        h_ = (h_ ^ *p) * HASH_PRIME;
+}
+
+
+void Hasher::Add(int64_t i)
+{
+    Add(&i, sizeof(int64_t));
+}
+
+
+void Hasher::Add(double d)
+{
+    Add(&d, sizeof(double));
+}
+
+
+uint64_t Hasher::Value(void) const
+{
+    return h_;
+}
+
+
+void HashBasisSet(Hasher & h, const BasisSet & basis)
+{
+    h.Add(static_cast<int64_t>(basis.nshell()));
+
+    for(int i = 0; i < basis.nshell(); i++)
+    {
+        const GaussianShell & s = basis.shell(i);
+
+        h.Add(static_cast<int64_t>(s.am()));
+        h.Add(static_cast<int64_t>(s.is_pure()));
+        h.Add(static_cast<int64_t>(s.nprimitive()));
+        h.Add(s.center(), 3*sizeof(double));
+
+        for(int p = 0; p < s.nprimitive(); p++)
+        {
+            h.Add(s.exp(p));
+            h.Add(s.original_coef(p));
+        }
+    }
+}
+
+
+uint64_t Checksum(const void * data, size_t nbytes)
+{
+    Hasher h;
+    h.Add(data, nbytes);
+    return h.Value();
+}
+
+} // close namespace panache
+
@@ -0,0 +1,64 @@
+/*! \file
+ * \brief Simple hashing of data and inputs (header)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_HASH_H
+#define PANACHE_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace panache
+{
+
+class BasisSet;
+
+
+/*!
+ * \brief Accumulates a 64-bit hash (FNV-1a style, a word at a time)
+ *
+ * This is for detecting changes to inputs and corruption of data,
+ * and is not cryptographically secure.
+ */
+class Hasher
+{
+public:
+    Hasher();
+
+    /// Add some raw data to the hash
+    void Add(const void * data, size_t nbytes);
+
+    /// Add an integer to the hash
+    void Add(int64_t i);
+
+    /// Add a double (by its bit pattern) to the hash
+    void Add(double d);
+
+    /// Obtain the current value of the hash
+    uint64_t Value(void) const;
+
+private:
+    uint64_t h_; //!< Current hash value
+};
+
+
+/*!
+ * \brief Add a basis set (and the positions of its shells) to a hash
+ *
+ * Includes the angular momentum, exponents, contraction coefficients,
+ * and centers of all shells.
+ */
+void HashBasisSet(Hasher & h, const BasisSet & basis);
+
+
+/*!
+ * \brief Checksum of a block of data
+ */
+uint64_t Checksum(const void * data, size_t nbytes);
+
+
+} // close namespace panache
+
+#endif
+
@@ -0,0 +1,98 @@
+/*! \file
+ * \brief Direct access to a single stored three-index tensor (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <algorithm>
+
+#include "panache/QTensorHandle.h"
+#include "panache/Exception.h"
+#include "panache/storedqtensor/StoredQTensor.h"
+#include "panache/storedqtensor/StoreCopy.h"
+
+namespace panache
+{
+
+QTensorHandle::QTensorHandle(StoredQTensor * qt)
+    : qt_(qt), data_(nullptr),
+      naux_(qt->naux()), ndim1_(qt->ndim1()), ndim2_(qt->ndim2()), ndim12_(qt->ndim12()),
+      packed_(qt->packed()), byq_(qt->byq())
+{
+    // The whole tensor, if it can be viewed. Data from a reused
+    // file that hasn't been checked yet is read through the tensor
+    // instead, so that only the parts read are checked.
+    if(!qt->verified())
+        return;
+
+    if(byq_)
+        qt->ViewByQ(data_, naux_, 0);
+    else
+        qt->View(data_, ndim12_, 0);
+}
+
+
+int QTensorHandle::GetQBatch(double * outbuf, size_t bufsize, int qstart) const
+{
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    size_t nq = (bufsize / ndim12_);
+
+    if(nq == 0)
+        throw RuntimeError("Error - buffer is to small to hold even one batch!");
+
+    if(qstart >= naux_)
+        return 0;
+
+    // buffer may hold more than the whole tensor
+    int gotten = static_cast<int>(std::min(nq, static_cast<size_t>(naux_ - qstart)));
+
+    if(data_)
+        StoreReadQ(data_, outbuf, byq_, naux_, ndim12_, gotten, qstart);
+    else
+        gotten = qt_->ReadByQ(outbuf, gotten, qstart);
+
+#ifdef PANACHE_TIMING
+    tim.Stop();
+    qt_->GetQBatchTimer().AddTime(tim);
+#endif
+
+    return gotten;
+}
+
+
+int QTensorHandle::GetBatch(double * outbuf, size_t bufsize, int ijstart) const
+{
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    size_t nij = (bufsize / naux_);
+
+    if(nij == 0)
+        throw RuntimeError("Error - buffer is to small to hold even one batch!");
+
+    if(ijstart >= ndim12_)
+        return 0;
+
+    // buffer may hold more than the whole tensor
+    int gotten = static_cast<int>(std::min(nij, static_cast<size_t>(ndim12_ - ijstart)));
+
+    if(data_)
+        StoreReadIJ(data_, outbuf, byq_, naux_, ndim12_, gotten, ijstart);
+    else
+        gotten = qt_->Read(outbuf, gotten, ijstart);
+
+#ifdef PANACHE_TIMING
+    tim.Stop();
+    qt_->GetBatchTimer().AddTime(tim);
+#endif
+
+    return gotten;
+}
+
+} // close namespace panache
+
@@ -0,0 +1,133 @@
+/*! \file
+ * \brief Direct access to a single stored three-index tensor (header)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_QTENSORHANDLE_H
+#define PANACHE_QTENSORHANDLE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace panache
+{
+
+class StoredQTensor;
+
+
+/*!
+ * \brief Access to one stored three-index tensor, for use within loops
+ *
+ * Obtained once from ThreeIndexTensor::Handle(), after which the tensor flag
+ * doesn't need to be resolved again. The dimensions are kept in the handle, so
+ * CalcIndex(), etc, are inlined.
+ *
+ * If the tensor is stored in double precision in memory (or in a memory-mapped file),
+ * batches are copied directly from the storage without going through the
+ * StoredQTensor object, and single elements can be obtained with Element().
+ * Otherwise, batches are read through the StoredQTensor object as usual. This
+ * includes memory-mapped files reused with QSTORAGE_READDISK whose checksums
+ * have not all been checked yet, so that each batch checks only what it reads.
+ *
+ * The handle is valid until the tensor is deleted or regenerated. It
+ * is cheap to copy.
+ */
+class QTensorHandle
+{
+public:
+    /*!
+     * \brief Construct for a stored tensor
+     *
+     * \param [in] qt The stored tensor (which must be filled in)
+     */
+    explicit QTensorHandle(StoredQTensor * qt);
+
+    /// Number of auxiliary indices
+    int naux(void) const { return naux_; }
+
+    /// Length of the first orbital index
+    int ndim1(void) const { return ndim1_; }
+
+    /// Length of the second orbital index
+    int ndim2(void) const { return ndim2_; }
+
+    /// Number of combined orbital indices (depends on packing)
+    int ndim12(void) const { return ndim12_; }
+
+    /// Size of a batch by Q (see ThreeIndexTensor::QBatchSize())
+    int QBatchSize(void) const { return ndim12_; }
+
+    /// Size of a batch by orbital index (see ThreeIndexTensor::BatchSize())
+    int BatchSize(void) const { return naux_; }
+
+    /// Is the tensor packed
+    bool IsPacked(void) const { return packed_; }
+
+    /// Is the tensor stored by Q
+    bool IsByQ(void) const { return byq_; }
+
+    /*!
+     * \brief Calculate the combined orbital index (see ThreeIndexTensor::CalcIndex())
+     */
+    int CalcIndex(int i, int j) const
+    {
+        if(!packed_)
+            return (i*ndim2_+j);
+        else if(i >= j)
+            return static_cast<int>((static_cast<int64_t>(i)*(i+1))>>1) + j;
+        else
+            return static_cast<int>((static_cast<int64_t>(j)*(j+1))>>1) + i;
+    }
+
+    /*!
+     * \brief Can the storage be accessed directly
+     *
+     * If true, Element() may be used, and batches are copied
+     * straight from the storage.
+     */
+    bool Direct(void) const { return data_ != nullptr; }
+
+    /*!
+     * \brief Get a single element of the tensor
+     *
+     * Only available if Direct() is true (not checked)
+     *
+     * \param [in] q Auxiliary index
+     * \param [in] ij Combined orbital index
+     */
+    double Element(int q, int ij) const
+    {
+        if(byq_)
+            return data_[static_cast<size_t>(q)*ndim12_ + ij];
+        else
+            return data_[static_cast<size_t>(ij)*naux_ + q];
+    }
+
+    /*!
+     * \brief Retrieves a batch of the tensor by Q
+     *
+     * Same as ThreeIndexTensor::GetQBatch()
+     */
+    int GetQBatch(double * outbuf, size_t bufsize, int qstart) const;
+
+    /*!
+     * \brief Retrieves a batch of the tensor by orbital index
+     *
+     * Same as ThreeIndexTensor::GetBatch()
+     */
+    int GetBatch(double * outbuf, size_t bufsize, int ijstart) const;
+
+private:
+    StoredQTensor * qt_;   //!< The stored tensor
+    const double * data_;  //!< Start of the storage (if it can be accessed directly)
+    int naux_;     //!< Number of auxiliary functions
+    int ndim1_;    //!< Length of index 1
+    int ndim2_;    //!< Length of index 2
+    int ndim12_;   //!< Combined size of index 1 and 2
+    bool packed_;  //!< Tensor is packed
+    bool byq_;     //!< Tensor is stored by Q
+};
+
+} // close namespace panache
+
+#endif
@@ -0,0 +1,264 @@
+/*! \file
+ * \brief Load balancing for loops over shell triples (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <algorithm>
+
+#include "panache/ShellTasks.h"
+#include "panache/BasisSet.h"
+#include "panache/Output.h"
+
+namespace panache
+{
+
+// Number of chunks to aim for per thread
+// More chunks = better balance but more overhead
+#define SHELLTASKS_PER_THREAD 8
+
+
+/*!
+ * \brief Estimated relative cost of a shell
+ *
+ * The cost of a shell triple is taken to be the product of these
+ */
+static double ShellCost_(const GaussianShell & s)
+{
+    return static_cast<double>(s.nprimitive() * s.ncartesian() * (s.am()+1));
+}
+
+
+double ShellTripleCost(const SharedBasisSet & auxiliary, int P,
+                       const SharedBasisSet & primary, int M, int N)
+{
+    return ShellCost_(auxiliary->shell(P))
+         * ShellCost_(primary->shell(M))
+         * ShellCost_(primary->shell(N));
+}
+
+
+std::vector<ShellTask> BalancedShellTasks(const SharedBasisSet & auxiliary,
+                                          const SharedBasisSet & primary,
+                                          int nthreads, bool splitaux)
+{
+    const int nauxshell = auxiliary->nshell();
+    const int nprimshell = primary->nshell();
+    const int npair = (nprimshell*(nprimshell+1))/2;
+
+    // the cost model is separable, so we only need
+    // the costs of the P and of the MN pairs
+    std::vector<double> pcost(nauxshell);
+    std::vector<double> mncost(npair);
+
+    double ptotal = 0;
+    for(int P = 0; P < nauxshell; P++)
+    {
+        pcost[P] = ShellCost_(auxiliary->shell(P));
+        ptotal += pcost[P];
+    }
+
+    double mntotal = 0;
+    for(int M = 0, MN = 0; M < nprimshell; M++)
+    {
+        double mcost = ShellCost_(primary->shell(M));
+        for(int N = 0; N <= M; N++, MN++)
+        {
+            mncost[MN] = mcost * ShellCost_(primary->shell(N));
+            mntotal += mncost[MN];
+        }
+    }
+
+    double target = (ptotal*mntotal) / static_cast<double>(nthreads*SHELLTASKS_PER_THREAD);
+
+    std::vector<ShellTask> tasks;
+
+    // Splits a range of MN pairs for the aux shells [pstart, pend)
+    auto SplitMN = [&](int pstart, int pend, double pfac)
+    {
+        ShellTask task{pstart, pend, 0, 0, 0.0};
+        for(int MN = 0; MN < npair; MN++)
+        {
+            task.cost += pfac*mncost[MN];
+            task.mnend = MN+1;
+
+            if(task.cost >= target)
+            {
+                tasks.push_back(task);
+                task.mnstart = task.mnend;
+                task.cost = 0.0;
+            }
+        }
+
+        if(task.mnend > task.mnstart)
+            tasks.push_back(task);
+    };
+
+
+    if(!splitaux)
+        SplitMN(0, nauxshell, ptotal);
+    else
+    {
+        // group small rows of P together, and
+        // split large ones along MN
+        ShellTask group{0, 0, 0, npair, 0.0};
+
+        for(int P = 0; P < nauxshell; P++)
+        {
+            double rowcost = pcost[P]*mntotal;
+
+            if(rowcost >= target)
+                SplitMN(P, P+1, pcost[P]);
+            else
+            {
+                if(group.pend > group.pstart && group.cost + rowcost > target)
+                {
+                    tasks.push_back(group);
+                    group.cost = 0.0;
+                }
+
+                if(group.cost == 0.0)
+                    group.pstart = P;
+
+                group.pend = P+1;
+                group.cost += rowcost;
+                continue;
+            }
+
+            // flush the group so that it stays contiguous
+            if(group.cost > 0.0)
+            {
+                tasks.push_back(group);
+                group.cost = 0.0;
+            }
+        }
+
+        if(group.cost > 0.0)
+            tasks.push_back(group);
+    }
+
+    std::stable_sort(tasks.begin(), tasks.end(),
+                     [](const ShellTask & t1, const ShellTask & t2) { return t1.cost > t2.cost; });
+
+    return tasks;
+}
+
+
+
+
+ShellTaskScheduler::ShellTaskScheduler(const std::vector<ShellTask> & tasks, int nthreads)
+    : finished_(nthreads)
+{
+    for(int i = 0; i < nthreads; i++)
+    {
+        queues_.push_back(std::unique_ptr<ThreadQueue>(new ThreadQueue));
+        queues_.back()->remaining = 0.0;
+    }
+
+    // Give each task (which should be sorted most expensive first)
+    // to the thread with the least work so far
+    for(const auto & it : tasks)
+    {
+        auto least = std::min_element(queues_.begin(), queues_.end(),
+                                      [](const std::unique_ptr<ThreadQueue> & q1,
+                                         const std::unique_ptr<ThreadQueue> & q2)
+                                      { return q1->remaining < q2->remaining; });
+        (*least)->tasks.push_back(it);
+        (*least)->remaining += it.cost;
+    }
+}
+
+
+bool ShellTaskScheduler::Next(int threadnum, ShellTask & task)
+{
+    {
+        ThreadQueue & myqueue = *queues_[threadnum];
+        std::lock_guard<std::mutex> l(myqueue.mtx);
+
+        if(myqueue.tasks.size())
+        {
+            task = myqueue.tasks.front();
+            myqueue.tasks.pop_front();
+            myqueue.remaining -= task.cost;
+            return true;
+        }
+    }
+
+    if(Steal_(threadnum, task))
+        return true;
+
+    finished_[threadnum] = panacheclock::now();
+    return false;
+}
+
+
+bool ShellTaskScheduler::Steal_(int threadnum, ShellTask & task)
+{
+    // Tasks are never added, so once every queue
+    // is seen empty, we are done
+    while(true)
+    {
+        int victim = -1;
+        double most = 0.0;
+
+        for(size_t i = 0; i < queues_.size(); i++)
+        {
+            std::lock_guard<std::mutex> l(queues_[i]->mtx);
+            if(queues_[i]->tasks.size() && (victim < 0 || queues_[i]->remaining > most))
+            {
+                victim = i;
+                most = queues_[i]->remaining;
+            }
+        }
+
+        if(victim < 0)
+            return false;
+
+        ThreadQueue & vqueue = *queues_[victim];
+        std::lock_guard<std::mutex> l(vqueue.mtx);
+
+        // may have been emptied in the meantime
+        if(vqueue.tasks.size())
+        {
+            task = vqueue.tasks.back();
+            vqueue.tasks.pop_back();
+            vqueue.remaining -= task.cost;
+            return true;
+        }
+    }
+}
+
+
+std::vector<unsigned long> ShellTaskScheduler::IdleMicroseconds(void) const
+{
+    std::vector<unsigned long> idle(finished_.size());
+
+    auto last = std::max_element(finished_.begin(), finished_.end());
+
+    // threads that never started (ie, if OpenMP gave us fewer)
+    // still have the default time point
+    for(size_t i = 0; i < finished_.size(); i++)
+    {
+        if(finished_[i] == panacheclock::time_point())
+            idle[i] = 0;
+        else
+            idle[i] = std::chrono::duration_cast<std::chrono::microseconds>(*last - finished_[i]).count();
+    }
+
+    return idle;
+}
+
+
+void ShellTaskScheduler::PrintIdle(const std::string & name) const
+{
+    #ifdef PANACHE_TIMING
+    auto idle = IdleMicroseconds();
+
+    output::printf("  %s generation: idle time per thread (microseconds)\n", name.c_str());
+    for(size_t i = 0; i < idle.size(); i++)
+        output::printf("      Thread %3lu: %17lu\n", i, idle[i]);
+    output::printf("\n");
+    #endif
+}
+
+} // close namespace panache
+
@@ -0,0 +1,129 @@
+/*! \file
+ * \brief Load balancing for loops over shell triples (header)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_SHELLTASKS_H
+#define PANACHE_SHELLTASKS_H
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "panache/Timing.h"
+
+namespace panache
+{
+
+class BasisSet;
+typedef std::shared_ptr<BasisSet> SharedBasisSet;
+
+
+/*!
+ * \brief A chunk of work in a loop over (P|MN) shell triples
+ *
+ * Covers auxiliary shells [pstart, pend) and packed primary shell
+ * pairs [mnstart, mnend). A packed shell pair index is M*(M+1)/2+N with N <= M.
+ */
+struct ShellTask
+{
+    int pstart;   //!< First auxiliary shell
+    int pend;     //!< One past the last auxiliary shell
+    int mnstart;  //!< First packed primary shell pair
+    int mnend;    //!< One past the last packed primary shell pair
+    double cost;  //!< Estimated cost of this chunk (arbitrary units)
+};
+
+
+/*!
+ * \brief Estimate the cost of computing a (P|MN) shell triple
+ *
+ * Based on the number of primitives and angular momentum of each shell.
+ * The units are arbitrary, and only useful for comparison.
+ */
+double ShellTripleCost(const SharedBasisSet & auxiliary, int P,
+                       const SharedBasisSet & primary, int M, int N);
+
+
+/*!
+ * \brief Split a loop over (P|MN) shell triples into chunks of similar cost
+ *
+ * If \p splitaux is false, every chunk covers all auxiliary shells (for loops
+ * that need all of P for a given MN pair). The chunks are returned sorted
+ * with the most expensive first.
+ *
+ * \param [in] auxiliary Auxiliary basis set
+ * \param [in] primary Primary basis set
+ * \param [in] nthreads Number of threads that will process the chunks
+ * \param [in] splitaux Allow chunks to contain only some of the auxiliary shells
+ */
+std::vector<ShellTask> BalancedShellTasks(const SharedBasisSet & auxiliary,
+                                          const SharedBasisSet & primary,
+                                          int nthreads, bool splitaux);
+
+
+/*!
+ * \brief Hands out ShellTask chunks to threads, with work stealing
+ *
+ * Chunks are dealt out to per-thread queues. Each thread takes from the
+ * front of its own queue, and when it runs out, steals from the back of
+ * the queue with the most remaining work.
+ *
+ * The time each thread spends waiting for the others to finish is
+ * recorded and can be obtained through IdleMicroseconds().
+ */
+class ShellTaskScheduler
+{
+public:
+    /*!
+     * \brief Constructor
+     *
+     * \param [in] tasks Chunks of work (see BalancedShellTasks())
+     * \param [in] nthreads Number of threads that will call Next()
+     */
+    ShellTaskScheduler(const std::vector<ShellTask> & tasks, int nthreads);
+
+    /*!
+     * \brief Obtain the next chunk of work for a thread
+     *
+     * \param [in] threadnum Thread calling this function
+     * \param [out] task The chunk to work on
+     * \return False if there is no work left
+     */
+    bool Next(int threadnum, ShellTask & task);
+
+    /*!
+     * \brief Per-thread idle time, in microseconds
+     *
+     * Only meaningful after all threads have received false from Next()
+     */
+    std::vector<unsigned long> IdleMicroseconds(void) const;
+
+    /*!
+     * \brief Print the idle time of each thread (if timing is enabled)
+     *
+     * \param [in] name Descriptive name of what was calculated
+     */
+    void PrintIdle(const std::string & name) const;
+
+private:
+    struct ThreadQueue
+    {
+        std::mutex mtx;
+        std::deque<ShellTask> tasks;
+        double remaining; //!< Total cost left in this queue
+    };
+
+    std::vector<std::unique_ptr<ThreadQueue>> queues_;
+    std::vector<panacheclock::time_point> finished_; //!< When each thread ran out of work
+
+    bool Steal_(int threadnum, ShellTask & task);
+};
+
+
+} // close namespace panache
+
+#endif
+
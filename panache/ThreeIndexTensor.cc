@@ -3,6 +3,8 @@
  * \author Benjamin Pritchard (ben@bennyp.org)
  */
 
+#include <algorithm>
+#include <limits>
 
 #include "panache/ThreeIndexTensor.h"
 #include "panache/storedqtensor/StoredQTensor.h"
@@ -11,6 +13,8 @@
 #include "panache/BasisSet.h"
 #include "panache/Exception.h"
 #include "panache/Output.h"
+#include "panache/Hash.h"
+#include "panache/Lapack.h"
 
 // for reordering
 #include "panache/MemorySwapper.h"
@@ -24,12 +28,17 @@
 namespace panache
 {
 
+// Fraction of the memory limit set aside for
+// temporary buffers (ie, 4 = a quarter)
+#define MEMLIMIT_WORKSPACE_FRACTION 4
+
 ThreeIndexTensor::ThreeIndexTensor(SharedBasisSet primary,
                      const std::string & directory,
                      int qtype,
                      int bsorder,
                      int nthreads)
-    : primary_(primary), directory_(directory), qtype_(qtype), bsorder_(bsorder)
+    : primary_(primary), memlimit_(0), directory_(directory), qtype_(qtype), bsorder_(bsorder),
+      qsofinal_(false)
 {
     //remove trailing slashes
     while(directory_.size() > 1 && directory_.back() == '/')
@@ -61,11 +70,88 @@ int ThreeIndexTensor::SetNThread(int nthread)
 }
 
 
+void ThreeIndexTensor::SetMemoryLimit(size_t nbytes)
+{
+    memlimit_ = nbytes;
+}
+
+
+size_t ThreeIndexTensor::MemoryAvailable(void) const
+{
+    if(memlimit_ == 0)
+        return std::numeric_limits<size_t>::max();
+
+    // set aside for temporary buffers
+    size_t used = memlimit_ / MEMLIMIT_WORKSPACE_FRACTION;
+    for(const UniqueStoredQTensor * qt : { &qso_, &qmo_, &qoo_, &qov_, &qvv_ })
+        if(*qt)
+            used += (*qt)->MemoryUsed();
+
+    return (used < memlimit_ ? memlimit_ - used : 0);
+}
+
+
+void ThreeIndexTensor::ApplyMemoryLimit(StoredQTensor * qt) const
+{
+    if(memlimit_ > 0)
+        qt->SetWorkspace(Workspace());
+}
+
+
+size_t ThreeIndexTensor::Workspace(void) const
+{
+    if(memlimit_ > 0)
+        return memlimit_ / MEMLIMIT_WORKSPACE_FRACTION;
+    else
+        return StoredQTensor::DefaultWorkspace();
+}
+
+
+int ThreeIndexTensor::LimitedStoreFlags(int storeflags) const
+{
+    int elsewhere = QSTORAGE_ONDISK | QSTORAGE_MMAP | QSTORAGE_ONFLY;
+    #ifdef PANACHE_CYCLOPS
+    elsewhere |= QSTORAGE_CYCLOPS;
+    #endif
+
+    if(memlimit_ > 0 && !(storeflags & elsewhere))
+        storeflags |= QSTORAGE_HYBRID;
+
+    return storeflags;
+}
+
+
 
 ThreeIndexTensor::~ThreeIndexTensor()
 {
 }
 
+
+QTensorOrigin ThreeIndexTensor::Origin(bool withorbs) const
+{
+    QTensorOrigin origin;
+    origin.qtype = qtype_;
+    origin.bsorder = bsorder_;
+
+    Hasher h;
+    HashBasisSet(h, *primary_);
+    origin.inputhash = h.Value();
+
+    AddOriginOptions(origin);
+
+    if(withorbs && Cmo_)
+    {
+        Hasher ho;
+        ho.Add(static_cast<int64_t>(nmo_));
+        ho.Add(static_cast<int64_t>(nocc_));
+        ho.Add(static_cast<int64_t>(nfroz_));
+        ho.Add(Cmo_.get(), static_cast<size_t>(nso_)*nmo_*sizeof(double));
+        origin.orbhash = ho.Value();
+    }
+
+    return origin;
+}
+
 void ThreeIndexTensor::SetCMatrix(double * cmo, int nmo, bool cmo_is_trans)
 {
     if(Cmo_)
@@ -91,7 +177,10 @@ void ThreeIndexTensor::SetCMatrix(double * cmo, int nmo, bool cmo_is_trans)
 void ThreeIndexTensor::Delete(int qflags)
 {
     if(qflags & QGEN_QSO)
+    {
         qso_.reset();
+        qsofinal_ = false;
+    }
 
     if(qflags & QGEN_QMO)
         qmo_.reset();
@@ -114,8 +203,9 @@ void ThreeIndexTensor::GenQTensors(int qflags, int storeflags)
     tim.Start();
 #endif
 
-    // remove packed setting
-    storeflags &= ~QSTORAGE_PACKED;
+    // how the tensors will be stored and generated
+    QTensorPlan plan = Plan(qflags, storeflags);
+    storeflags = plan.storeflags;
 
 
     if( (!Cmo_ || nocc_ == 0) && 
@@ -133,19 +223,7 @@ void ThreeIndexTensor::GenQTensors(int qflags, int storeflags)
     // only do this stuff the first time!
     if(!qso_ || !qso_->filled())
     {
-        int qsoflags = storeflags;
-
-        // remove keep flag if Qso is not wanted
-        // this is so it isn't stored with the wrong ordering,
-        // etc
-        if(!(qflags & QGEN_QSO))
-          qsoflags &= ~QSTORAGE_KEEPDISK;
-
-        // Turn on fastdf under some circumstances
-        if(!(qflags & QGEN_QSO) && !(qflags & QGEN_QMO))
-          qsoflags |= QSTORAGE_FASTDF;
-
-        qso_ = GenQso(qsoflags); // calls the virtual function
+        qso_ = GenQso(plan.qsoflags); // calls the virtual function
 
         // Renormalize CMat if necessary
         if(bsorder_ != BSORDER_PSI4)
@@ -195,6 +273,10 @@ void ThreeIndexTensor::GenQTensors(int qflags, int storeflags)
             //    std::cout << Cmo_[i] << "\n";
         }
 
+        // Without QGEN_QSO, Qso is left without the metric
+        // and in the original ordering, and can't be used directly
+        qsofinal_ = qsofinal;
+
         // now we can split the c matrix
         // Whether we need the cmatrix or not has been checked above ^_^
         if(Cmo_)
@@ -202,66 +284,122 @@ void ThreeIndexTensor::GenQTensors(int qflags, int storeflags)
     }
     else
     {
-        // qso already existed and therefore must have been finalized
-        qsofinal = true;
+        // qso already existed. It was only finalized if it was requested
+        // then. Otherwise, the new tensors still need the metric applied.
+        qsofinal = qsofinal_;
     }
 
     std::vector<StoredQTensor::TransformMat> lefts;
     std::vector<StoredQTensor::TransformMat> rights;
     std::vector<StoredQTensor *> qouts;
 
+    // Tensors that can be taken from Qmo
+    // (if Qmo is being generated)
+    struct QmoSlice
+    {
+        StoredQTensor * qout;
+        int start1, start2;
+        StoredQTensor::TransformMat left, right;
+    };
+
+    std::vector<QmoSlice> slices;
+
+    // Add a tensor to be generated, either by slicing Qmo
+    // or by transforming Qso
+    bool newqmo = false;
+    auto AddOutput = [&](StoredQTensor * qout, int start1, int start2,
+                         StoredQTensor::TransformMat left, StoredQTensor::TransformMat right)
+    {
+        if(newqmo)
+            slices.push_back({qout, start1, start2, left, right});
+        else
+        {
+            qouts.push_back(qout);
+            lefts.push_back(left);
+            rights.push_back(right);
+        }
+    };
+
     int naux = qso_->naux();
+    QTensorOrigin moorigin = Origin(true);
 
     // The checks for filled are because they may exist on disk, etc
     if(qflags & QGEN_QMO)
     {
         // generate Qmo
-        qmo_ = StoredQTensorFactory(naux, nmo_, nmo_, storeflags | QSTORAGE_PACKED, "qmo", directory_);
+        qmo_ = StoredQTensorFactory(naux, nmo_, nmo_, storeflags | QSTORAGE_PACKED, "qmo", directory_, moorigin,
+                                    MemoryAvailable());
+        ApplyMemoryLimit(qmo_.get());
         if(!qmo_->filled())
         {
-            qouts.push_back(qmo_.get());
-            lefts.push_back(StoredQTensor::TransformMat(Cmo_.get(), nmo_));
-            rights.push_back(StoredQTensor::TransformMat(Cmo_.get(), nmo_));
+            AddOutput(qmo_.get(), 0, 0,
+                      StoredQTensor::TransformMat(Cmo_.get(), nmo_),
+                      StoredQTensor::TransformMat(Cmo_.get(), nmo_));
+            newqmo = plan.sliceqmo;
         }
     }
     if(qflags & QGEN_QOO)
     {
         // generate Qoo
-        qoo_ = StoredQTensorFactory(naux, nocc_, nocc_, storeflags | QSTORAGE_PACKED, "qoo", directory_);
+        qoo_ = StoredQTensorFactory(naux, nocc_, nocc_, storeflags | QSTORAGE_PACKED, "qoo", directory_, moorigin,
+                                    MemoryAvailable());
+        ApplyMemoryLimit(qoo_.get());
         if(!qoo_->filled())
-        {
-            qouts.push_back(qoo_.get());
-            lefts.push_back(StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_));
-            rights.push_back(StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_));
-        }
+            AddOutput(qoo_.get(), nfroz_, nfroz_,
+                      StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_),
+                      StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_));
     }
     if(qflags & QGEN_QOV)
     {
         // generate Qov
-        qov_ = StoredQTensorFactory(naux, nocc_, nvir_, storeflags, "qov", directory_);
+        qov_ = StoredQTensorFactory(naux, nocc_, nvir_, storeflags, "qov", directory_, moorigin,
+                                    MemoryAvailable());
+        ApplyMemoryLimit(qov_.get());
         if(!qov_->filled())
-        {
-            qouts.push_back(qov_.get());
-            lefts.push_back(StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_));
-            rights.push_back(StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_));
-        }
+            AddOutput(qov_.get(), nfroz_, nfroz_+nocc_,
+                      StoredQTensor::TransformMat(Cmo_occ_.get(), nocc_),
+                      StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_));
     }
     if(qflags & QGEN_QVV)
     {
         // generate Qvv
-        qvv_ = StoredQTensorFactory(naux, nvir_, nvir_, storeflags | QSTORAGE_PACKED, "qvv", directory_);
+        qvv_ = StoredQTensorFactory(naux, nvir_, nvir_, storeflags | QSTORAGE_PACKED, "qvv", directory_, moorigin,
+                                    MemoryAvailable());
+        ApplyMemoryLimit(qvv_.get());
         if(!qvv_->filled())
-        {
-            qouts.push_back(qvv_.get());
-            lefts.push_back(StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_));
-            rights.push_back(StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_));
-        }
+            AddOutput(qvv_.get(), nfroz_+nocc_, nfroz_+nocc_,
+                      StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_),
+                      StoredQTensor::TransformMat(Cmo_vir_.get(), nvir_));
     }
 
 
     if(lefts.size() > 0)
         qso_->Transform(lefts, rights, qouts, nthreads_);
 
+    // Take the others from Qmo, transforming
+    // Qso only if that isn't supported
+    if(slices.size() > 0)
+    {
+        lefts.clear();
+        rights.clear();
+        std::vector<StoredQTensor *> squouts;
+
+        for(auto & it : slices)
+        {
+            if(!qmo_->Slice(it.start1, it.start2, it.qout, nthreads_))
+            {
+                squouts.push_back(it.qout);
+                lefts.push_back(it.left);
+                rights.push_back(it.right);
+            }
+
+            qouts.push_back(it.qout);
+        }
+
+        if(lefts.size() > 0)
+            qso_->Transform(lefts, rights, squouts, nthreads_);
+    }
+
     // Erase Qso if not requested
     if(!(qflags & QGEN_QSO))
     {
@@ -289,6 +427,206 @@ void ThreeIndexTensor::GenQTensors(int qflags, int storeflags)
 }
 
 
+// Size of a symmetric matrix stored packed
+static size_t PackedSize_(int n)
+{
+    return (static_cast<size_t>(n)*(n+1))/2;
+}
+
+
+QTensorPlan ThreeIndexTensor::Plan(int qflags, int storeflags) const
+{
+    QTensorPlan plan = QTensorPlan();
+
+    // remove packed setting
+    storeflags &= ~QSTORAGE_PACKED;
+
+    // in memory if possible, but able to spill to disk
+    storeflags = LimitedStoreFlags(storeflags);
+
+    plan.qflags = qflags;
+    plan.storeflags = storeflags;
+
+    // Qso is only generated the first time
+    bool haveqso = (qso_ && qso_->filled());
+
+    if(haveqso)
+        plan.naux = qso_->naux();
+    else
+        PlanQso(plan);
+
+    double naux = plan.naux;
+
+
+    // The tensors to be generated, with the number of
+    // columns of the left and right transformation matrices
+    struct PlanOutput
+    {
+        int left, right;
+        size_t ndim12;
+    };
+
+    std::vector<PlanOutput> outputs;
+    if(qflags & QGEN_QMO)
+        outputs.push_back({nmo_, nmo_, PackedSize_(nmo_)});
+    if(qflags & QGEN_QOO)
+        outputs.push_back({nocc_, nocc_, PackedSize_(nocc_)});
+    if(qflags & QGEN_QOV)
+        outputs.push_back({nocc_, nvir_, static_cast<size_t>(nocc_)*nvir_});
+    if(qflags & QGEN_QVV)
+        outputs.push_back({nvir_, nvir_, PackedSize_(nvir_)});
+
+    size_t outsize = 0;
+    for(const auto & it : outputs)
+        outsize += it.ndim12;
+
+
+    int qsoflags = storeflags;
+
+    // remove keep flag if Qso is not wanted
+    // this is so it isn't stored with the wrong ordering,
+    // etc
+    if(!(qflags & QGEN_QSO))
+      qsoflags &= ~QSTORAGE_KEEPDISK;
+
+    // Qso is always stored in double precision
+    qsoflags &= ~QSTORAGE_FLOAT;
+
+    // Apply the metric to the transformed tensors (in memory or on disk) if they
+    // are not larger than Qso. Not if Qso or Qmo are wanted with the metric applied,
+    // or for single precision results, since rounding before applying the metric
+    // loses too much accuracy
+    if(!haveqso && !(qflags & QGEN_QSO) && !(qflags & QGEN_QMO) && !(storeflags & QSTORAGE_FLOAT)
+       && outputs.size() > 0 && outsize <= static_cast<size_t>(nsotri_))
+    {
+        qsoflags |= QSTORAGE_FASTDF;
+        plan.fastdf = true;
+        if(plan.metricflops > 0)
+            plan.metricflops = 2.0*naux*naux*outsize;
+    }
+
+    plan.qsoflags = qsoflags;
+
+    // Qmo includes all the others, which can be taken from it
+    // without any more transformation
+    plan.sliceqmo = ((qflags & QGEN_QMO) && outputs.size() > 1);
+    if(plan.sliceqmo)
+        outputs.resize(1);
+
+
+    // Transformation of each q. Qso is symmetric, so the left matrix is applied first
+    // (once for each distinct matrix), then the right one. Symmetric results only need
+    // the lower triangle.
+    double nso = nso_;
+    double perqflops = 0.0;
+    std::vector<int> firsts;
+
+    for(const auto & it : outputs)
+    {
+        if(std::find(firsts.begin(), firsts.end(), it.left) == firsts.end())
+        {
+            firsts.push_back(it.left);
+            perqflops += 2.0*nso*nso*it.left;
+        }
+
+        if(it.left == it.right)
+            perqflops += nso*it.left*(it.left+1);
+        else
+            perqflops += 2.0*nso*it.left*it.right;
+    }
+
+    // Qso is reordered by transforming it with a permutation
+    bool reorder = (!haveqso && (qflags & QGEN_QSO) && bsorder_ != BSORDER_PSI4);
+    if(reorder)
+        perqflops += 2.0*nso*nso*nso + nso*nso*(nso+1);
+
+    plan.transformflops = naux*perqflops;
+
+
+    // Where each tensor is stored, in the order they are created. Tensors
+    // that can spill to disk get whatever memory is left
+    size_t avail = MemoryAvailable();
+    bool outspill = false;
+
+    auto Place = [&](size_t nbytes, int flags) -> size_t
+    {
+        if(flags & QSTORAGE_ONFLY)
+            return 0;
+
+        if(flags & (QSTORAGE_ONDISK | QSTORAGE_MMAP))
+        {
+            plan.diskusage += nbytes;
+            return nbytes;
+        }
+
+        size_t inmem = nbytes;
+        if(flags & QSTORAGE_HYBRID)
+            inmem = std::min(nbytes, avail);
+
+        avail -= std::min(avail, inmem);
+        plan.peakmemory += inmem;
+        plan.diskusage += nbytes - inmem;
+        return nbytes - inmem;
+    };
+
+    size_t qsobytes = sizeof(double)*plan.naux*static_cast<size_t>(nsotri_);
+
+    if(!haveqso)
+    {
+        Place(qsobytes, qsoflags);
+
+        // reordered copy
+        if(reorder)
+            Place(qsobytes, qsoflags);
+    }
+
+    size_t elsize = (storeflags & QSTORAGE_FLOAT) ? sizeof(float) : sizeof(double);
+
+    if(qflags & QGEN_QMO)
+        outspill |= (Place(elsize*plan.naux*PackedSize_(nmo_), storeflags) > 0);
+    if(qflags & QGEN_QOO)
+        outspill |= (Place(elsize*plan.naux*PackedSize_(nocc_), storeflags) > 0);
+    if(qflags & QGEN_QOV)
+        outspill |= (Place(elsize*plan.naux*nocc_*nvir_, storeflags) > 0);
+    if(qflags & QGEN_QVV)
+        outspill |= (Place(elsize*plan.naux*PackedSize_(nvir_), storeflags) > 0);
+
+    // The transformed tensors are written a batch of q at a time,
+    // which is contiguous on disk if they are stored by q
+    plan.byq = outspill;
+
+
+    // Temporary buffers are limited to the workspace, except that a
+    // batch of at least one q is always transformed at a time
+    size_t ws = Workspace();
+    size_t scratch = std::min(ws, qsobytes);
+
+    if(outputs.size() > 0 || reorder)
+    {
+        int maxf = (reorder ? nso_ : 0);
+        size_t perqout = 0;
+        for(const auto & it : outputs)
+        {
+            maxf = std::max(maxf, it.left);
+            perqout += it.ndim12;
+        }
+
+        size_t perq = sizeof(double)*(static_cast<size_t>(nso_)*(nso_ + maxf) + nsotri_ + perqout);
+        if(reorder)
+            perq += sizeof(double)*nsotri_;
+
+        plan.transformbatch = static_cast<int>(std::min(ws / perq, static_cast<size_t>(plan.naux)));
+        plan.transformbatch = std::max(1, plan.transformbatch);
+
+        scratch = std::max(scratch, plan.transformbatch*perq);
+    }
+
+    plan.peakmemory += scratch;
+
+    return plan;
+}
+
+
 void ThreeIndexTensor::ReorderQso(void)
 {
     std::vector<StoredQTensor::TransformMat> leftright;
@@ -315,7 +653,9 @@ void ThreeIndexTensor::ReorderQso(void)
     auto newqso = StoredQTensorFactory(qso_->naux(),
                                        qso_->ndim1(),
                                        qso_->ndim2(),
-                                       qso_->storeflags(), "qso2", directory_); 
+                                       qso_->storeflags(), "qso2", directory_,
+                                       Origin(false), MemoryAvailable());
+    ApplyMemoryLimit(newqso.get());
     qouts.push_back(newqso.get());
     qso_->Transform(leftright, leftright, qouts, nthreads_);
 
@@ -326,7 +666,8 @@ void ThreeIndexTensor::ReorderQso(void)
 }
 
 
-int ThreeIndexTensor::GetQBatch_Base(double * outbuf, int bufsize, int qstart,
+template<typename T>
+int ThreeIndexTensor::GetQBatch_Base(T * outbuf, size_t bufsize, int qstart,
                                     const UniqueStoredQTensor & qt)
 {
 #ifdef PANACHE_TIMING
@@ -334,13 +675,16 @@ int ThreeIndexTensor::GetQBatch_Base(double * outbuf, int bufsize, int qstart,
     tim.Start();
 #endif
 
-    int nq = (bufsize / qt->ndim12());
+    size_t nq = (bufsize / qt->ndim12());
 
     if(nq == 0)
         throw RuntimeError("Error - buffer is to small to hold even one batch!");
 
+    // buffer may hold more than the whole tensor
+    nq = std::min(nq, static_cast<size_t>(qt->naux()));
+
     // get a batch
-    int gotten = qt->ReadByQ(outbuf, nq, qstart);
+    int gotten = qt->ReadByQ(outbuf, static_cast<int>(nq), qstart);
 
 #ifdef PANACHE_TIMING
     tim.Stop();
@@ -351,7 +695,8 @@ int ThreeIndexTensor::GetQBatch_Base(double * outbuf, int bufsize, int qstart,
 }
 
 
-int ThreeIndexTensor::GetBatch_Base(double * outbuf, int bufsize, int ijstart,
+template<typename T>
+int ThreeIndexTensor::GetBatch_Base(T * outbuf, size_t bufsize, int ijstart,
                                     const UniqueStoredQTensor & qt)
 {
 #ifdef PANACHE_TIMING
@@ -359,13 +704,16 @@ int ThreeIndexTensor::GetBatch_Base(double * outbuf, int bufsize, int ijstart,
     tim.Start();
 #endif
 
-    int nij = (bufsize / qt->naux());
+    size_t nij = (bufsize / qt->naux());
 
     if(nij == 0)
         throw RuntimeError("Error - buffer is to small to hold even one batch!");
 
+    // buffer may hold more than the whole tensor
+    nij = std::min(nij, static_cast<size_t>(qt->ndim12()));
+
     // get a batch
-    int gotten = qt->Read(outbuf, nij, ijstart);
+    int gotten = qt->Read(outbuf, static_cast<int>(nij), ijstart);
 
 #ifdef PANACHE_TIMING
     tim.Stop();
@@ -396,18 +744,219 @@ UniqueStoredQTensor & ThreeIndexTensor::ResolveTensorFlag(int tensorflag)
 }
 
 
-int ThreeIndexTensor::GetQBatch(int tensorflag, double * outbuf, int bufsize, int qstart)
+int ThreeIndexTensor::GetQBatch(int tensorflag, double * outbuf, size_t bufsize, int qstart)
+{
+    return GetQBatch_Base(outbuf, bufsize, qstart, ResolveTensorFlag(tensorflag));
+}
+
+int ThreeIndexTensor::GetBatch(int tensorflag, double * outbuf, size_t bufsize, int ijstart)
+{
+    return GetBatch_Base(outbuf, bufsize, ijstart, ResolveTensorFlag(tensorflag));
+}
+
+
+int ThreeIndexTensor::GetQBatch(int tensorflag, float * outbuf, size_t bufsize, int qstart)
 {
     return GetQBatch_Base(outbuf, bufsize, qstart, ResolveTensorFlag(tensorflag));
 }
 
-int ThreeIndexTensor::GetBatch(int tensorflag, double * outbuf, int bufsize, int ijstart)
+int ThreeIndexTensor::GetBatch(int tensorflag, float * outbuf, size_t bufsize, int ijstart)
 {
     return GetBatch_Base(outbuf, bufsize, ijstart, ResolveTensorFlag(tensorflag));
 }
 
 
-int ThreeIndexTensor::GetQBatch(int tensorflag, double * outbuf, int bufsize, QIterator qstart)
+void ThreeIndexTensor::GetBlock(int tensorflag, double * outbuf, size_t bufsize,
+                                int istart, int ni, int jstart, int nj, int qstart, int nq)
+{
+    const UniqueStoredQTensor & qt = ResolveTensorFlag(tensorflag);
+
+    if(static_cast<size_t>(ni)*nj*nq > bufsize)
+        throw RuntimeError("Error - buffer is to small to hold the block!");
+
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    qt->ReadBlock(outbuf, istart, ni, jstart, nj, qstart, nq);
+
+#ifdef PANACHE_TIMING
+    tim.Stop();
+    qt->GetBatchTimer().AddTime(tim);
+#endif
+}
+
+
+void ThreeIndexTensor::GetGather(int tensorflag, double * outbuf, size_t bufsize,
+                                 const int * ij, int nij, int qstart, int nq)
+{
+    const UniqueStoredQTensor & qt = ResolveTensorFlag(tensorflag);
+
+    if(static_cast<size_t>(nij)*nq > bufsize)
+        throw RuntimeError("Error - buffer is to small to hold the data!");
+
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    qt->Gather(outbuf, ij, nij, qstart, nq);
+
+#ifdef PANACHE_TIMING
+    tim.Stop();
+    qt->GetBatchTimer().AddTime(tim);
+#endif
+}
+
+
+void ThreeIndexTensor::GetFourIndex(int tensorflag1, int tensorflag2, double * outbuf, size_t bufsize,
+                                    int istart, int ni, int jstart, int nj,
+                                    int kstart, int nk, int lstart, int nl)
+{
+    const UniqueStoredQTensor & qt1 = ResolveTensorFlag(tensorflag1);
+    const UniqueStoredQTensor & qt2 = ResolveTensorFlag(tensorflag2);
+
+    if(qt1->naux() != qt2->naux())
+        throw RuntimeError("Error - tensors have different numbers of auxiliary functions!");
+
+    const int naux = qt1->naux();
+    const int nij = ni*nj;
+    const int nkl = nk*nl;
+
+    if(static_cast<size_t>(nij)*nkl > bufsize)
+        throw RuntimeError("Error - buffer is to small to hold the integrals!");
+
+    std::fill(outbuf, outbuf + static_cast<size_t>(nij)*nkl, 0.0);
+
+    if(nij == 0 || nkl == 0)
+        return;
+
+    // The same block is only read once
+    bool same = (qt1.get() == qt2.get() && istart == kstart && ni == nk && jstart == lstart && nj == nl);
+
+    // Auxiliary indices in a batch
+    size_t perq = sizeof(double)*(same ? nij : nij + nkl);
+    size_t nfit = std::max(static_cast<size_t>(1), Workspace() / perq);
+    int nqbatch = static_cast<int>(std::min(nfit, static_cast<size_t>(naux)));
+
+    std::unique_ptr<double[]> buf1(new double[static_cast<size_t>(nqbatch)*nij]);
+    std::unique_ptr<double[]> buf2(new double[same ? 0 : static_cast<size_t>(nqbatch)*nkl]);
+    double * b1 = buf1.get();
+    double * b2 = (same ? b1 : buf2.get());
+
+    // rows of the output for each thread
+    int nthreads = nthreads_;
+    int nrow = (nij + nthreads - 1) / nthreads;
+
+    for(int q0 = 0; q0 < naux; q0 += nqbatch)
+    {
+        int nq = std::min(nqbatch, naux - q0);
+
+        // blocks are (ij, q), with q the fastest index
+        GetBlock(tensorflag1, b1, static_cast<size_t>(nq)*nij, istart, ni, jstart, nj, q0, nq);
+        if(!same)
+            GetBlock(tensorflag2, b2, static_cast<size_t>(nq)*nkl, kstart, nk, lstart, nl, q0, nq);
+
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(static) num_threads(nthreads)
+        #endif
+        for(int r0 = 0; r0 < nij; r0 += nrow)
+        {
+            int nr = std::min(nrow, nij - r0);
+            C_DGEMM('N', 'T', nr, nkl, nq, 1.0, b1 + static_cast<size_t>(r0)*nq, nq,
+                    b2, nq, 1.0, outbuf + static_cast<size_t>(r0)*nkl, nkl);
+        }
+    }
+}
+
+
+QTensorHandle ThreeIndexTensor::Handle(int tensorflag)
+{
+    const UniqueStoredQTensor & qt = ResolveTensorFlag(tensorflag);
+
+    if(!qt || !qt->filled())
+        throw RuntimeError("Error - tensor has not been generated");
+
+    return QTensorHandle(qt.get());
+}
+
+
+int ThreeIndexTensor::GetQBatchView(int tensorflag, const double *& data, double * outbuf, size_t bufsize, int qstart)
+{
+    const UniqueStoredQTensor & qt = ResolveTensorFlag(tensorflag);
+
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    // same number of batches as GetQBatch()
+    size_t nq = (bufsize / qt->ndim12());
+
+    if(nq == 0)
+        throw RuntimeError("Error - buffer is to small to hold even one batch!");
+
+    nq = std::min(nq, static_cast<size_t>(qt->naux()));
+
+    int gotten = qt->ViewByQ(data, static_cast<int>(nq), qstart);
+
+    if(data)
+    {
+#ifdef PANACHE_TIMING
+        tim.Stop();
+        qt->GetQBatchTimer().AddTime(tim);
+#endif
+        return gotten;
+    }
+
+    // can't be viewed - copy it
+    if(outbuf == nullptr)
+        throw RuntimeError("Error - tensor can't be viewed directly, and no buffer was given");
+
+    data = outbuf;
+    return GetQBatch_Base(outbuf, bufsize, qstart, qt);
+}
+
+
+int ThreeIndexTensor::GetBatchView(int tensorflag, const double *& data, double * outbuf, size_t bufsize, int ijstart)
+{
+    const UniqueStoredQTensor & qt = ResolveTensorFlag(tensorflag);
+
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    // same number of batches as GetBatch()
+    size_t nij = (bufsize / qt->naux());
+
+    if(nij == 0)
+        throw RuntimeError("Error - buffer is to small to hold even one batch!");
+
+    nij = std::min(nij, static_cast<size_t>(qt->ndim12()));
+
+    int gotten = qt->View(data, static_cast<int>(nij), ijstart);
+
+    if(data)
+    {
+#ifdef PANACHE_TIMING
+        tim.Stop();
+        qt->GetBatchTimer().AddTime(tim);
+#endif
+        return gotten;
+    }
+
+    // can't be viewed - copy it
+    if(outbuf == nullptr)
+        throw RuntimeError("Error - tensor can't be viewed directly, and no buffer was given");
+
+    data = outbuf;
+    return GetBatch_Base(outbuf, bufsize, ijstart, qt);
+}
+
+
+int ThreeIndexTensor::GetQBatch(int tensorflag, double * outbuf, size_t bufsize, QIterator qstart)
 {
     if(qstart)
         return GetQBatch_Base(outbuf, bufsize, qstart.Index(), ResolveTensorFlag(tensorflag));
@@ -415,7 +964,7 @@ int ThreeIndexTensor::GetQBatch(int tensorflag, double * outbuf, int bufsize, QI
         return 0;
 }
 
-int ThreeIndexTensor::GetBatch(int tensorflag, double * outbuf, int bufsize, IJIterator ijstart)
+int ThreeIndexTensor::GetBatch(int tensorflag, double * outbuf, size_t bufsize, IJIterator ijstart)
 {
     if(ijstart)
         return GetBatch_Base(outbuf, bufsize, ijstart.Index(), ResolveTensorFlag(tensorflag));
@@ -435,13 +984,13 @@ int ThreeIndexTensor::BatchSize(int tensorflag)
     return ResolveTensorFlag(tensorflag)->naux();
 }
 
-int ThreeIndexTensor::TensorDimensions(int tensorflag, int & naux, int & ndim1, int & ndim2)
+size_t ThreeIndexTensor::TensorDimensions(int tensorflag, int & naux, int & ndim1, int & ndim2)
 {
     auto & qt = ResolveTensorFlag(tensorflag);
     naux = qt->naux();
     ndim1 = qt->ndim1();
     ndim2 = qt->ndim2();
-    return qt->naux() * qt->ndim12();
+    return static_cast<size_t>(qt->naux()) * qt->ndim12();
 }
 
 
@@ -450,6 +999,11 @@ bool ThreeIndexTensor::IsPacked(int tensorflag)
     return ResolveTensorFlag(tensorflag)->packed();
 }
 
+bool ThreeIndexTensor::IsFloat(int tensorflag)
+{
+    return ResolveTensorFlag(tensorflag)->isfloat();
+}
+
 int ThreeIndexTensor::CalcIndex(int tensorflag, int i, int j)
 {
     return ResolveTensorFlag(tensorflag)->calcindex(i, j);
@@ -703,48 +1257,346 @@ void ThreeIndexTensor::PrintTimings(void) const
 }
 
 
-ThreeIndexTensor::IteratedQTensorByQ ThreeIndexTensor::IterateByQ(int tensorflag, double * buf, int bufsize)
+BatchPrefetcher::FetchFunc ThreeIndexTensor::QBatchFetchFunc(int tensorflag, size_t bufsize)
 {
-    using std::placeholders::_1;
+    // the tensor flag is only resolved once
+    QTensorHandle h = Handle(tensorflag);
+    return [h, bufsize](double * buf, int qstart)
+    {
+        return h.GetQBatch(buf, bufsize, qstart);
+    };
+}
 
-    // ugly
-    IteratedQTensorByQ::GetBatchFunc gbf(std::bind(
-                                   static_cast<int(ThreeIndexTensor::*)(int, double *, int, int)>(&ThreeIndexTensor::GetQBatch),
-                                   this, tensorflag, buf, bufsize, _1));
 
+BatchPrefetcher::FetchFunc ThreeIndexTensor::BatchFetchFunc(int tensorflag, size_t bufsize)
+{
+    QTensorHandle h = Handle(tensorflag);
+    return [h, bufsize](double * buf, int ijstart)
+    {
+        return h.GetBatch(buf, bufsize, ijstart);
+    };
+}
+
+
+ThreeIndexTensor::IteratedQTensorByQ ThreeIndexTensor::IterateByQ(int tensorflag, double * buf, size_t bufsize, int depth)
+{
     int ndim1, ndim2, naux;
     TensorDimensions(tensorflag, naux, ndim1, ndim2);
 
     IteratedQTensorByQ iqt(tensorflag, buf, bufsize, 
-                           QBatchSize(tensorflag),
+                           QBatchSize(tensorflag), naux,
                            QIterator(naux, IsPacked(tensorflag)),
-                           gbf);
+                           QBatchFetchFunc(tensorflag, bufsize), depth);
 
     return iqt;
 }
 
 
-ThreeIndexTensor::IteratedQTensorByIJ ThreeIndexTensor::IterateByIJ(int tensorflag, double * buf, int bufsize)
+ThreeIndexTensor::IteratedQTensorByIJ ThreeIndexTensor::IterateByIJ(int tensorflag, double * buf, size_t bufsize, int depth)
 {
-    using std::placeholders::_1;
-
-    // ugly
-    IteratedQTensorByIJ::GetBatchFunc gbf(std::bind(
-                                   static_cast<int(ThreeIndexTensor::*)(int, double *, int, int)>(&ThreeIndexTensor::GetBatch),
-                                   this, tensorflag, buf, bufsize, _1));
-
     int ndim1, ndim2, naux;
     TensorDimensions(tensorflag, naux, ndim1, ndim2);
 
     IteratedQTensorByIJ iqt(tensorflag, buf, bufsize, 
-                            BatchSize(tensorflag),
+                            BatchSize(tensorflag), QBatchSize(tensorflag),
                             IJIterator(ndim1, ndim2, IsPacked(tensorflag)),
-                            gbf);
+                            BatchFetchFunc(tensorflag, bufsize), depth);
 
     return iqt;
 }
 
 
+std::unique_ptr<BatchPrefetcher> ThreeIndexTensor::PrefetchQBatches(int tensorflag, double * buf, size_t bufsize, int depth)
+{
+    return std::unique_ptr<BatchPrefetcher>(new BatchPrefetcher(QBatchFetchFunc(tensorflag, bufsize),
+                                                                buf, bufsize, QBatchSize(tensorflag),
+                                                                BatchSize(tensorflag), depth));
+}
+
+
+std::unique_ptr<BatchPrefetcher> ThreeIndexTensor::PrefetchBatches(int tensorflag, double * buf, size_t bufsize, int depth)
+{
+    return std::unique_ptr<BatchPrefetcher>(new BatchPrefetcher(BatchFetchFunc(tensorflag, bufsize),
+                                                                buf, bufsize, BatchSize(tensorflag),
+                                                                QBatchSize(tensorflag), depth));
+}
+
+
+double ThreeIndexTensor::DFMP2Energy(const double * orben, double & esame, double & eopp)
+{
+    if(!qov_ || !qov_->filled())
+        throw RuntimeError("Error - Qov must be generated before calculating the MP2 energy");
+
+    // no (ia|jb) integrals without virtual orbitals
+    esame = eopp = 0.0;
+    if(nocc_ == 0 || nvir_ == 0)
+        return 0.0;
+
+    const int naux = qov_->naux();
+    const int nocc = nocc_;
+    const int nvir = nvir_;
+    const size_t ovsize = static_cast<size_t>(nvir)*naux;  // (a|Q) for a single i
+    const double * eocc = orben + nfroz_;
+    const double * evir = orben + nfroz_ + nocc_;
+
+    int nthreads = nthreads_;
+
+    // Occupied orbitals in a block. Two blocks of (ia|Q), plus
+    // (ia|jb) for one i and a whole block of j for each thread
+    size_t perocc = sizeof(double)*(2*ovsize + static_cast<size_t>(nthreads)*nvir*nvir);
+    size_t nfit = std::max(static_cast<size_t>(1), Workspace() / perocc);
+    int nblock = static_cast<int>(std::min(nfit, static_cast<size_t>(nocc)));
+
+    std::unique_ptr<double[]> ibuf(new double[nblock*ovsize]);
+    std::unique_ptr<double[]> jbuf(new double[nblock*ovsize]);
+    std::unique_ptr<double[]> iajb(new double[static_cast<size_t>(nthreads)*nblock*nvir*nvir]);
+
+    // Qov is stored with i as the slowest index, so a block of i is a
+    // contiguous range of ia. It may be used directly if in memory.
+    auto ReadBlock = [&](double * buf, int i0, int ni) -> const double *
+    {
+        const double * data;
+        GetBatchView(QGEN_QOV, data, buf, ni*ovsize, i0*nvir);
+        return data;
+    };
+
+    double es = 0.0;
+    double eo = 0.0;
+
+    for(int i0 = 0; i0 < nocc; i0 += nblock)
+    {
+        int ni = std::min(nblock, nocc - i0);
+        const double * iblock = ReadBlock(ibuf.get(), i0, ni);
+
+        // pairs with j <= i, counted twice if j < i
+        for(int j0 = 0; j0 <= i0; j0 += nblock)
+        {
+            int nj = std::min(nblock, nocc - j0);
+            const double * jblock = (j0 == i0 ? iblock : ReadBlock(jbuf.get(), j0, nj));
+            int njv = nj*nvir;
+
+            #ifdef _OPENMP
+            #pragma omp parallel for schedule(dynamic) num_threads(nthreads) reduction(+:es,eo)
+            #endif
+            for(int i = 0; i < ni; i++)
+            {
+                int threadnum = 0;
+                #ifdef _OPENMP
+                threadnum = omp_get_thread_num();
+                #endif
+
+                // (ia|jb) for this i, with the (a, jb) index
+                double * ints = iajb.get() + static_cast<size_t>(threadnum)*nblock*nvir*nvir;
+                C_DGEMM('N', 'T', nvir, njv, naux, 1.0, const_cast<double *>(iblock) + i*ovsize, naux,
+                        const_cast<double *>(jblock), naux, 0.0, ints, njv);
+
+                int ii = i0 + i;
+                int jmax = std::min(nj, ii - j0 + 1);
+
+                for(int j = 0; j < jmax; j++)
+                {
+                    int jj = j0 + j;
+                    double perm = (ii == jj ? 1.0 : 2.0);
+                    double eij = eocc[ii] + eocc[jj];
+
+                    for(int a = 0; a < nvir; a++)
+                    for(int b = 0; b < nvir; b++)
+                    {
+                        double iajbval = ints[static_cast<size_t>(a)*njv + j*nvir + b];
+                        double ibjaval = ints[static_cast<size_t>(b)*njv + j*nvir + a];
+                        double denom = eij - evir[a] - evir[b];
+
+                        eo += perm*(iajbval*iajbval)/denom;
+                        es += perm*(iajbval*(iajbval-ibjaval))/denom;
+                    }
+                }
+            }
+        }
+    }
+
+    esame = es;
+    eopp = eo;
+    return es + eo;
+}
+
+
+void ThreeIndexTensor::BuildJK(int ndens, const double * const * cocc, const int * nocc,
+                               double * const * J, double * const * K)
+{
+    // J needs the densities themselves
+    std::vector<std::unique_ptr<double[]>> dmats(ndens);
+    std::vector<const double *> dens(ndens, nullptr);
+
+    for(int k = 0; k < ndens; k++)
+    {
+        if(J[k] == nullptr)
+            continue;
+
+        dmats[k] = std::unique_ptr<double[]>(new double[nso2_]);
+        dens[k] = dmats[k].get();
+
+        if(nocc[k] > 0)
+            C_DGEMM('N', 'T', nso_, nso_, nocc[k], 1.0, const_cast<double *>(cocc[k]), nocc[k],
+                    const_cast<double *>(cocc[k]), nocc[k], 0.0, dmats[k].get(), nso_);
+        else
+            std::fill(dmats[k].get(), dmats[k].get() + nso2_, 0.0);
+    }
+
+    JK_(ndens, dens.data(), cocc, nocc, J, K);
+}
+
+
+void ThreeIndexTensor::BuildJ(int ndens, const double * const * dens, double * const * J)
+{
+    JK_(ndens, dens, nullptr, nullptr, J, nullptr);
+}
+
+
+void ThreeIndexTensor::JK_(int ndens, const double * const * dens, const double * const * cocc,
+                           const int * nocc, double * const * J, double * const * K)
+{
+    if(!qso_ || !qso_->filled())
+        throw RuntimeError("Error - Qso must be generated before building J and K");
+
+    if(!qsofinal_)
+        throw RuntimeError("Error - Qso must be generated with QGEN_QSO before building J and K");
+
+    const int naux = qso_->naux();
+    const int nso = nso_;
+    const size_t nsotri = nsotri_;
+    const size_t nso2 = nso2_;
+
+    // Which densities need J and K
+    std::vector<int> jlist, klist;
+    size_t sumocc = 0;
+
+    for(int k = 0; k < ndens; k++)
+    {
+        if(J[k] != nullptr)
+            jlist.push_back(k);
+        if(K != nullptr && K[k] != nullptr)
+        {
+            if(nocc[k] > 0)
+            {
+                klist.push_back(k);
+                sumocc += nocc[k];
+            }
+            else
+                std::fill(K[k], K[k] + nso2, 0.0);
+        }
+    }
+
+    const int nj = static_cast<int>(jlist.size());
+    const int nk = static_cast<int>(klist.size());
+
+    if(nj == 0 && nk == 0)
+        return;
+
+    int nthreads = nthreads_;
+
+    // Packed densities (off-diagonal elements counted twice), and packed J
+    std::unique_ptr<double[]> dpack(new double[nj*nsotri]);
+    std::unique_ptr<double[]> jpack(new double[nj*nsotri]);
+    std::fill(jpack.get(), jpack.get() + nj*nsotri, 0.0);
+
+    for(int n = 0; n < nj; n++)
+    {
+        const double * d = dens[jlist[n]];
+        double * dp = dpack.get() + n*nsotri;
+
+        for(int i = 0, ij = 0; i < nso; i++)
+        {
+            for(int j = 0; j < i; j++, ij++)
+                dp[ij] = d[i*nso+j] + d[j*nso+i];
+            dp[ij++] = d[i*nso+i];
+        }
+    }
+
+    for(int n = 0; n < nk; n++)
+        std::fill(K[klist[n]], K[klist[n]] + nso2, 0.0);
+
+    // Auxiliary indices in a batch. For each, the packed (Q|mu nu), the fitting
+    // coefficients for J, and the half-transformed (Q|i nu) for K. Each thread
+    // also unpacks (Q|mu nu).
+    size_t perq = sizeof(double)*(nsotri + nj + sumocc*nso);
+    size_t unpacked = (nk > 0 ? sizeof(double)*nthreads*nso2 : 0);
+    size_t ws = Workspace();
+    size_t nfit = (ws > unpacked ? (ws - unpacked) / perq : 0);
+    int nqbatch = static_cast<int>(std::min(std::max(nfit, static_cast<size_t>(1)),
+                                            static_cast<size_t>(naux)));
+
+    std::unique_ptr<double[]> qbuf(new double[nqbatch*nsotri]);
+    std::unique_ptr<double[]> dq(new double[nqbatch*nj]);
+    std::unique_ptr<double[]> xbuf(new double[nqbatch*sumocc*nso]);
+    std::unique_ptr<double[]> qmat(new double[nk > 0 ? nthreads*nso2 : 0]);
+
+    // start of the (Q|i nu) for each density
+    std::vector<double *> xk(nk);
+    for(int n = 0, off = 0; n < nk; off += nocc[klist[n]], n++)
+        xk[n] = xbuf.get() + static_cast<size_t>(nqbatch)*off*nso;
+
+    const double * qdata;
+    int nq;
+
+    for(int q0 = 0; (nq = GetQBatchView(QGEN_QSO, qdata, qbuf.get(), nqbatch*nsotri, q0)) > 0; q0 += nq)
+    {
+        double * qd = const_cast<double *>(qdata);
+
+        // J: d_Q = sum (Q|mu nu) D_mu nu, then J_mu nu += sum d_Q (Q|mu nu)
+        if(nj > 0)
+        {
+            C_DGEMM('N', 'T', nq, nj, nsotri, 1.0, qd, nsotri, dpack.get(), nsotri, 0.0, dq.get(), nj);
+            C_DGEMM('T', 'N', nj, nsotri, nq, 1.0, dq.get(), nj, qd, nsotri, 1.0, jpack.get(), nsotri);
+        }
+
+        if(nk == 0)
+            continue;
+
+        // K: (Q|i nu) = sum C_mu i (Q|mu nu) for each Q in the batch
+        #ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+        #endif
+        for(int q = 0; q < nq; q++)
+        {
+            int threadnum = 0;
+            #ifdef _OPENMP
+            threadnum = omp_get_thread_num();
+            #endif
+
+            const double * qp = qdata + q*nsotri;
+            double * qm = qmat.get() + threadnum*nso2;
+
+            for(int i = 0, ij = 0; i < nso; i++)
+            for(int j = 0; j <= i; j++, ij++)
+                qm[i*nso+j] = qm[j*nso+i] = qp[ij];
+
+            for(int n = 0; n < nk; n++)
+            {
+                int no = nocc[klist[n]];
+                C_DGEMM('T', 'N', no, nso, nso, 1.0, const_cast<double *>(cocc[klist[n]]), no,
+                        qm, nso, 0.0, xk[n] + static_cast<size_t>(q)*no*nso, nso);
+            }
+        }
+
+        // K_mu nu += sum over Q and i of (Q|i mu)(Q|i nu)
+        for(int n = 0; n < nk; n++)
+        {
+            int nqi = nq*nocc[klist[n]];
+            C_DGEMM('T', 'N', nso, nso, nqi, 1.0, xk[n], nso, xk[n], nso, 1.0, K[klist[n]], nso);
+        }
+    }
+
+    for(int n = 0; n < nj; n++)
+    {
+        const double * jp = jpack.get() + n*nsotri;
+        double * jm = J[jlist[n]];
+
+        for(int i = 0, ij = 0; i < nso; i++)
+        for(int j = 0; j <= i; j++, ij++)
+            jm[i*nso+j] = jm[j*nso+i] = jp[ij];
+    }
+}
+
 } // close namespace panache
 
 
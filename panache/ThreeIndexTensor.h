@@ -9,10 +9,13 @@
 #include <vector>
 #include <memory>
 #include <string>
+#include <functional>
 
 #include "panache/Timing.h"
 #include "panache/Flags.h"
 #include "panache/Iterator.h"
+#include "panache/BatchPrefetcher.h"
+#include "panache/QTensorHandle.h"
 
 namespace panache
 {
@@ -23,6 +26,7 @@ typedef std::shared_ptr<BasisSet> SharedBasisSet;
 class TwoBodyAOInt;
 class StoredQTensor;
 typedef std::unique_ptr<StoredQTensor> UniqueStoredQTensor;
+struct QTensorOrigin;
 
 namespace reorder
 {
@@ -31,6 +35,32 @@ class CNorm;
 }
 
 
+/*!
+ *   \brief Predicted resources and chosen options for generating tensors
+ *
+ *   Returned by ThreeIndexTensor::Plan(). Sizes are in bytes, and are
+ *   estimates (for cholesky, the number of auxiliary functions is not known
+ *   until the decomposition is done).
+ */
+struct QTensorPlan
+{
+    int qflags;          //!< Tensors to generate
+    int storeflags;      //!< How the requested tensors will be stored
+    int qsoflags;        //!< How Qso will be stored
+    bool fastdf;         //!< The metric is applied after transformation (QSTORAGE_FASTDF)
+    bool sliceqmo;       //!< Other tensors are taken from Qmo (staged) rather than transformed from Qso with it (fused)
+    bool byq;            //!< Storing by Q (QSTORAGE_BYQ) would be cheaper to generate
+    int naux;            //!< Number of auxiliary functions
+    int transformbatch;  //!< Number of auxiliary indices transformed at a time
+
+    size_t peakmemory;   //!< Peak memory (stored tensors, metric, and temporary buffers)
+    size_t diskusage;    //!< Disk space used by the tensors
+    double nintegrals;   //!< Number of integrals computed
+    double transformflops; //!< Floating point operations for transforming Qso
+    double metricflops;    //!< Floating point operations for applying the metric
+};
+
+
 /*!
  *   \brief A generic three-index tensor
  *
@@ -49,7 +79,8 @@ public:
      * Initializes the basis set shared pointer and other information
      *
      * \param [in] primary The primary basis set
-     * \param [in] directory Full path to a directory to put scratch files
+     * \param [in] directory Full path to a directory to put scratch files (or several, separated
+     *                       by ':', to stripe tensors stored on disk across)
      * \param [in] qtype The type of tensor stored (Cholesky, DF, may include various options)
      * \param [in] bsorder The ordering of basis functions (PSI4, GAMESS, etc)
      * \param [in] nthreads Max number of threads to use
@@ -125,6 +156,26 @@ public:
     int SetNThread(int nthread);
 
 
+    /*!
+     * \brief Sets the memory available for generating and storing tensors
+     *
+     * A quarter of the limit is set aside for the temporary buffers used while generating
+     * tensors. Batch sizes (and, if needed, the number of threads) are reduced so that
+     * the buffers fit. The rest is for storing the tensors.
+     *
+     * With a limit, tensors that would be stored in memory are stored as with QSTORAGE_HYBRID.
+     * Each keeps as much of itself in memory as fits in what is left (after the other tensors
+     * already stored), and stores the rest on disk in the directory given to the constructor.
+     *
+     * Memory for the fitting metric and integral buffers is not included.
+     *
+     * Set to zero (the default) for no limit.
+     *
+     * \param [in] nbytes Memory available (in bytes)
+     */
+    void SetMemoryLimit(size_t nbytes);
+
+
 
     /*!
      * \brief Prints out timing information collected so far
@@ -164,6 +215,25 @@ public:
 
 
 
+    /*!
+     * \brief Plan the generation of tensors, without generating anything
+     *
+     * Predicts the memory, disk, integrals, and floating point operations that GenQTensors()
+     * would use with the same arguments, and decides how they will be generated (whether the
+     * metric is applied before or after transformation, and whether tensors are taken from Qmo
+     * or transformed separately). GenQTensors() follows the same plan.
+     *
+     * The prediction assumes nothing has been generated yet (or read from disk), except for
+     * Qso if it already exists.
+     *
+     * \param [in] qflags A combination of flags specifying which tensors to generate
+     * \param [in] storeflags How to store the matrix
+     * \return The plan
+     */
+    QTensorPlan Plan(int qflags, int storeflags) const;
+
+
+
     /*!
      * \brief Delete the given tensor
      *
@@ -188,7 +258,7 @@ public:
      * \param [out] ndim2 Second dimension
      * \return Total tensor size (depends on packing)
      */
-    int TensorDimensions(int tensorflag, int & naux, int & ndim1, int & ndim2);
+    size_t TensorDimensions(int tensorflag, int & naux, int & ndim1, int & ndim2);
 
 
 
@@ -234,6 +304,16 @@ public:
 
 
 
+    /*!
+     * \brief See if a particular tensor is stored in single precision
+     *
+     * \param [in] tensorflag Which tensor to query (see Flags.h)
+     * \return True if the tensor is stored in single precision (QSTORAGE_FLOAT)
+     */
+    bool IsFloat(int tensorflag);
+
+
+
     /*!
      * \brief Calculate a combined orbital index
      *
@@ -262,20 +342,24 @@ public:
      * Call this and process the batches, incrementing qstart by the return value,
      * until this function returns zero.
      *
+     * This (and GetBatch()) may be called from several threads at once, as long as
+     * tensors are not being generated or deleted at the same time. Reads
+     * of tensors generated on-the-fly are done one at a time.
+     *
      * \param [in] tensorflag Which tensor to get (see Flags.h)
      * \param [in] outbuf Memory location to store the batch of tensors
      * \param [in] bufsize The size of \p outbuf (in number of doubles)
      * \param [in] qstart The starting value of q
      * \return The number of batches actually stored in the buffer.
      */
-    int GetQBatch(int tensorflag, double * outbuf, int bufsize, int qstart);
+    int GetQBatch(int tensorflag, double * outbuf, size_t bufsize, int qstart);
 
 
     /*!
      * \copybrief   GetQBatch
      * \copydetails GetQBatch
      */
-    int GetQBatch(int tensorflag, double * outbuf, int bufsize, QIterator qstart);
+    int GetQBatch(int tensorflag, double * outbuf, size_t bufsize, QIterator qstart);
 
 
     /*!
@@ -293,20 +377,218 @@ public:
      * Call this and process the batches, incrementing qstart by the return value,
      * until this function returns zero.
      *
+     * This may be called from several threads at once (see GetQBatch()).
+     *
      * \param [in] outbuf Memory location to store the tensor
      * \param [in] tensorflag Which tensor to get (see Flags.h)
      * \param [in] bufsize The size of \p outbuf (in number of doubles)
      * \param [in] ijstart The starting value of the ij index
      * \return The number of batches actually stored in the buffer.
      */
-    int GetBatch(int tensorflag, double * outbuf, int bufsize, int ijstart);
+    int GetBatch(int tensorflag, double * outbuf, size_t bufsize, int ijstart);
 
 
     /*!
      * \copybrief   GetBatch
      * \copydetails GetBatch
      */
-    int GetBatch(int tensorflag, double * outbuf, int bufsize, IJIterator ijstart);
+    int GetBatch(int tensorflag, double * outbuf, size_t bufsize, IJIterator ijstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor in single precision
+     *
+     * Same as GetQBatch(int, double *, int, int), but \p bufsize is in number of floats.
+     * Tensors stored in double precision are converted.
+     */
+    int GetQBatch(int tensorflag, float * outbuf, size_t bufsize, int qstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor in single precision
+     *
+     * Same as GetBatch(int, double *, int, int), but \p bufsize is in number of floats.
+     * Tensors stored in double precision are converted.
+     */
+    int GetBatch(int tensorflag, float * outbuf, size_t bufsize, int ijstart);
+
+
+    /*!
+     * \brief Retrieves a block of a 3-index tensor
+     *
+     * Gets orbitals [\p istart, \p istart + \p ni) x [\p jstart, \p jstart + \p nj)
+     * and auxiliary indices [\p qstart, \p qstart + \p nq) in one call. The buffer will
+     * contain ni*nj*nq elements with i as the slowest index and q as the fastest (ie,
+     * outbuf[(i*nj + j)*nq + q]). Packed tensors are expanded.
+     *
+     * Only the parts of the tensor needed are read, with as few reads as possible
+     * for tensors stored on disk.
+     *
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [in] outbuf Memory location to store the block
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] istart First value of the first orbital index
+     * \param [in] ni Number of values of the first orbital index
+     * \param [in] jstart First value of the second orbital index
+     * \param [in] nj Number of values of the second orbital index
+     * \param [in] qstart First auxiliary index
+     * \param [in] nq Number of auxiliary indices
+     */
+    void GetBlock(int tensorflag, double * outbuf, size_t bufsize,
+                  int istart, int ni, int jstart, int nj, int qstart, int nq);
+
+
+    /*!
+     * \brief Retrieves a list of combined orbital indices of a 3-index tensor
+     *
+     * The buffer will contain nij*nq elements with the orbital index as the slowest
+     * index, in the order given in \p ij (ie, outbuf[k*nq + q] for ij[k]).
+     * Combined indices can be obtained with CalcIndex().
+     *
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [in] outbuf Memory location to store the data
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] ij Combined orbital indices to get
+     * \param [in] nij Number of indices in \p ij
+     * \param [in] qstart First auxiliary index
+     * \param [in] nq Number of auxiliary indices
+     */
+    void GetGather(int tensorflag, double * outbuf, size_t bufsize,
+                   const int * ij, int nij, int qstart, int nq);
+
+
+    /*!
+     * \brief Assemble four-index integrals from two 3-index tensors
+     *
+     * Forms (ij|kl) = sum_Q B_Q,ij B_Q,kl for orbitals [\p istart, \p istart + \p ni) x
+     * [\p jstart, \p jstart + \p nj) of the tensor \p tensorflag1, and [\p kstart, \p kstart + \p nk) x
+     * [\p lstart, \p lstart + \p nl) of the tensor \p tensorflag2 (for example, Qov and Qov for (ia|jb), or
+     * Qoo and Qvv for (ij|ab)). The buffer will contain ni*nj*nk*nl elements with i as the slowest index
+     * and l as the fastest (ie, outbuf[((i*nj + j)*nk + k)*nl + l]).
+     *
+     * Blocks of both tensors are read (see GetBlock()) in batches of auxiliary indices,
+     * and the integrals are accumulated with matrix multiplications, in parallel over ij.
+     * Batches are as large as fit in the memory for temporary buffers (see SetMemoryLimit()).
+     *
+     * \param [in] tensorflag1 Tensor for the first pair of indices (see Flags.h)
+     * \param [in] tensorflag2 Tensor for the second pair of indices (see Flags.h)
+     * \param [in] outbuf Memory location to store the integrals
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] istart First value of the first orbital index of \p tensorflag1
+     * \param [in] ni Number of values of the first orbital index of \p tensorflag1
+     * \param [in] jstart First value of the second orbital index of \p tensorflag1
+     * \param [in] nj Number of values of the second orbital index of \p tensorflag1
+     * \param [in] kstart First value of the first orbital index of \p tensorflag2
+     * \param [in] nk Number of values of the first orbital index of \p tensorflag2
+     * \param [in] lstart First value of the second orbital index of \p tensorflag2
+     * \param [in] nl Number of values of the second orbital index of \p tensorflag2
+     */
+    void GetFourIndex(int tensorflag1, int tensorflag2, double * outbuf, size_t bufsize,
+                      int istart, int ni, int jstart, int nj,
+                      int kstart, int nk, int lstart, int nl);
+
+
+    /*!
+     * \brief Calculate the MP2 correlation energy from Qov
+     *
+     * Qov must have been generated (and not deleted). Blocks of occupied orbitals
+     * are read from Qov (in memory or on disk), and the (ia|jb) integrals for pairs of
+     * blocks are formed with matrix multiplications, in parallel over the occupied orbitals.
+     * Blocks are as large as fit in the memory for temporary buffers (see SetMemoryLimit()).
+     * Without virtual orbitals, the energy is zero.
+     *
+     * \param [in] orben Energies of all the molecular orbitals, in the same order as the
+     *                   C matrix (including frozen orbitals)
+     * \param [out] esame Same-spin part of the correlation energy
+     * \param [out] eopp Opposite-spin part of the correlation energy
+     * \return The MP2 correlation energy (\p esame + \p eopp)
+     */
+    double DFMP2Energy(const double * orben, double & esame, double & eopp);
+
+
+    /*!
+     * \brief Build Coulomb (J) and exchange (K) matrices from Qso
+     *
+     * Qso must have been generated with QGEN_QSO (and not deleted). If it was only
+     * generated on the way to other tensors, the metric may not have been applied to it and
+     * it may not be reordered, so an exception is thrown. Each density is given
+     * by its occupied orbitals (D = C C^T). Qso is read in batches of auxiliary
+     * indices (in memory or on disk). For each batch, J is formed with two matrix
+     * multiplications over the packed orbital index, and K by half-transforming
+     * each (Q|mu nu) with C and then summing over the batch with a single matrix
+     * multiplication. Batches are as large as fit in the memory for temporary
+     * buffers (see SetMemoryLimit()).
+     *
+     * The C matrices, J, and K use the same basis function ordering as Qso
+     * (the ordering passed to the constructor).
+     *
+     * \param [in] ndens Number of densities
+     * \param [in] cocc For each density, the occupied orbitals (nso x nocc[k], row-major)
+     * \param [in] nocc For each density, the number of occupied orbitals (columns of cocc[k])
+     * \param [out] J For each density, the nso x nso Coulomb matrix (or null to skip)
+     * \param [out] K For each density, the nso x nso exchange matrix (or null to skip)
+     */
+    void BuildJK(int ndens, const double * const * cocc, const int * nocc,
+                 double * const * J, double * const * K);
+
+
+    /*!
+     * \brief Build Coulomb (J) matrices from Qso, given densities
+     *
+     * Same as BuildJK(), but only for J, which may be built from
+     * any density matrix.
+     *
+     * \param [in] ndens Number of densities
+     * \param [in] dens For each density, the nso x nso density matrix
+     * \param [out] J For each density, the nso x nso Coulomb matrix
+     */
+    void BuildJ(int ndens, const double * const * dens, double * const * J);
+
+
+    /*!
+     * \brief Obtain a handle for accessing a tensor directly
+     *
+     * For use in loops, where the tensor flag would otherwise be resolved
+     * on every call to GetQBatch(), CalcIndex(), etc. See QTensorHandle.
+     *
+     * The handle is valid until the tensor is deleted or regenerated.
+     *
+     * \param [in] tensorflag Which tensor to access (see Flags.h)
+     */
+    QTensorHandle Handle(int tensorflag);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor by Q, without copying if possible
+     *
+     * Batches are the same as from GetQBatch(int, double *, size_t, int), including
+     * the number of batches (which is limited by \p bufsize). If the tensor is stored
+     * in memory (or in a memory-mapped file) in double precision with QSTORAGE_BYQ,
+     * \p data points directly to the stored tensor and \p outbuf is not touched.
+     * Otherwise, the batches are copied to \p outbuf, and \p data points to it.
+     *
+     * \p outbuf may be null, in which case an exception is thrown if the
+     * batches can't be viewed directly.
+     *
+     * The data is valid until the tensor is deleted or regenerated, and must not be modified.
+     *
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [out] data Where the batches are
+     * \param [in] outbuf Memory location to store the batches, if they must be copied
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] qstart The starting value of q
+     * \return The number of batches in \p data
+     */
+    int GetQBatchView(int tensorflag, const double *& data, double * outbuf, size_t bufsize, int qstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor by orbital index, without copying if possible
+     *
+     * Same as GetQBatchView(), but with the batches from GetBatch(int, double *, size_t, int).
+     * Batches can be viewed directly if the tensor is stored without QSTORAGE_BYQ.
+     */
+    int GetBatchView(int tensorflag, const double *& data, double * outbuf, size_t bufsize, int ijstart);
 
 
 
@@ -322,13 +604,17 @@ public:
      *
      * Use Get() to get a pointer to the current data for the indices stored in the
      * iterator.
+     *
+     * If created with a prefetch depth greater than one, the next batches are
+     * read in the background (see BatchPrefetcher), and Get() may point to
+     * internally-allocated buffers rather than the one passed in.
      **/
     template<typename ITTYPE>
     class IteratedQTensor
     {
         public:
-            /// A function that takes an index, and returns the size of the batch retrieved 
-            typedef std::function<int(int)> GetBatchFunc;
+            /// A function that takes a buffer and an index, and returns the size of the batch retrieved 
+            typedef BatchPrefetcher::FetchFunc GetBatchFunc;
 
             /*!
              * \brief Constructor
@@ -337,18 +623,22 @@ public:
              * \param [in] buf Where to place the retrieved batches
              * \param [in] bufsize The size of the buffer \p buf (in number of doubles)
              * \param [in] batchsize The size of a batch of the tensor
+             * \param [in] nindex Total number of indices iterated over
              * \param [in] it Base iterator
              * \param [in] gbf Function to obtain the batches
+             * \param [in] depth Number of batches to have in flight (1 = no prefetching)
              */
-            IteratedQTensor(int tensorflag, double * buf, int bufsize,
-                            int batchsize, const ITTYPE & it, GetBatchFunc gbf)
-                : gbf_(gbf),it_(it),buf_(buf),bufsize_(bufsize),batchsize_(batchsize)
+            IteratedQTensor(int tensorflag, double * buf, size_t bufsize,
+                            int batchsize, int nindex, const ITTYPE & it, GetBatchFunc gbf,
+                            int depth)
+                : it_(it),batchsize_(batchsize),
+                  prefetcher_(std::make_shared<BatchPrefetcher>(gbf, buf, bufsize, batchsize, nindex, depth))
             {
                 GetBatch();
             }
 
-            // note that we don't own the pointer
-            // so no need to deep copy
+            // note that we don't own the user's buffer, and
+            // copies share the prefetched buffers
             IteratedQTensor(const IteratedQTensor & rhs) = default;
 
             /*!
@@ -405,6 +695,11 @@ public:
              */ 
             int Index(void) const { return it_.Index(); }
 
+            /*!
+             * \brief Number of buffers actually used for prefetching
+             */
+            int PrefetchDepth(void) const { return prefetcher_->Depth(); }
+
         protected:
 
             /*!
@@ -413,25 +708,22 @@ public:
             const ITTYPE & Iterator(void) const { return it_; }
 
         private:
-            GetBatchFunc gbf_;  //!< Function pointer to get batches
-
             ITTYPE it_;         //!< Stored iterator object
             double * curptr_;   //!< Pointer to data corresponding to the current iterator value
             int nbatch_;        //!< Number of batches currently in the buffer
             int curbatch_;      //!< The batch I'm currently on
-
-            double * buf_;      //!< Where to store the data
-            int bufsize_;       //!< Size of the buffer
             int batchsize_;     //!< Size of a single batch
 
+            std::shared_ptr<BatchPrefetcher> prefetcher_; //!< Obtains the batches (possibly ahead of time)
+
 
             /*!
-             * \brief Actually Get a batch (through gbf_)
+             * \brief Actually Get a batch (through the prefetcher)
              */
             void GetBatch(void)
             {
-                nbatch_ = gbf_(it_.Index());
-                curptr_ = buf_;
+                int start;
+                nbatch_ = prefetcher_->Next(&curptr_, &start);
                 curbatch_ = 0;
             }
 
@@ -451,12 +743,15 @@ public:
              * \param [in] buf Where to place the retrieved batches
              * \param [in] bufsize The size of the buffer \p buf (in number of doubles)
              * \param [in] batchsize The size of a batch of the tensor
+             * \param [in] nindex Total number of indices iterated over
              * \param [in] it Base iterator
              * \param [in] gbf Function to obtain the batches
+             * \param [in] depth Number of batches to have in flight (1 = no prefetching)
              */
-            IteratedQTensorByQ(int tensorflag, double * buf, int bufsize,
-                               int batchsize, const QIterator & it, GetBatchFunc gbf)
-                    : IteratedQTensor(tensorflag, buf, bufsize, batchsize, it, gbf) { }
+            IteratedQTensorByQ(int tensorflag, double * buf, size_t bufsize,
+                               int batchsize, int nindex, const QIterator & it, GetBatchFunc gbf,
+                               int depth)
+                    : IteratedQTensor(tensorflag, buf, bufsize, batchsize, nindex, it, gbf, depth) { }
 
 
             /*!
@@ -479,12 +774,15 @@ public:
              * \param [in] buf Where to place the retrieved batches
              * \param [in] bufsize The size of the buffer \p buf (in number of doubles)
              * \param [in] batchsize The size of a batch of the tensor
+             * \param [in] nindex Total number of indices iterated over
              * \param [in] it Base iterator
              * \param [in] gbf Function to obtain the batches
+             * \param [in] depth Number of batches to have in flight (1 = no prefetching)
              */
-            IteratedQTensorByIJ(int tensorflag, double * buf, int bufsize,
-                                int batchsize, const IJIterator & it, GetBatchFunc gbf)
-                    : IteratedQTensor(tensorflag, buf, bufsize, batchsize, it, gbf) { }
+            IteratedQTensorByIJ(int tensorflag, double * buf, size_t bufsize,
+                                int batchsize, int nindex, const IJIterator & it, GetBatchFunc gbf,
+                                int depth)
+                    : IteratedQTensor(tensorflag, buf, bufsize, batchsize, nindex, it, gbf, depth) { }
 
 
             /*!
@@ -509,16 +807,57 @@ public:
      * \brief Obtain an iterator to a specific stored three-index tensor
      *
      * Iteration will happen over the auxiliary index
+     *
+     * \param [in] tensorflag Which tensor to iterate over
+     * \param [in] buf Where to place the retrieved batches
+     * \param [in] bufsize The size of the buffer \p buf (in number of doubles)
+     * \param [in] depth Number of batches to have in flight. With more than one,
+     *                   batches are read in the background while the current one is
+     *                   used (2 = double buffering, etc), and (depth-1) extra
+     *                   buffers of size \p bufsize are allocated.
      */
-    IteratedQTensorByQ IterateByQ(int tensorflag, double * buf, int bufsize);
+    IteratedQTensorByQ IterateByQ(int tensorflag, double * buf, size_t bufsize, int depth = 1);
 
 
     /*!
      * \brief Obtain an iterator to a specific stored three-index tensor
      *
      * Iteration will happen over the combined orbital index
+     *
+     * \copydetails IterateByQ
      */
-    IteratedQTensorByIJ IterateByIJ(int tensorflag, double * buf, int bufsize);
+    IteratedQTensorByIJ IterateByIJ(int tensorflag, double * buf, size_t bufsize, int depth = 1);
+
+
+    /*!
+     * \brief Read batches of a tensor by Q, optionally ahead of time
+     *
+     * Batches are obtained with BatchPrefetcher::Next(). Each contains
+     * whole rows of the tensor, as returned from GetQBatch().
+     *
+     * \warning With \p depth larger than one, batches are read from the tensor by
+     *          background threads until the prefetcher is destroyed. The prefetcher
+     *          (or an iterator from IterateByQ() or IterateByIJ() with \p depth larger
+     *          than one) must be destroyed before the tensor is deleted with Delete() or
+     *          regenerated with GenQTensors(), and before this object is destroyed.
+     *
+     * \copydetails IterateByQ
+     */
+    std::unique_ptr<BatchPrefetcher> PrefetchQBatches(int tensorflag, double * buf, size_t bufsize, int depth);
+
+
+    /*!
+     * \brief Read batches of a tensor by orbital index, optionally ahead of time
+     *
+     * Batches are obtained with BatchPrefetcher::Next(). Each contains
+     * whole rows of the tensor, as returned from GetBatch().
+     *
+     * The prefetcher must be destroyed before the tensor is deleted or
+     * regenerated (see PrefetchQBatches()).
+     *
+     * \copydetails IterateByQ
+     */
+    std::unique_ptr<BatchPrefetcher> PrefetchBatches(int tensorflag, double * buf, size_t bufsize, int depth);
 
 
 protected:
@@ -530,6 +869,63 @@ protected:
      */
     virtual UniqueStoredQTensor GenQso(int storeflags) const = 0;
 
+
+    /*!
+     * \brief Fill in the part of a plan that depends on how Qso is generated
+     *
+     * Sets the number of auxiliary functions, the number of integrals, the floating point
+     * operations for applying the metric to Qso (zero if there is no metric), and the
+     * memory needed while generating Qso (not including Qso itself).
+     *
+     * \param [inout] plan The plan to fill in
+     */
+    virtual void PlanQso(QTensorPlan & plan) const = 0;
+
+
+    /*!
+     * \brief Add the options of the derived class to the description of the calculation
+     *
+     * \param [inout] origin Description to add to (already has the primary basis set)
+     */
+    virtual void AddOriginOptions(QTensorOrigin & origin) const = 0;
+
+
+    /*!
+     * \brief Describe the calculation, for checking tensors stored on disk
+     *
+     * \param [in] withorbs Include the C matrix (for transformed tensors)
+     */
+    QTensorOrigin Origin(bool withorbs) const;
+
+
+    /*!
+     * \brief Memory left for storing a new tensor (in bytes)
+     *
+     * The memory limit minus what is used by the tensors
+     * currently stored. Very large if there is no limit.
+     */
+    size_t MemoryAvailable(void) const;
+
+
+    /*!
+     * \brief Apply the memory limit to a tensor that is about to be generated
+     *
+     * Sets the memory it can use for temporary buffers. Does nothing if there is no limit.
+     */
+    void ApplyMemoryLimit(StoredQTensor * qt) const;
+
+
+    /*!
+     * \brief Storage flags to use, given the memory limit
+     *
+     * Tensors that would be stored in memory can spill to disk if there is a limit
+     */
+    int LimitedStoreFlags(int storeflags) const;
+
+
+    /// Memory for temporary buffers each tensor can use (in bytes)
+    size_t Workspace(void) const;
+
     ///@}
 
 
@@ -561,12 +957,26 @@ protected:
 
     int nthreads_;  //!< Number of threads to use
 
+    size_t memlimit_;  //!< Memory available for storing tensors (zero if no limit)
+
     std::string directory_;  //!< Directory to use to store matrices on disk (if requested)
 
 
 private:
     int qtype_;  //!< Type of tensor (DF, CH, etc. See Flags.h)
     int bsorder_; //!< Ordering of basis functions (See Flags.h)
+    bool qsofinal_; //!< Qso was generated with QGEN_QSO (metric applied and reordered)
+
+
+    /*!
+     * \brief Build J and K matrices from Qso
+     *
+     * See BuildJK() and BuildJ(). \p dens[k] is only used if \p J[k] is not null,
+     * and \p cocc[k] only if \p K[k] is not null. \p cocc, \p nocc, and \p K may be null
+     * if no K matrices are wanted.
+     */
+    void JK_(int ndens, const double * const * dens, const double * const * cocc,
+             const int * nocc, double * const * J, double * const * K);
 
 
     /*!
@@ -628,6 +1038,19 @@ private:
 
     CumulativeTime timer_genqtensors_;   //!< Total time spent in GenQTensors()
 
+    /*!
+     * \brief Function that reads batches by Q, for use by iterators and prefetchers
+     */
+    BatchPrefetcher::FetchFunc QBatchFetchFunc(int tensorflag, size_t bufsize);
+
+
+    /*!
+     * \brief Function that reads batches by orbital index, for use by iterators and prefetchers
+     *
+     * \copydetails QBatchFetchFunc
+     */
+    BatchPrefetcher::FetchFunc BatchFetchFunc(int tensorflag, size_t bufsize);
+
 
     /*!
      * \brief Obtains a stored tensor object corresponding to a tensor flag
@@ -646,7 +1069,8 @@ private:
      * \param [in] qstart The starting value of q
      * \param [in] qt Pointer to the StoredQTensor to retrieve
      */
-    int GetQBatch_Base(double * outbuf, int bufsize, int qstart, const UniqueStoredQTensor & qt);
+    template<typename T>
+    int GetQBatch_Base(T * outbuf, size_t bufsize, int qstart, const UniqueStoredQTensor & qt);
 
 
     /*!
@@ -657,7 +1081,8 @@ private:
      * \param [in] ijstart Starting combined orbital index
      * \param [in] qt Pointer to the StoredQTensor to retrieve
      */
-    int GetBatch_Base(double * outbuf, int bufsize, int ijstart, const UniqueStoredQTensor & qt);
+    template<typename T>
+    int GetBatch_Base(T * outbuf, size_t bufsize, int ijstart, const UniqueStoredQTensor & qt);
 
     
 
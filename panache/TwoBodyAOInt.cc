@@ -3,6 +3,8 @@
  * \author Benjamin Pritchard (ben@bennyp.org)
  */
 
+#include <algorithm>
+
 #include "panache/SphericalTransform.h"
 #include "panache/Molecule.h"
 #include "panache/TwoBodyAOInt.h"
@@ -277,11 +279,15 @@ void TwoBodyAOInt::pure_transform(int sh1, int sh2, int sh3, int sh4, int nchunk
     const GaussianShell& s3 = bs3_->shell(sh3);
     const GaussianShell& s4 = bs4_->shell(sh4);
 
-    // Get the transforms from the basis set
-    SphericalTransform trans1(SphericalTransform::Generate(s1.am()));
-    SphericalTransform trans2(SphericalTransform::Generate(s2.am()));
-    SphericalTransform trans3(SphericalTransform::Generate(s3.am()));
-    SphericalTransform trans4(SphericalTransform::Generate(s4.am()));
+    // Get the transforms (generated once for each angular momentum)
+    int maxam = std::max(std::max(s1.am(), s2.am()), std::max(s3.am(), s4.am()));
+    for(int l = static_cast<int>(sphtrans_.size()); l <= maxam; l++)
+        sphtrans_.push_back(SphericalTransform::Generate(l));
+
+    const SphericalTransform & trans1 = sphtrans_[s1.am()];
+    const SphericalTransform & trans2 = sphtrans_[s2.am()];
+    const SphericalTransform & trans3 = sphtrans_[s3.am()];
+    const SphericalTransform & trans4 = sphtrans_[s4.am()];
 
     // Get the angular momentum for each shell
     int am1 = s1.am();
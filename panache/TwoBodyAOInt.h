@@ -8,6 +8,9 @@
 
 #include <memory>
 #include <array>
+#include <vector>
+
+#include "panache/SphericalTransform.h"
 
 namespace panache {
 
@@ -43,6 +46,7 @@ protected:
     int natom_;                 //!< Number of atoms.
     bool force_cartesian_;      //!< Whether to force integrals to be generated in the Cartesian (AO) basis;
     unsigned char buffer_offsets_[4];  //!< The order of the derivative integral buffers, after permuting shells
+    std::vector<SphericalTransform> sphtrans_; //!< Cartesian to spherical transforms, by angular momentum
 
 
     /*!
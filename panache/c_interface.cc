@@ -4,8 +4,10 @@
  */
 
 #include <map>
+#include <vector>
 #include <sstream>
 #include <iostream> // for std::cout
+#include <limits>
 
 // included from c_convert.h
 //#include "panache/c_interface.h"
@@ -22,6 +24,7 @@ using panache::SharedBasisSetParser;
 using panache::Gaussian94BasisSetParser;
 using panache::SharedBasisSet;
 using panache::ThreeIndexTensor;
+using panache::BatchPrefetcher;
 using panache::DFTensor;
 using panache::CHTensor;
 using panache::Molecule;
@@ -33,6 +36,10 @@ namespace
 int tensor_index_ = 0;
 std::map<int, ThreeIndexTensor *> xtensors_;
 
+// Prefetches, and the handle of the calculation they belong to
+int prefetch_index_ = 0;
+std::map<int, std::pair<int, std::unique_ptr<BatchPrefetcher>>> xprefetch_;
+
 
 void CheckHandle(int handle, const char * func)
 {
@@ -45,6 +52,73 @@ void CheckHandle(int handle, const char * func)
 }
 
 
+// Convert an index or count passed in through the interface
+// to what is used internally, making sure it isn't truncated
+int ToInt(panache_int_t val, const char * func)
+{
+    if(val < std::numeric_limits<int>::min() || val > std::numeric_limits<int>::max())
+    {
+        std::stringstream ss;
+        ss << "Function: " << func << ": Error - value " << val << " is too large!";
+        throw RuntimeError(ss.str());
+    }
+    return static_cast<int>(val);
+}
+
+
+// Convert a size to the interface integer type. For a 32-bit
+// interface, the size may not fit
+panache_int_t ToInterfaceInt(size_t val, const char * func)
+{
+    if(val > static_cast<size_t>(std::numeric_limits<panache_int_t>::max()))
+    {
+        std::stringstream ss;
+        ss << "Function: " << func << ": Error - value " << val << " does not fit in the interface integer type."
+           << " Use a 64-bit interface (PANACHE_INTERFACE64)";
+        throw RuntimeError(ss.str());
+    }
+    return static_cast<panache_int_t>(val);
+}
+
+
+// Buffer sizes must not be negative
+size_t ToBufSize(panache_int_t val, const char * func)
+{
+    if(val < 0)
+    {
+        std::stringstream ss;
+        ss << "Function: " << func << ": Error - negative buffer size!";
+        throw RuntimeError(ss.str());
+    }
+    return static_cast<size_t>(val);
+}
+
+
+void CheckPrefetchHandle(int prefetch, const char * func)
+{
+    if(xprefetch_.count(prefetch) == 0)
+    {
+        std::stringstream ss;
+        ss << "Function: " << func << ": Error - cannot find prefetch with that handle!";
+        throw RuntimeError(ss.str());
+    }
+}
+
+
+// Prefetches must end before their calculation (or any of its
+// tensors) is deleted, since they read in the background
+void EndPrefetches(int handle)
+{
+    for(auto it = xprefetch_.begin(); it != xprefetch_.end(); )
+    {
+        if(it->second.first == handle)
+            it = xprefetch_.erase(it);
+        else
+            ++it;
+    }
+}
+
+
 } // close anonymous namespace
 
 
@@ -120,13 +194,13 @@ extern "C" {
     }
 
 
-    int panache_qbatchsize(int handle, int tensorflag)
+    panache_int_t panache_qbatchsize(int handle, int tensorflag)
     {
         CheckHandle(handle, __FUNCTION__);
         return xtensors_[handle]->QBatchSize(tensorflag); 
     }
 
-    int panache_batchsize(int handle, int tensorflag)
+    panache_int_t panache_batchsize(int handle, int tensorflag)
     {
         CheckHandle(handle, __FUNCTION__);
         return xtensors_[handle]->BatchSize(tensorflag); 
@@ -138,24 +212,35 @@ extern "C" {
         return xtensors_[handle]->IsPacked(tensorflag); 
     }
 
-    int panache_calcindex(int handle, int tensorflag, int i, int j)
+    int panache_isfloat(int handle, int tensorflag)
     {
         CheckHandle(handle, __FUNCTION__);
-        return xtensors_[handle]->CalcIndex(tensorflag, i, j); 
+        return xtensors_[handle]->IsFloat(tensorflag); 
     }
 
-    int panache_tensordimensions(int handle, int tensorflag,
-                                   int * naux, int * ndim1, int * ndim2)
+    panache_int_t panache_calcindex(int handle, int tensorflag, panache_int_t i, panache_int_t j)
     {
         CheckHandle(handle, __FUNCTION__);
-        int ret = xtensors_[handle]->TensorDimensions(tensorflag, *naux, *ndim1, *ndim2);
-        return ret;
+        return xtensors_[handle]->CalcIndex(tensorflag, ToInt(i, __FUNCTION__), ToInt(j, __FUNCTION__)); 
+    }
+
+    panache_int_t panache_tensordimensions(int handle, int tensorflag,
+                                           panache_int_t * naux, panache_int_t * ndim1, panache_int_t * ndim2)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        int inaux, indim1, indim2;
+        size_t ret = xtensors_[handle]->TensorDimensions(tensorflag, inaux, indim1, indim2);
+        *naux = inaux;
+        *ndim1 = indim1;
+        *ndim2 = indim2;
+        return ToInterfaceInt(ret, __FUNCTION__);
     }
 
     void panache_cleanup(int handle)
     {
         if(xtensors_.count(handle) > 0)
         {
+            EndPrefetches(handle);
             delete xtensors_[handle];
             xtensors_.erase(handle);
         }
@@ -165,27 +250,31 @@ extern "C" {
 
     void panache_cleanup_all(void)
     {
+        xprefetch_.clear();
+
         for(auto it : xtensors_)
             delete it.second;
 
         xtensors_.clear();
     }
 
-    void panache_setcmatrix(int handle, double * cmo, int nmo, int cmo_is_trans)
+    void panache_setcmatrix(int handle, double * cmo, panache_int_t nmo, int cmo_is_trans)
     {
         CheckHandle(handle, __FUNCTION__);
-        xtensors_[handle]->SetCMatrix(cmo, nmo, cmo_is_trans);
+        xtensors_[handle]->SetCMatrix(cmo, ToInt(nmo, __FUNCTION__), cmo_is_trans);
     }
 
     void panache_genqtensors(int handle, int qflags, int storeflags)
     {
         CheckHandle(handle, __FUNCTION__);
+        EndPrefetches(handle);
         xtensors_[handle]->GenQTensors(qflags, storeflags); 
     }
 
     void panache_delete(int handle, int qflags)
     {
         CheckHandle(handle, __FUNCTION__);
+        EndPrefetches(handle);
         xtensors_[handle]->Delete(qflags); 
     }
 
@@ -206,10 +295,36 @@ extern "C" {
     }
 
 
-    void panache_setnocc(int handle, int nocc, int nfroz)
+    void panache_setmemorylimit(int handle, panache_int_t megabytes)
     {
         CheckHandle(handle, __FUNCTION__);
-        xtensors_[handle]->SetNOcc(nocc, nfroz); 
+
+        if(megabytes < 0)
+            throw RuntimeError("Function: panache_setmemorylimit: Error - negative memory limit!");
+
+        xtensors_[handle]->SetMemoryLimit(static_cast<size_t>(megabytes)*1024*1024);
+    }
+
+
+    void panache_plan(int handle, int qflags, int storeflags,
+                      double * peakmemory, double * diskusage, double * nintegrals,
+                      double * transformflops, double * metricflops)
+    {
+        CheckHandle(handle, __FUNCTION__);
+
+        panache::QTensorPlan plan = xtensors_[handle]->Plan(qflags, storeflags);
+        *peakmemory = static_cast<double>(plan.peakmemory);
+        *diskusage = static_cast<double>(plan.diskusage);
+        *nintegrals = plan.nintegrals;
+        *transformflops = plan.transformflops;
+        *metricflops = plan.metricflops;
+    }
+
+
+    void panache_setnocc(int handle, panache_int_t nocc, panache_int_t nfroz)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xtensors_[handle]->SetNOcc(ToInt(nocc, __FUNCTION__), ToInt(nfroz, __FUNCTION__)); 
     }
 
     void panache_printtimings(int handle)
@@ -218,17 +333,155 @@ extern "C" {
         xtensors_[handle]->PrintTimings(); 
     }
 
-    int panache_getqbatch(int handle, int tensorflag, double * outbuf, int bufsize, int qstart)
+    panache_int_t panache_getqbatch(int handle, int tensorflag, double * outbuf,
+                                    panache_int_t bufsize, panache_int_t qstart)
     {
         CheckHandle(handle, __FUNCTION__);
-        return xtensors_[handle]->GetQBatch(tensorflag, outbuf, bufsize, qstart);
+        return xtensors_[handle]->GetQBatch(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                      ToInt(qstart, __FUNCTION__));
     }
 
 
-    int panache_getbatch(int handle, int tensorflag, double * outbuf, int bufsize, int ijstart)
+    panache_int_t panache_getbatch(int handle, int tensorflag, double * outbuf,
+                                   panache_int_t bufsize, panache_int_t ijstart)
     {
         CheckHandle(handle, __FUNCTION__);
-        return xtensors_[handle]->GetBatch(tensorflag, outbuf, bufsize, ijstart);
+        return xtensors_[handle]->GetBatch(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                      ToInt(ijstart, __FUNCTION__));
+    }
+
+    panache_int_t panache_getqbatch_float(int handle, int tensorflag, float * outbuf,
+                                          panache_int_t bufsize, panache_int_t qstart)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        return xtensors_[handle]->GetQBatch(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                      ToInt(qstart, __FUNCTION__));
+    }
+
+    panache_int_t panache_getbatch_float(int handle, int tensorflag, float * outbuf,
+                                         panache_int_t bufsize, panache_int_t ijstart)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        return xtensors_[handle]->GetBatch(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                      ToInt(ijstart, __FUNCTION__));
+    }
+
+    double panache_dfmp2energy(int handle, const double * orben, double * esame, double * eopp)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        return xtensors_[handle]->DFMP2Energy(orben, *esame, *eopp);
+    }
+
+    void panache_buildjk(int handle, int ndens, const double * const * cocc, const panache_int_t * nocc,
+                         double * const * J, double * const * K)
+    {
+        CheckHandle(handle, __FUNCTION__);
+
+        if(ndens < 0)
+            throw RuntimeError("Function: panache_buildjk: Error - negative number of densities!");
+
+        // panache_int_t may be 64-bit
+        std::vector<int> nocc2(ndens);
+        for(int k = 0; k < ndens; k++)
+            nocc2[k] = ToInt(nocc[k], __FUNCTION__);
+
+        xtensors_[handle]->BuildJK(ndens, cocc, nocc2.data(), J, K);
+    }
+
+    void panache_buildj(int handle, int ndens, const double * const * dens, double * const * J)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xtensors_[handle]->BuildJ(ndens, dens, J);
+    }
+
+    void panache_getblock(int handle, int tensorflag, double * outbuf, panache_int_t bufsize,
+                          panache_int_t istart, panache_int_t ni, panache_int_t jstart, panache_int_t nj,
+                          panache_int_t qstart, panache_int_t nq)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xtensors_[handle]->GetBlock(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                    ToInt(istart, __FUNCTION__), ToInt(ni, __FUNCTION__),
+                                    ToInt(jstart, __FUNCTION__), ToInt(nj, __FUNCTION__),
+                                    ToInt(qstart, __FUNCTION__), ToInt(nq, __FUNCTION__));
+    }
+
+    void panache_getgather(int handle, int tensorflag, double * outbuf, panache_int_t bufsize,
+                           const panache_int_t * ij, panache_int_t nij,
+                           panache_int_t qstart, panache_int_t nq)
+    {
+        CheckHandle(handle, __FUNCTION__);
+
+        if(nij < 0)
+            throw RuntimeError("Function: panache_getgather: Error - negative number of indices!");
+
+        // panache_int_t may be 64-bit
+        std::vector<int> ijint(ToInt(nij, __FUNCTION__));
+        for(size_t k = 0; k < ijint.size(); k++)
+            ijint[k] = ToInt(ij[k], __FUNCTION__);
+
+        xtensors_[handle]->GetGather(tensorflag, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                     ijint.data(), static_cast<int>(ijint.size()),
+                                     ToInt(qstart, __FUNCTION__), ToInt(nq, __FUNCTION__));
+    }
+
+    void panache_getfourindex(int handle, int tensorflag1, int tensorflag2, double * outbuf, panache_int_t bufsize,
+                              panache_int_t istart, panache_int_t ni, panache_int_t jstart, panache_int_t nj,
+                              panache_int_t kstart, panache_int_t nk, panache_int_t lstart, panache_int_t nl)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xtensors_[handle]->GetFourIndex(tensorflag1, tensorflag2, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                        ToInt(istart, __FUNCTION__), ToInt(ni, __FUNCTION__),
+                                        ToInt(jstart, __FUNCTION__), ToInt(nj, __FUNCTION__),
+                                        ToInt(kstart, __FUNCTION__), ToInt(nk, __FUNCTION__),
+                                        ToInt(lstart, __FUNCTION__), ToInt(nl, __FUNCTION__));
+    }
+
+    panache_int_t panache_getqbatchview(int handle, int tensorflag, const double ** data, double * outbuf,
+                                        panache_int_t bufsize, panache_int_t qstart)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        return xtensors_[handle]->GetQBatchView(tensorflag, *data, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                                ToInt(qstart, __FUNCTION__));
+    }
+
+    panache_int_t panache_getbatchview(int handle, int tensorflag, const double ** data, double * outbuf,
+                                       panache_int_t bufsize, panache_int_t ijstart)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        return xtensors_[handle]->GetBatchView(tensorflag, *data, outbuf, ToBufSize(bufsize, __FUNCTION__),
+                                               ToInt(ijstart, __FUNCTION__));
+    }
+
+    int panache_prefetchqbatches(int handle, int tensorflag, double * buf,
+                                 panache_int_t bufsize, int depth)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xprefetch_[prefetch_index_] = std::make_pair(handle,
+                                      xtensors_[handle]->PrefetchQBatches(tensorflag, buf, ToBufSize(bufsize, __FUNCTION__), depth));
+        return prefetch_index_++;
+    }
+
+    int panache_prefetchbatches(int handle, int tensorflag, double * buf,
+                                panache_int_t bufsize, int depth)
+    {
+        CheckHandle(handle, __FUNCTION__);
+        xprefetch_[prefetch_index_] = std::make_pair(handle,
+                                      xtensors_[handle]->PrefetchBatches(tensorflag, buf, ToBufSize(bufsize, __FUNCTION__), depth));
+        return prefetch_index_++;
+    }
+
+    panache_int_t panache_nextbatch(int prefetch, double ** batch, panache_int_t * start)
+    {
+        CheckPrefetchHandle(prefetch, __FUNCTION__);
+        int istart = 0;
+        int n = xprefetch_[prefetch].second->Next(batch, &istart);
+        *start = istart;
+        return n;
+    }
+
+    void panache_endprefetch(int prefetch)
+    {
+        xprefetch_.erase(prefetch);
     }
 }
 
@@ -7,8 +7,23 @@
 #ifndef PANACHE_C_INTERFACE_H
 #define PANACHE_C_INTERFACE_H
 
+#include <stdint.h>
+
 #include "panache/Flags.h"
 
+/*! \def panache_int_t
+ *
+ *  \brief Integer type used for sizes and indices in the C interface
+ *
+ *  Is set to either int64_t or int32_t, depending on the PANACHE_INTERFACE64 option.
+ *  See \ref PANACHE_INTERFACE64_sec
+ */
+#ifdef PANACHE_INTERFACE64
+  #define panache_int_t int64_t
+#else
+  #define panache_int_t int32_t
+#endif
+
 extern "C" {
 
     /*!
@@ -60,7 +75,8 @@ extern "C" {
      * \param [in] directory A full path to a directory to be used for storing matrices to disk.
      *                       Not referenced if the disk is not used. Should not be set to "NULL", but
      *                       may be set to an empty string if disk is not to be used.
-     *                       If used, any existing files will be overwritten.
+     *                       If used, any existing files will be overwritten. Several directories
+     *                       may be given, separated by ':', to stripe tensors on disk across.
      * \param [in] optflag Flag controlling the type of metric to use
      *                     and other options. Set to zero for default (coulomb/eiginv)
      * \param [in] bsorder Basis function ordering flag
@@ -97,7 +113,8 @@ extern "C" {
      * \param [in] directory A full path to a file to be used for storing matrices to disk.
      *                       Not referenced if the disk is not used. Should not be set to "NULL", but
      *                       may be set to an empty string if disk is not to be used.
-     *                       If used, any existing files will be overwritten.
+     *                       If used, any existing files will be overwritten. Several directories
+     *                       may be given, separated by ':', to stripe tensors on disk across.
      * \param [in] optflag Flag controlling the type of metric to use
      *                     and other options. Set to zero for default (coulomb/eiginv)
      * \param [in] bsorder Basis function ordering flag
@@ -132,7 +149,8 @@ extern "C" {
      * \param [in] directory A full path to a file to be used for storing matrices to disk.
      *                       Not referenced if the disk is not used. Should not be set to "NULL", but
      *                       may be set to an empty string if disk is not to be used.
-     *                       If used, any existing files will be overwritten.
+     *                       If used, any existing files will be overwritten. Several directories
+     *                       may be given, separated by ':', to stripe tensors on disk across.
      * \param [in] bsorder Basis function ordering flag
      * \param [in] nthreads Max number of threads to use
      *
@@ -199,7 +217,7 @@ extern "C" {
      * \param [in] cmo_is_trans Set to non-zero if the matrix is the transpose (nmo x nso) or
      *                          is in column-major order.
      */
-    void panache_setcmatrix(int handle, double * cmo, int nmo, int cmo_is_trans);
+    void panache_setcmatrix(int handle, double * cmo, panache_int_t nmo, int cmo_is_trans);
 
 
     /*!
@@ -216,7 +234,7 @@ extern "C" {
      * \param [in] nocc Number of (non-frozen) occupied orbitals
      * \param [in] nfroz Number of frozen occupied orbitals
      */
-     void panache_setnocc(int handle, int nocc, int nfroz = 0);
+     void panache_setnocc(int handle, panache_int_t nocc, panache_int_t nfroz = 0);
 
 
     /*!
@@ -233,6 +251,38 @@ extern "C" {
 
 
 
+    /*!
+     * \brief Sets the memory available for generating and storing tensors
+     *
+     * See panache::ThreeIndexTensor::SetMemoryLimit()
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] megabytes Memory available (in megabytes). Zero for no limit.
+     */
+    void panache_setmemorylimit(int handle, panache_int_t megabytes);
+
+
+
+    /*!
+     * \brief Predicts the resources needed to generate tensors, without generating them
+     *
+     * See panache::ThreeIndexTensor::Plan(). Memory and disk usage are in bytes.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] qflags Which tensors would be generated
+     * \param [in] storeflags How the tensors would be stored
+     * \param [out] peakmemory Predicted peak memory usage
+     * \param [out] diskusage Predicted disk usage
+     * \param [out] nintegrals Number of integrals that would be computed
+     * \param [out] transformflops Floating point operations for the transformations
+     * \param [out] metricflops Floating point operations for applying the fitting metric
+     */
+    void panache_plan(int handle, int qflags, int storeflags,
+                      double * peakmemory, double * diskusage, double * nintegrals,
+                      double * transformflops, double * metricflops);
+
+
+
     /*!
      * \brief Prints out timing information collected so far
      *
@@ -263,6 +313,8 @@ extern "C" {
      * \warning Be sure to set the C-Matrix first and number of occupied orbitals first
      *          if qflags contains more than QGEN_QSO
      *
+     * Any prefetches for this calculation (see panache_prefetchqbatches()) are ended first.
+     *
      * \param [in] handle A handle (returned from an init function) for the calcultion
      * \param [in] qflags A combination of flags specifying which tensors to generate
      * \param [in] storeflags How to store the matrix
@@ -275,6 +327,8 @@ extern "C" {
     /*!
      * \brief Delete a tensor (from memory, disk, etc)
      *
+     * Any prefetches for this calculation (see panache_prefetchqbatches()) are ended first.
+     *
      * \param [in] handle A handle (returned from an init function) for the calcultion
      * \param [in] qflags A combination of flags specifying which tensors to delete
      */
@@ -299,7 +353,7 @@ extern "C" {
      * \param [in] tensorflag Which tensor to query (see Flags.h)
      * \return Size of batches returned by panache_getqbatch
      */
-    int panache_qbatchsize(int handle, int tensorflag);
+    panache_int_t panache_qbatchsize(int handle, int tensorflag);
 
 
     /*!
@@ -311,7 +365,7 @@ extern "C" {
      * \param [in] tensorflag Which tensor to query (see Flags.h)
      * \return Size of batches returned by panache_getbatch()
      */
-    int panache_batchsize(int handle, int tensorflag);
+    panache_int_t panache_batchsize(int handle, int tensorflag);
 
 
 
@@ -324,6 +378,15 @@ extern "C" {
      */
     int panache_ispacked(int handle, int tensorflag);
 
+    /*!
+     * \brief See if a particular tensor is stored in single precision
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation 
+     * \param [in] tensorflag Which tensor to query (see Flags.h)
+     * \return Nonzero if the tensor is stored in single precision (QSTORAGE_FLOAT)
+     */
+    int panache_isfloat(int handle, int tensorflag);
+
     /*!
      * \brief Calculate a combined orbital index
      *
@@ -335,7 +398,7 @@ extern "C" {
      * \param [in] j Second orbital index
      * \return ij, depending on packing
      */
-    int panache_calcindex(int handle, int tensorflag, int i, int j);
+    panache_int_t panache_calcindex(int handle, int tensorflag, panache_int_t i, panache_int_t j);
     
 
 
@@ -349,8 +412,8 @@ extern "C" {
      * \param [out] ndim2 Second dimension for a particular q
      * \return Total tensor size (depends on packing)
      */
-    int panache_tensordimensions(int handle, int tensorflag,
-                                   int * naux, int * ndim1, int * ndim2);
+    panache_int_t panache_tensordimensions(int handle, int tensorflag,
+                                           panache_int_t * naux, panache_int_t * ndim1, panache_int_t * ndim2);
 
 
 
@@ -379,7 +442,8 @@ extern "C" {
      * \param [in] qstart The starting value of q
      * \return The number of batches actually stored in the buffer.
      */
-    int panache_getqbatch(int handle, int tensorflag, double * outbuf, int bufsize, int qstart);
+    panache_int_t panache_getqbatch(int handle, int tensorflag, double * outbuf,
+                                    panache_int_t bufsize, panache_int_t qstart);
 
 
 
@@ -405,7 +469,231 @@ extern "C" {
      * \param [in] ijstart The starting value of q
      * \return The number of batches actually stored in the buffer.
      */
-    int panache_getbatch(int handle, int tensorflag, double * outbuf, int bufsize, int ijstart);
+    panache_int_t panache_getbatch(int handle, int tensorflag, double * outbuf,
+                                   panache_int_t bufsize, panache_int_t ijstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor in single precision
+     *
+     * Same as panache_getqbatch(), but \p bufsize is in number of floats.
+     * Tensors stored in double precision are converted.
+     */
+    panache_int_t panache_getqbatch_float(int handle, int tensorflag, float * outbuf,
+                                          panache_int_t bufsize, panache_int_t qstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor in single precision
+     *
+     * Same as panache_getbatch(), but \p bufsize is in number of floats.
+     * Tensors stored in double precision are converted.
+     */
+    panache_int_t panache_getbatch_float(int handle, int tensorflag, float * outbuf,
+                                         panache_int_t bufsize, panache_int_t ijstart);
+
+
+    /*!
+     * \brief Calculate the MP2 correlation energy from Qov
+     *
+     * See panache::ThreeIndexTensor::DFMP2Energy(). Qov must be generated first.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] orben Energies of all the molecular orbitals (including frozen orbitals)
+     * \param [out] esame Same-spin part of the correlation energy
+     * \param [out] eopp Opposite-spin part of the correlation energy
+     * \return The MP2 correlation energy
+     */
+    double panache_dfmp2energy(int handle, const double * orben, double * esame, double * eopp);
+
+
+    /*!
+     * \brief Build Coulomb (J) and exchange (K) matrices from Qso
+     *
+     * See panache::ThreeIndexTensor::BuildJK(). Qso must be generated first, with QGEN_QSO
+     * in the flags passed to panache_genqtensors().
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] ndens Number of densities
+     * \param [in] cocc For each density, the occupied orbitals (nso x nocc[k], row-major)
+     * \param [in] nocc For each density, the number of occupied orbitals
+     * \param [out] J For each density, the nso x nso Coulomb matrix (or NULL to skip)
+     * \param [out] K For each density, the nso x nso exchange matrix (or NULL to skip)
+     */
+    void panache_buildjk(int handle, int ndens, const double * const * cocc, const panache_int_t * nocc,
+                         double * const * J, double * const * K);
+
+
+    /*!
+     * \brief Build Coulomb (J) matrices from Qso, given densities
+     *
+     * See panache::ThreeIndexTensor::BuildJ(). Qso must be generated first, with QGEN_QSO
+     * in the flags passed to panache_genqtensors().
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] ndens Number of densities
+     * \param [in] dens For each density, the nso x nso density matrix
+     * \param [out] J For each density, the nso x nso Coulomb matrix
+     */
+    void panache_buildj(int handle, int ndens, const double * const * dens, double * const * J);
+
+
+    /*!
+     * \brief Retrieves a block of a 3-index tensor
+     *
+     * See panache::ThreeIndexTensor::GetBlock(). The buffer will contain ni*nj*nq
+     * elements, with i as the slowest index and q as the fastest.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [in] outbuf Memory location to store the block
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] istart First value of the first orbital index
+     * \param [in] ni Number of values of the first orbital index
+     * \param [in] jstart First value of the second orbital index
+     * \param [in] nj Number of values of the second orbital index
+     * \param [in] qstart First auxiliary index
+     * \param [in] nq Number of auxiliary indices
+     */
+    void panache_getblock(int handle, int tensorflag, double * outbuf, panache_int_t bufsize,
+                          panache_int_t istart, panache_int_t ni, panache_int_t jstart, panache_int_t nj,
+                          panache_int_t qstart, panache_int_t nq);
+
+
+    /*!
+     * \brief Retrieves a list of combined orbital indices of a 3-index tensor
+     *
+     * See panache::ThreeIndexTensor::GetGather(). The buffer will contain nij*nq
+     * elements, in the order of the indices in \p ij.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [in] outbuf Memory location to store the data
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] ij Combined orbital indices to get (see panache_calcindex())
+     * \param [in] nij Number of indices in \p ij
+     * \param [in] qstart First auxiliary index
+     * \param [in] nq Number of auxiliary indices
+     */
+    void panache_getgather(int handle, int tensorflag, double * outbuf, panache_int_t bufsize,
+                           const panache_int_t * ij, panache_int_t nij,
+                           panache_int_t qstart, panache_int_t nq);
+
+
+    /*!
+     * \brief Assemble four-index integrals from two 3-index tensors
+     *
+     * See panache::ThreeIndexTensor::GetFourIndex(). The buffer will contain ni*nj*nk*nl
+     * elements, with i as the slowest index and l as the fastest.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] tensorflag1 Tensor for the first pair of indices (see Flags.h)
+     * \param [in] tensorflag2 Tensor for the second pair of indices (see Flags.h)
+     * \param [in] outbuf Memory location to store the integrals
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] istart First value of the first orbital index of \p tensorflag1
+     * \param [in] ni Number of values of the first orbital index of \p tensorflag1
+     * \param [in] jstart First value of the second orbital index of \p tensorflag1
+     * \param [in] nj Number of values of the second orbital index of \p tensorflag1
+     * \param [in] kstart First value of the first orbital index of \p tensorflag2
+     * \param [in] nk Number of values of the first orbital index of \p tensorflag2
+     * \param [in] lstart First value of the second orbital index of \p tensorflag2
+     * \param [in] nl Number of values of the second orbital index of \p tensorflag2
+     */
+    void panache_getfourindex(int handle, int tensorflag1, int tensorflag2, double * outbuf, panache_int_t bufsize,
+                              panache_int_t istart, panache_int_t ni, panache_int_t jstart, panache_int_t nj,
+                              panache_int_t kstart, panache_int_t nk, panache_int_t lstart, panache_int_t nl);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor by Q, without copying if possible
+     *
+     * Batches are the same as from panache_getqbatch(). If the tensor is stored in memory
+     * (or in a memory-mapped file) in double precision with QSTORAGE_BYQ, \p data is set to point
+     * directly to the stored tensor. Otherwise, the batches are copied to \p outbuf and
+     * \p data points to it. See panache::ThreeIndexTensor::GetQBatchView()
+     *
+     * The data must not be modified, and is valid until the tensor is deleted.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [out] data Where the batches are
+     * \param [in] outbuf Memory location to store the batches, if they must be copied (may be null)
+     * \param [in] bufsize The size of \p outbuf (in number of doubles)
+     * \param [in] qstart The starting value of q
+     * \return The number of batches in \p data
+     */
+    panache_int_t panache_getqbatchview(int handle, int tensorflag, const double ** data, double * outbuf,
+                                        panache_int_t bufsize, panache_int_t qstart);
+
+
+    /*!
+     * \brief Retrieves a batch of a 3-index tensor by orbital index, without copying if possible
+     *
+     * Same as panache_getqbatchview(), but with the batches from panache_getbatch().
+     * Batches can be viewed directly if the tensor is stored without QSTORAGE_BYQ.
+     */
+    panache_int_t panache_getbatchview(int handle, int tensorflag, const double ** data, double * outbuf,
+                                       panache_int_t bufsize, panache_int_t ijstart);
+
+
+    /*!
+     * \brief Start reading batches of a 3-index tensor by Q, possibly ahead of time
+     *
+     * Batches are the same as those from panache_getqbatch(), and are obtained
+     * in order through panache_nextbatch(). With a \p depth larger than one,
+     * the following batches are read in the background while the caller
+     * works on the current one (2 = double buffering, 3 = triple buffering, etc).
+     * In that case, (depth-1) extra buffers of size \p bufsize are allocated internally.
+     *
+     * The prefetching should be ended with panache_endprefetch(). Since the
+     * background reads use the tensor, it is also ended when tensors of the
+     * calculation are deleted (panache_delete()) or generated again (panache_genqtensors()),
+     * and when the calculation is cleaned up. Its handle is then no longer valid.
+     *
+     * \param [in] handle A handle (returned from an init function) for the calculation
+     * \param [in] tensorflag Which tensor to get (see Flags.h)
+     * \param [in] buf Memory location to store the first batch
+     * \param [in] bufsize The size of \p buf (in number of doubles)
+     * \param [in] depth Number of batches to have in flight (1 = no prefetching)
+     * \return A handle to the prefetching, to be passed to panache_nextbatch()
+     */
+    int panache_prefetchqbatches(int handle, int tensorflag, double * buf,
+                                 panache_int_t bufsize, int depth);
+
+
+    /*!
+     * \brief Start reading batches of a 3-index tensor by orbital index, possibly ahead of time
+     *
+     * Same as panache_prefetchqbatches(), but the batches are the same
+     * as those from panache_getbatch().
+     */
+    int panache_prefetchbatches(int handle, int tensorflag, double * buf,
+                                panache_int_t bufsize, int depth);
+
+
+    /*!
+     * \brief Obtain the next batch from a prefetch
+     *
+     * The buffer returned by the previous call to this function
+     * is reused, and should not be used after calling this.
+     *
+     * \param [in] prefetch A handle returned from panache_prefetchqbatches() or panache_prefetchbatches()
+     * \param [out] batch Set to the location of the data for this batch
+     * \param [out] start Set to the starting index of this batch
+     * \return The number of batches (rows) in the buffer, or zero if there are no more
+     */
+    panache_int_t panache_nextbatch(int prefetch, double ** batch, panache_int_t * start);
+
+
+    /*!
+     * \brief End a prefetch, freeing its buffers
+     *
+     * Waits for any reads that are still in progress.
+     *
+     * \param [in] prefetch A handle returned from panache_prefetchqbatches() or panache_prefetchbatches()
+     */
+    void panache_endprefetch(int prefetch);
 
 
 } // end extern "C"
@@ -12,6 +12,7 @@
 #include "panache/Lapack.h"
 #include "panache/Flags.h"
 #include "panache/Iterator.h"
+#include "panache/Math.h"
  
 #ifdef PANACHE_PROFILE
 #include "panache/Output.h"
@@ -95,6 +96,42 @@ void CyclopsQTensor::ReadByQ_(double * data, int nq, int qstart)
     tensor_->read(nelements, indices.data(), data);
 }
 
+void CyclopsQTensor::Gather_(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    // All the elements are read in one call, which
+    // does the communication for all of them at once
+    size_t nelements = static_cast<size_t>(nij)*nq;
+
+    std::vector<long> indices;
+    indices.reserve(nelements);
+
+    for(int k = 0; k < nij; k++)
+    {
+        int i, j;
+        if(packed())
+        {
+            auto ijpair = math::decomposeij_packed(ij[k]);
+            i = ijpair.first;
+            j = ijpair.second;
+        }
+        else
+        {
+            i = ij[k] / ndim2();
+            j = ij[k] % ndim2();
+        }
+
+        for(int q = qstart; q < qstart + nq; q++)
+        {
+            if(byq())
+                indices.push_back(q+i*naux()+j*naux()*ndim1());
+            else
+                indices.push_back(i+j*ndim1()+q*ndim1()*ndim2());
+        }
+    }
+
+    tensor_->read(nelements, indices.data(), data);
+}
+
 void CyclopsQTensor::Init_(void)
 {
     //! \todo Symmetry not implemented
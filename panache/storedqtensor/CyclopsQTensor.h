@@ -115,6 +115,7 @@ private:
 protected:
     virtual void Read_(double * data, int nij, int ijstart);
     virtual void ReadByQ_(double * data, int nq, int qstart);
+    virtual void Gather_(double * data, const int * ij, int nij, int qstart, int nq);
     virtual void Init_(void);
 
     virtual void GenDFQso_(const SharedFittingMetric fit,
@@ -4,7 +4,13 @@
  */
 
 #include <cstdio> // for remove()
-#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <future>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "panache/Exception.h"
 #include "panache/Lapack.h"
@@ -14,6 +20,7 @@
 #include "panache/storedqtensor/MemoryQTensor.h"
 #include "panache/BasisSet.h"
 #include "panache/FittingMetric.h"
+#include "panache/Output.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -22,397 +29,655 @@
 namespace panache
 {
 
-void DiskQTensor::Write_(double * data, int nij, int ijstart)
+// Size of the buffer used for each tile of an out-of-core transpose
+#define DISK_TRANSPOSE_TILE_BYTES (32*1024*1024)
+
+// When reading only some of the columns of the file, gaps between
+// runs smaller than this are read (and discarded) rather than seeked over
+#define DISK_TRANSPOSE_MAXGAP_BYTES (256*1024)
+
+// Size of the (square) blocks used by the in-memory transpose
+#define DISK_TRANSPOSE_BLOCK 32
+
+// Size of the pieces of data stored in each file in turn,
+// when striping across directories
+#define DISK_STRIPE_BYTES (static_cast<size_t>(4*1024*1024))
+
+
+/*!
+ * \brief Cache-blocked out-of-place transpose
+ *
+ * Sets out(j,i) = in(i,j) for an \p m x \p n piece of \p in.
+ * Uses threads if not already inside a parallel region.
+ */
+template<typename T>
+static void BlockTranspose_(const T * in, int m, int n, size_t ldin, T * out, size_t ldout)
 {
+    int nblock = (m + DISK_TRANSPOSE_BLOCK - 1) / DISK_TRANSPOSE_BLOCK;
+
     #ifdef _OPENMP
-    #pragma omp critical
+    #pragma omp parallel for schedule(static) if(!omp_in_parallel())
     #endif
+    for(int b = 0; b < nblock; b++)
     {
-        int inaux = naux();
+        int i0 = b * DISK_TRANSPOSE_BLOCK;
+        int i1 = std::min(m, i0 + DISK_TRANSPOSE_BLOCK);
 
-        if(byq())
+        for(int j0 = 0; j0 < n; j0 += DISK_TRANSPOSE_BLOCK)
         {
-            int indim12 = ndim12();
-
-            for(int q = 0, qoff = 0; q < inaux; q++, qoff += indim12)
-            {
-                file_->seekp(sizeof(double)*(qoff+ijstart), std::ios_base::beg);
+            int j1 = std::min(n, j0 + DISK_TRANSPOSE_BLOCK);
 
-                for(int ij = 0, ijoff = 0; ij < nij; ij++, ijoff += inaux)
-                    file_->write(reinterpret_cast<const char *>(data+ijoff+q), sizeof(double));
-            }
-        }
-        else
-        {
-            file_->seekp(sizeof(double)*(ijstart * inaux), std::ios_base::beg);
-            file_->write(reinterpret_cast<const char *>(data), nij*inaux*sizeof(double));
+            for(int i = i0; i < i1; i++)
+            for(int j = j0; j < j1; j++)
+                out[j*ldout + i] = in[i*ldin + j];
         }
     }
 }
 
-void DiskQTensor::WriteByQ_(double * data, int nq, int qstart)
+
+template<typename T>
+void DiskQTensor::ReadColumns_(T * data, size_t lddata, int row0, int nrow, int rowlen, int ncol, int col0)
 {
-    #ifdef _OPENMP
-    #pragma omp critical
-    #endif
+    if(ncol <= 0 || nrow <= 0)
+        return;
+
+    // Read whole spans if the gaps between the pieces
+    // of each row are small. Otherwise, read each piece.
+    size_t gap = rowlen - ncol;
+    bool readspan = (gap*sizeof(T) <= DISK_TRANSPOSE_MAXGAP_BYTES);
+    size_t ld = (readspan ? rowlen : ncol);
+
+    int nrowtile = std::max(static_cast<size_t>(1), DISK_TRANSPOSE_TILE_BYTES / (ld*sizeof(T)));
+    nrowtile = std::min(nrowtile, nrow);
+
+    std::unique_ptr<T[]> tile(new T[nrowtile*ld]);
+
+    for(int r0 = 0; r0 < nrow; r0 += nrowtile)
     {
-        int indim12 = ndim12();
+        int nr = std::min(nrowtile, nrow - r0);
+        char * tileptr = reinterpret_cast<char *>(tile.get());
 
-        if(byq())
+        if(readspan)
         {
-            file_->seekp(sizeof(double)*(qstart*indim12), std::ios_base::beg);
-            file_->write(reinterpret_cast<const char *>(data), nq*indim12*sizeof(double));
+            PRead_(tileptr, sizeof(T)*((nr-1)*ld + ncol),
+                   sizeof(T)*(static_cast<size_t>(row0+r0)*rowlen + col0));
         }
         else
         {
-            int inaux = naux();
-
-            for(int q = 0, qoff = 0; q < nq; q++, qoff += indim12)
+            for(int r = 0; r < nr; r++)
             {
-                for(int ij = 0, ijoff = 0; ij < indim12; ij++, ijoff += inaux)
-                {
-                    file_->seekp(sizeof(double)*(ijoff+qstart+q), std::ios_base::beg);
-                    file_->write(reinterpret_cast<const char *>(data+qoff+ij), sizeof(double));
-                }
+                PRead_(tileptr + sizeof(T)*r*ld, sizeof(T)*ncol,
+                       sizeof(T)*(static_cast<size_t>(row0+r0+r)*rowlen + col0));
             }
         }
+
+        BlockTranspose_(tile.get(), nr, ncol, ld, data + r0, lddata);
     }
 }
 
-void DiskQTensor::Read_(double * data, int nij, int ijstart)
-{
-    #ifdef _OPENMP
-    #pragma omp critical
-    #endif
-    {
-        int inaux = naux();
 
-        if(byq())
-        {
-            int indim12 = ndim12();
+template<typename T>
+void DiskQTensor::WriteColumns_(const T * data, size_t lddata, int row0, int nrow, int rowlen, int ncol, int col0)
+{
+    if(ncol <= 0 || nrow <= 0)
+        return;
 
-            for(int q = 0, qoff = 0; q < inaux; q++, qoff += indim12)
-            {
-                file_->seekg(sizeof(double)*(qoff+ijstart), std::ios_base::beg);
+    int nrowtile = std::max(static_cast<size_t>(1), DISK_TRANSPOSE_TILE_BYTES / (ncol*sizeof(T)));
+    nrowtile = std::min(nrowtile, nrow);
 
-                for(int ij = 0, ijoff = 0; ij < nij; ij++, ijoff += inaux)
-                    file_->read(reinterpret_cast<char *>(data+ijoff+q), sizeof(double));
-            }
-        }
-        else
-        {
-            file_->seekg(sizeof(double)*(ijstart*inaux), std::ios_base::beg);
-            file_->read(reinterpret_cast<char *>(data), sizeof(double)*nij*inaux);
-        }
-    }
-}
+    std::unique_ptr<T[]> tile(new T[static_cast<size_t>(nrowtile)*ncol]);
 
-void DiskQTensor::ReadByQ_(double * data, int nq, int qstart)
-{
-    #ifdef _OPENMP
-    #pragma omp critical
-    #endif
+    for(int r0 = 0; r0 < nrow; r0 += nrowtile)
     {
-        int indim12 = ndim12();
+        int nr = std::min(nrowtile, nrow - r0);
+        const char * tileptr = reinterpret_cast<const char *>(tile.get());
 
-        if(byq())
+        BlockTranspose_(data + r0, ncol, nr, lddata, tile.get(), ncol);
+
+        // whole rows are contiguous on disk
+        if(ncol == rowlen)
         {
-            file_->seekg(sizeof(double)*(qstart*indim12), std::ios_base::beg);
-            file_->read(reinterpret_cast<char *>(data), sizeof(double)*nq*indim12);
+            PWrite_(tileptr, sizeof(T)*nr*ncol,
+                    sizeof(T)*static_cast<size_t>(row0+r0)*rowlen);
         }
         else
         {
-            int inaux = naux();
-
-            for(int q = 0, qoff = 0; q < nq; q++, qoff += indim12)
-            for(int ij = 0, ijoff = 0; ij < indim12; ij++, ijoff += inaux)
+            for(int r = 0; r < nr; r++)
             {
-                file_->seekg(sizeof(double)*(ijoff+qstart+q), std::ios_base::beg);
-                file_->read(reinterpret_cast<char *>(data+qoff+ij), sizeof(double));
+                PWrite_(tileptr + sizeof(T)*r*ncol, sizeof(T)*ncol,
+                        sizeof(T)*(static_cast<size_t>(row0+r0+r)*rowlen + col0));
             }
         }
     }
 }
 
 
-void DiskQTensor::OpenForReadWrite_(void)
-{
-    file_ = std::unique_ptr<std::fstream>(new std::fstream(filename_.c_str(),
-                                          std::fstream::out | std::fstream::in |
-                                          std::fstream::trunc | std::fstream::binary));
+// also used by derived classes
+template void DiskQTensor::ReadColumns_<double>(double *, size_t, int, int, int, int, int);
+template void DiskQTensor::ReadColumns_<float>(float *, size_t, int, int, int, int, int);
+template void DiskQTensor::WriteColumns_<double>(const double *, size_t, int, int, int, int, int);
+template void DiskQTensor::WriteColumns_<float>(const float *, size_t, int, int, int, int, int);
+
+
+// Accesses in the same orientation as the file are done directly.
+// Otherwise, they are done as a tiled transpose.
+//
+// All accesses are done with positional reads and writes, with
+// buffers local to the call, so threads don't need to be synchronized
+// (as long as writes from different threads are to different parts of
+// the tensor).
 
-    if(!file_->is_open())
-        throw RuntimeError(std::string("Unable to open file ") + filename_);
+void DiskQTensor::WriteRaw_(const char * data, int nij, int ijstart)
+{
+    size_t inaux = naux();
+    size_t elsize = ElementSize_();
 
-    file_->exceptions(std::fstream::failbit | std::fstream::badbit | std::fstream::eofbit);
+    if(byq())
+    {
+        if(isfloat())
+            WriteColumns_(reinterpret_cast<const float *>(data), naux(), 0, naux(), ndim12(), nij, ijstart);
+        else
+            WriteColumns_(reinterpret_cast<const double *>(data), naux(), 0, naux(), ndim12(), nij, ijstart);
+    }
+    else
+        PWrite_(data, elsize*nij*inaux, elsize*ijstart*inaux);
 }
 
+void DiskQTensor::WriteByQRaw_(const char * data, int nq, int qstart)
+{
+    size_t indim12 = ndim12();
+    size_t elsize = ElementSize_();
 
-bool DiskQTensor::OpenForRead_(bool required)
+    if(byq())
+        PWrite_(data, elsize*nq*indim12, elsize*qstart*indim12);
+    else
+    {
+        if(isfloat())
+            WriteColumns_(reinterpret_cast<const float *>(data), ndim12(), 0, ndim12(), naux(), nq, qstart);
+        else
+            WriteColumns_(reinterpret_cast<const double *>(data), ndim12(), 0, ndim12(), naux(), nq, qstart);
+    }
+}
+
+void DiskQTensor::ReadRaw_(char * data, int nij, int ijstart)
 {
-    file_ = std::unique_ptr<std::fstream>(new std::fstream(filename_.c_str(),
-                                          std::fstream::in | std::fstream::binary));
+    size_t inaux = naux();
+    size_t elsize = ElementSize_();
 
-    if(!file_->is_open())
+    if(byq())
     {
-        if(required)
-            throw RuntimeError(std::string("Unable to open file ") + filename_);
+        if(isfloat())
+            ReadColumns_(reinterpret_cast<float *>(data), naux(), 0, naux(), ndim12(), nij, ijstart);
         else
-        {
-            file_.reset();
-            return false;
-        }
+            ReadColumns_(reinterpret_cast<double *>(data), naux(), 0, naux(), ndim12(), nij, ijstart);
     }
+    else
+        PRead_(data, elsize*nij*inaux, elsize*ijstart*inaux);
+}
 
-    file_->exceptions(std::fstream::failbit | std::fstream::badbit | std::fstream::eofbit);
-    return true;
+void DiskQTensor::ReadByQRaw_(char * data, int nq, int qstart)
+{
+    size_t indim12 = ndim12();
+    size_t elsize = ElementSize_();
+
+    if(byq())
+        PRead_(data, elsize*nq*indim12, elsize*qstart*indim12);
+    else
+    {
+        if(isfloat())
+            ReadColumns_(reinterpret_cast<float *>(data), ndim12(), 0, ndim12(), naux(), nq, qstart);
+        else
+            ReadColumns_(reinterpret_cast<double *>(data), ndim12(), 0, ndim12(), naux(), nq, qstart);
+    }
 }
 
 
-void DiskQTensor::Init_(void)
+void DiskQTensor::ReadRegion_(char * data, int row0, int nrow, int col0, int ncol)
 {
-    WriteDimFile_();
-    // Nothing else to really do here. Reserve a big file?
+    size_t elsize = ElementSize_();
+    size_t rowbytes = elsize*(byq() ? ndim12() : naux());
+    size_t nbytes = elsize*ncol;
+
+    if(nbytes == rowbytes)
+        PRead_(data, nrow*rowbytes, row0*rowbytes);
+    else
+    {
+        for(int r = 0; r < nrow; r++)
+            PRead_(data + r*nbytes, nbytes, (row0+r)*rowbytes + col0*elsize);
+    }
 }
 
 
-DiskQTensor::DiskQTensor(int storeflags, const std::string & name, const std::string & directory) 
-             : LocalQTensor(storeflags, name, directory)
+// Gathers are done by reading rectangular regions of the file.
+// By ij, runs of consecutive orbital indices are read together. By q,
+// each row is read from the first to the last orbital index wanted.
+
+template<typename T>
+void DiskQTensor::GatherRegions_(double * data, const int * ij, int nij, int qstart, int nq)
 {
-    if(file_ && file_->is_open())
-        return;
+    if(!byq())
+    {
+        // regions go straight into the output if they are in double precision
+        bool direct = (sizeof(T) == sizeof(double));
+        int maxrun = nij;
+        std::unique_ptr<T[]> buf;
 
-    if(filename_.length() == 0 || name.length() == 0)
-        throw RuntimeError("Error - no file specified!");
+        if(!direct)
+        {
+            size_t nfit = std::max(static_cast<size_t>(1), workspace() / (sizeof(T)*nq));
+            maxrun = static_cast<int>(std::min(nfit, static_cast<size_t>(nij)));
+            buf = std::unique_ptr<T[]>(new T[static_cast<size_t>(maxrun)*nq]);
+        }
 
+        for(int k = 0; k < nij; )
+        {
+            int run = 1;
+            while(k + run < nij && run < maxrun && ij[k+run] == ij[k] + run)
+                run++;
+
+            double * out = data + static_cast<size_t>(k)*nq;
+
+            if(direct)
+                ReadRegion_(reinterpret_cast<char *>(out), ij[k], run, qstart, nq);
+            else
+            {
+                ReadRegion_(reinterpret_cast<char *>(buf.get()), ij[k], run, qstart, nq);
+                std::copy(buf.get(), buf.get() + static_cast<size_t>(run)*nq, out);
+            }
 
-    if(existed_ && (storeflags & QSTORAGE_READDISK))
+            k += run;
+        }
+    }
+    else
     {
-        OpenForRead_(true);  // false = not required
-        ReadDimFile_();
-        markfilled();
+        auto range = std::minmax_element(ij, ij + nij);
+        int ij0 = *range.first;
+        size_t span = *range.second - ij0 + 1;
+
+        size_t nfit = std::max(static_cast<size_t>(1), workspace() / (sizeof(T)*span));
+        int nqbatch = static_cast<int>(std::min(nfit, static_cast<size_t>(nq)));
+        std::unique_ptr<T[]> buf(new T[nqbatch*span]);
+
+        for(int q0 = 0; q0 < nq; q0 += nqbatch)
+        {
+            int n = std::min(nqbatch, nq - q0);
+            ReadRegion_(reinterpret_cast<char *>(buf.get()), qstart + q0, n, ij0, static_cast<int>(span));
+
+            for(int q = 0; q < n; q++)
+            {
+                const T * row = buf.get() + q*span - ij0;
+                for(size_t k = 0, koff = q0+q; k < static_cast<size_t>(nij); k++, koff += nq)
+                    data[koff] = row[ij[k]];
+            }
+        }
     }
+}
 
-    if(!(storeflags & QSTORAGE_READDISK) || !existed_)
-        OpenForReadWrite_();
+void DiskQTensor::Gather_(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    if(isfloat())
+        GatherRegions_<float>(data, ij, nij, qstart, nq);
+    else
+        GatherRegions_<double>(data, ij, nij, qstart, nq);
 }
 
 
-void DiskQTensor::ReadDimFile_(void)
+void DiskQTensor::StripeIO_(char * data, size_t nbytes, size_t offset, bool write)
 {
-    std::ifstream dim(dimfilename_.c_str());
+    if(nstripe_ == 1)
+    {
+        if(write)
+            FileWrite_(fds_[0], data, nbytes, DataOffset_() + offset);
+        else
+            FileRead_(fds_[0], data, nbytes, DataOffset_() + offset);
+        return;
+    }
 
-    if(!dim.is_open())
-        throw RuntimeError(std::string("Unable to open file ") + dimfilename_);
+    // Does the part of each stripe, one piece at a time
+    auto DoStripe = [=](int stripe) -> int
+    {
+        size_t piece = offset / stripebytes_;
+        size_t end = offset + nbytes;
 
-    dim.exceptions(std::fstream::failbit | std::fstream::badbit | std::fstream::eofbit);
+        // first piece of this stripe at or after the start
+        piece += (stripe + nstripe_ - (piece % nstripe_)) % nstripe_;
 
-    dim >> f_naux_ >> f_ndim1_ >> f_ndim2_ >> f_ndim12_ >> f_packed_ >> f_byq_;
+        for(; piece*stripebytes_ < end; piece += nstripe_)
+        {
+            size_t pstart = std::max(offset, piece*stripebytes_);
+            size_t pend = std::min(end, (piece+1)*stripebytes_);
+            size_t fileoff = DataOffset_() + (piece / nstripe_)*stripebytes_ + (pstart - piece*stripebytes_);
 
-    std::stringstream ss;
- 
-    // careful. byq() and ibyq are both ints and would represent QSTORAGE_BYQ, etc, not just a simple bool
-    if(f_byq_ != byq())
-    {
-        ss << "Tensor " << name() << " does not match orientation from file " << dimfilename_
-           << " Here: " << byq() << " disk: " << f_byq_ << "\n";
-        throw RuntimeError(ss.str());
-    }
+            if(write)
+                FileWrite_(fds_[stripe], data + (pstart - offset), pend - pstart, fileoff);
+            else
+                FileRead_(fds_[stripe], data + (pstart - offset), pend - pstart, fileoff);
+        }
+        return 0;
+    };
 
-    // same here
-    if(f_packed_ != packed())
-    {
-        ss << "Tensor " << name() << " does not match packed-ness from file " << dimfilename_
-           << " Here: " << packed() << " disk: " << f_packed_ << "\n";
-        throw RuntimeError(ss.str());
-    }
+    size_t firstpiece = offset / stripebytes_;
+    size_t npiece = (nbytes == 0) ? 0 : (offset + nbytes - 1) / stripebytes_ - firstpiece + 1;
+    int nused = static_cast<int>(std::min(npiece, static_cast<size_t>(nstripe_)));
+
+    // All stripes in use are done at the same time. The
+    // first is done by this thread.
+    std::vector<std::future<int>> others;
+    for(int i = 1; i < nused; i++)
+        others.push_back(std::async(std::launch::async, DoStripe, static_cast<int>((firstpiece + i) % nstripe_)));
+
+    if(nused > 0)
+        DoStripe(static_cast<int>(firstpiece % nstripe_));
 
-    Init(f_naux_, f_ndim1_, f_ndim2_);
+    for(auto & it : others)
+        it.get();
 }
 
-void DiskQTensor::WriteDimFile_(void)
+void DiskQTensor::PWrite_(const char * data, size_t nbytes, size_t offset)
 {
-    std::ofstream dim(dimfilename_.c_str(), std::ofstream::trunc);
+    StripeIO_(const_cast<char *>(data), nbytes, offset, true);
+}
 
-    if(!dim.is_open())
-        throw RuntimeError(std::string("Unable to open file ") + dimfilename_);
+void DiskQTensor::PRead_(char * data, size_t nbytes, size_t offset)
+{
+    // check data read from an existing file
+    if(readonly_)
+        VerifyChunks_(offset, nbytes);
 
-    dim.exceptions(std::fstream::failbit | std::fstream::badbit | std::fstream::eofbit);
+    StripeIO_(data, nbytes, offset, false);
+}
 
-    // careful. byq() and packed() are both ints and would represent QSTORAGE_BYQ, etc, not just a simple bool
-    dim << naux() << " " << ndim1() << " " << ndim2() << " "
-        << ndim12() << " " << packed() << " "
-        << byq() << " END";  //Sorry, the "END" is a cheap hack so that ReadDimFile_ doesn't
-                             // throw with EOF
+void DiskQTensor::ReadData_(char * data, size_t nbytes, size_t offset)
+{
+    StripeIO_(data, nbytes, offset, false);
 }
 
-void DiskQTensor::GenDFQso_(const SharedFittingMetric fit,
-                            const SharedBasisSet primary,
-                            const SharedBasisSet auxiliary,
-                            int nthreads)
+size_t DiskQTensor::ElementSize_(void) const
 {
-    int maxpershell = primary->max_function_per_shell();
-    int maxpershell2 = maxpershell*maxpershell;
+    return (isfloat() ? sizeof(float) : sizeof(double));
+}
 
-    double * J = fit->get_metric();
 
-    // default constructor = zero basis
-    SharedBasisSet zero(new BasisSet);
+// If the data is already in the precision stored on disk, it is written
+// and read directly. Otherwise, it goes through a converted copy.
 
-    std::vector<SharedTwoBodyAOInt> eris;
-    std::vector<const double *> eribuffers;
-    std::vector<double *> A, B;
+void DiskQTensor::Write_(double * data, int nij, int ijstart)
+{
+    if(!isfloat())
+        WriteRaw_(reinterpret_cast<const char *>(data), nij, ijstart);
+    else
+    {
+        std::unique_ptr<float[]> conv(new float[static_cast<size_t>(nij)*naux()]);
+        std::copy(data, data + static_cast<size_t>(nij)*naux(), conv.get());
+        WriteRaw_(reinterpret_cast<const char *>(conv.get()), nij, ijstart);
+    }
+}
 
-    int naux = StoredQTensor::naux();
+void DiskQTensor::Write_(float * data, int nij, int ijstart)
+{
+    if(isfloat())
+        WriteRaw_(reinterpret_cast<const char *>(data), nij, ijstart);
+    else
+    {
+        std::unique_ptr<double[]> conv(new double[static_cast<size_t>(nij)*naux()]);
+        std::copy(data, data + static_cast<size_t>(nij)*naux(), conv.get());
+        WriteRaw_(reinterpret_cast<const char *>(conv.get()), nij, ijstart);
+    }
+}
 
-    for(int i = 0; i < nthreads; i++)
+void DiskQTensor::WriteByQ_(double * data, int nq, int qstart)
+{
+    if(!isfloat())
+        WriteByQRaw_(reinterpret_cast<const char *>(data), nq, qstart);
+    else
     {
-        eris.push_back(GetERI(auxiliary, zero, primary, primary));
-        eribuffers.push_back(eris.back()->buffer());
+        std::unique_ptr<float[]> conv(new float[static_cast<size_t>(nq)*ndim12()]);
+        std::copy(data, data + static_cast<size_t>(nq)*ndim12(), conv.get());
+        WriteByQRaw_(reinterpret_cast<const char *>(conv.get()), nq, qstart);
+    }
+}
 
-        // temporary buffers
-        A.push_back(new double[naux*maxpershell2]);
-        B.push_back(new double[naux*maxpershell2]);
+void DiskQTensor::WriteByQ_(float * data, int nq, int qstart)
+{
+    if(isfloat())
+        WriteByQRaw_(reinterpret_cast<const char *>(data), nq, qstart);
+    else
+    {
+        std::unique_ptr<double[]> conv(new double[static_cast<size_t>(nq)*ndim12()]);
+        std::copy(data, data + static_cast<size_t>(nq)*ndim12(), conv.get());
+        WriteByQRaw_(reinterpret_cast<const char *>(conv.get()), nq, qstart);
     }
+}
 
+void DiskQTensor::Read_(double * data, int nij, int ijstart)
+{
+    if(!isfloat())
+        ReadRaw_(reinterpret_cast<char *>(data), nij, ijstart);
+    else
+    {
+        std::unique_ptr<float[]> conv(new float[static_cast<size_t>(nij)*naux()]);
+        ReadRaw_(reinterpret_cast<char *>(conv.get()), nij, ijstart);
+        std::copy(conv.get(), conv.get() + static_cast<size_t>(nij)*naux(), data);
+    }
+}
 
-    const int nprimshell = primary->nshell();
-    const int nauxshell = auxiliary->nshell();
+void DiskQTensor::Read_(float * data, int nij, int ijstart)
+{
+    if(isfloat())
+        ReadRaw_(reinterpret_cast<char *>(data), nij, ijstart);
+    else
+    {
+        std::unique_ptr<double[]> conv(new double[static_cast<size_t>(nij)*naux()]);
+        ReadRaw_(reinterpret_cast<char *>(conv.get()), nij, ijstart);
+        std::copy(conv.get(), conv.get() + static_cast<size_t>(nij)*naux(), data);
+    }
+}
 
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
-#endif
-    for (int M = 0; M < nprimshell; M++)
+void DiskQTensor::ReadByQ_(double * data, int nq, int qstart)
+{
+    if(!isfloat())
+        ReadByQRaw_(reinterpret_cast<char *>(data), nq, qstart);
+    else
     {
-        int threadnum = 0;
+        std::unique_ptr<float[]> conv(new float[static_cast<size_t>(nq)*ndim12()]);
+        ReadByQRaw_(reinterpret_cast<char *>(conv.get()), nq, qstart);
+        std::copy(conv.get(), conv.get() + static_cast<size_t>(nq)*ndim12(), data);
+    }
+}
 
-#ifdef _OPENMP
-        threadnum = omp_get_thread_num();
-#endif
+void DiskQTensor::ReadByQ_(float * data, int nq, int qstart)
+{
+    if(isfloat())
+        ReadByQRaw_(reinterpret_cast<char *>(data), nq, qstart);
+    else
+    {
+        std::unique_ptr<double[]> conv(new double[static_cast<size_t>(nq)*ndim12()]);
+        ReadByQRaw_(reinterpret_cast<char *>(conv.get()), nq, qstart);
+        std::copy(conv.get(), conv.get() + static_cast<size_t>(nq)*ndim12(), data);
+    }
+}
 
-        int nm = primary->shell(M).nfunction();
-        int mstart = primary->shell(M).function_index();
-        int mend = mstart + nm;
 
-        for (int N = 0; N <= M; N++)
-        {
-            int nn = primary->shell(N).nfunction();
-            int nstart = primary->shell(N).function_index();
-            //int nend = nstart + nn;
+bool DiskQTensor::Open_(bool readonly)
+{
+    readonly_ = readonly;
+
+    for(const auto & fname : filenames_)
+    {
+        int fd;
+        if(readonly)
+            fd = open(fname.c_str(), O_RDONLY);
+        else
+            fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
 
-            for (int P = 0; P < nauxshell; P++)
+        if(fd < 0)
+        {
+            // only the first file is checked for existence
+            if(readonly && errno == ENOENT)
             {
-                int np = auxiliary->shell(P).nfunction();
-                int pstart = auxiliary->shell(P).function_index();
-                int pend = pstart + np;
-
-                int ncalc = eris[threadnum]->compute_shell(P,0,M,N);
-
-                if(ncalc)
-                {
-                    for (int p = pstart, index = 0; p < pend; p++)
-                    {
-                        for (int m = 0; m < nm; m++)
-                        {
-                            for (int n = 0; n < nn; n++, index++)
-                            {
-                                B[threadnum][p*nm*nn + m*nn + n] = eribuffers[threadnum][index];
-                            }
-                        }
-                    }
-                }
+                output::printf("  Not reusing file %s, since %s does not exist. It will be regenerated.\n",
+                               filename_.c_str(), fname.c_str());
+                existed_ = false;
+                Close_();
+                return false;
             }
 
-            // we now have a set of columns of B, although "condensed"
-            // we can do a DGEMM with J
-            // Access to J are only reads, so that is safe in parallel
-            C_DGEMM('T','T',nm*nn, naux, naux, 1.0, B[threadnum], nm*nn, J, naux, 0.0,
-                    A[threadnum], naux);
+            Close_();
+            throw RuntimeError(std::string("Unable to open file ") + fname + ": " + strerror(errno));
+        }
 
+        fds_.push_back(fd);
+    }
 
-            // write to disk or store in memory
-            if(N == M)
-            {
-                int iwrite = 1;
-                for (int m0 = 0, m = mstart; m < mend; m0++, m++)
-                    Write_(A[threadnum] + (m0*nm)*naux, iwrite++, calcindex(m, mstart));
-            }
-            else
-            {
-                for (int m0 = 0, m = mstart; m < mend; m0++, m++)
-                    Write_(A[threadnum] + (m0*nn)*naux, nn, calcindex(m, nstart));
-            }
-        }
+    return true;
+}
+
+
+void DiskQTensor::Close_(void)
+{
+    for(int fd : fds_)
+        close(fd);
+    fds_.clear();
+}
+
+
+void DiskQTensor::Init_(void)
+{
+    if(readonly_)
+        return;
+
+    for(int i = 0; i < nstripe_; i++)
+    {
+        // Not complete until the checksums are written
+        WriteHeader_(fds_[i], false, i);
+
+        // Reserve the whole file, so that reads of
+        // parts not yet written don't hit the end of the file
+        size_t nbytes = DataOffset_() + StripeDataBytes_(i);
+        if(ftruncate(fds_[i], static_cast<off_t>(nbytes)) != 0)
+            throw RuntimeError(std::string("Unable to resize file ") + filenames_[i] + ": " + strerror(errno));
     }
+}
 
-    for(int i = 0; i < nthreads; i++)
+
+DiskQTensor::DiskQTensor(int storeflags, const std::string & name, const std::string & directory,
+                         const QTensorOrigin & origin) 
+             : LocalQTensor(storeflags, name, directory, origin), readonly_(false)
+{
+    if(filename_.length() == 0 || name.length() == 0)
+        throw RuntimeError("Error - no file specified!");
+
+    nstripe_ = static_cast<int>(filenames_.size());
+    if(nstripe_ > 1)
+        stripebytes_ = DISK_STRIPE_BYTES;
+
+    if(existed_ && (storeflags & QSTORAGE_READDISK) && Open_(true))
     {
-        delete [] A[i];
-        delete [] B[i];
+        // if the files can't be used, the tensor is regenerated
+        bool ok = ReadHeader_(fds_[0], 0);
+        for(int i = 1; ok && i < nstripe_; i++)
+            ok = ReadHeader_(fds_[i], i);
+
+        if(ok)
+            markfilled();
+        else
+            Close_();
     }
+
+    if(!filled())
+        Open_(false);
 }
 
 
 DiskQTensor::~DiskQTensor()
 {
-    if(file_ && file_->is_open())
+    // Finish files that are being kept. If that fails, the
+    // files are left marked incomplete and won't be reused.
+    if((storeflags() & QSTORAGE_KEEPDISK) && !readonly_ && filled() && fds_.size() > 0)
     {
-        file_->close();
-        file_.reset();
+        try {
+            for(int i = 1; i < nstripe_; i++)
+                WriteHeader_(fds_[i], true, i);
+            WriteChecksums_(fds_[0]);
+        }
+        catch(const std::exception & ex)
+        {
+            output::printf("  Unable to finish writing file %s: %s\n", filename_.c_str(), ex.what());
+        }
     }
 
-    // Erase the file
+    Close_();
+
+    // Erase the files
     if(!(storeflags() & QSTORAGE_KEEPDISK))
     {
-        std::remove(filename_.c_str());
-        std::remove(dimfilename_.c_str());
+        for(const auto & fname : filenames_)
+            std::remove(fname.c_str());
     }
 }
 
 
 DiskQTensor::DiskQTensor(MemoryQTensor * memqt) 
-                 : DiskQTensor(memqt->storeflags(), memqt->name(), memqt->directory())
+                 : DiskQTensor(memqt->storeflags() & ~QSTORAGE_READDISK, memqt->name(),
+                               memqt->directory(), memqt->origin())
 {
+    // (the file is always rewritten)
+
     // initialize sizes
     // from StoredQTensor base class
     Init(*memqt);
 
+    // keep the precision it is stored in
+    if(isfloat())
+        CopyFrom_<float>(memqt);
+    else
+        CopyFrom_<double>(memqt);
+
+    markfilled();
+}
+
+
+// Size of the buffer used when copying from memory
+#define DISK_COPY_BLOCK_BYTES (32*1024*1024)
+
+template<typename T>
+void DiskQTensor::CopyFrom_(MemoryQTensor * memqt)
+{
     int inaux = naux();
     int indim12 = ndim12();
 
-    // do in blocks
+    // do in large blocks, in the orientation
+    // both tensors are stored in
     if(byq())
     {
-        std::unique_ptr<double[]> buf(new double[indim12]);
-        double * bufptr = buf.get();
+        int nq = std::max(static_cast<size_t>(1), DISK_COPY_BLOCK_BYTES / (sizeof(T)*indim12));
+        nq = std::min(nq, inaux);
+
+        std::unique_ptr<T[]> buf(new T[static_cast<size_t>(nq)*indim12]);
+        T * bufptr = buf.get();
   
-        for(int i = 0; i < inaux; i++)
+        for(int q = 0; q < inaux; q += nq)
         {
-            memqt->ReadByQ(bufptr, 1, i);
-            WriteByQ_(bufptr, 1, i);
+            int n = memqt->ReadByQ(bufptr, nq, q);
+            WriteByQ_(bufptr, n, q);
         }
     }
     else
     {
-        std::unique_ptr<double[]> buf(new double[inaux]);
-        double * bufptr = buf.get();
+        int nij = std::max(static_cast<size_t>(1), DISK_COPY_BLOCK_BYTES / (sizeof(T)*inaux));
+        nij = std::min(nij, indim12);
+
+        std::unique_ptr<T[]> buf(new T[static_cast<size_t>(nij)*inaux]);
+        T * bufptr = buf.get();
 
-        for(int i = 0; i < indim12; i++)
+        for(int ij = 0; ij < indim12; ij += nij)
         {
-            memqt->Read(bufptr, 1, i);
-            Write_(bufptr, 1, i);
+            int n = memqt->Read(bufptr, nij, ij);
+            Write_(bufptr, n, ij);
         }
     }
 }
 
 
-void DiskQTensor::Finalize_(int nthreads)
-{
-    // Nothing to do?
-    fittingmetric_.reset();
-}
-
-
-
 } // close namespace panache
 
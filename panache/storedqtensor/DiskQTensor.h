@@ -7,8 +7,6 @@
 #ifndef PANACHE_DISKQTENSOR_H
 #define PANACHE_DISKQTENSOR_H
 
-#include <fstream>
-
 #include "panache/storedqtensor/LocalQTensor.h"
 
 namespace panache
@@ -19,6 +17,17 @@ class MemoryQTensor;
 /*!
  *  \brief Class for storing a 3-index tensor on disk
  *  \ingroup storedqgroup
+ *
+ *  The file is accessed with positional reads and writes (pread/pwrite), so
+ *  reads from multiple threads proceed in parallel, as do writes to
+ *  different parts of the tensor.
+ *
+ *  If the file is kept (QSTORAGE_KEEPDISK), checksums are written when
+ *  the tensor is destroyed.
+ *
+ *  If several directories are given (separated by ':'), the data is striped
+ *  across a file in each, with pieces of the data going to each file in turn.
+ *  Parts of a read or write that go to different files are done in parallel.
  */
 class DiskQTensor : public LocalQTensor
 {
@@ -28,9 +37,12 @@ public:
      *
      * \param [in] storeflags How the tensor should be stored (packed, etc)
      * \param [in] name Some descriptive name
-     * \param [in] directory Directory where to store the files
+     * \param [in] directory Directory where to store the files (or a list
+     *                       of directories separated by ':', to stripe across)
+     * \param [in] origin Calculation the tensor comes from
      */
-    DiskQTensor(int storeflags, const std::string & name, const std::string & directory);
+    DiskQTensor(int storeflags, const std::string & name, const std::string & directory,
+                const QTensorOrigin & origin);
 
     DiskQTensor(MemoryQTensor * memqt);
 
@@ -42,31 +54,95 @@ protected:
     virtual void WriteByQ_(double * data, int nij, int ijstart);
     virtual void Read_(double * data, int nij, int ijstart);
     virtual void ReadByQ_(double * data, int nq, int qstart);
+    virtual void Write_(float * data, int nij, int ijstart);
+    virtual void WriteByQ_(float * data, int nq, int qstart);
+    virtual void Read_(float * data, int nij, int ijstart);
+    virtual void ReadByQ_(float * data, int nq, int qstart);
     virtual void Init_(void);
-    virtual void Finalize_(int nthreads);
 
     // Now in LocalQTensor class
+    //virtual void Finalize_(int nthreads);
     //virtual void NoFinalize_(void);
+    //virtual void GenDFQso_(const SharedFittingMetric fit, const SharedBasisSet primary,
+    //                       const SharedBasisSet auxiliary, int nthreads);
+
+    virtual void ReadData_(char * data, size_t nbytes, size_t offset);
+    virtual void Gather_(double * data, const int * ij, int nij, int qstart, int nq);
+
+    bool readonly_; //!< Files were opened read-only (QSTORAGE_READDISK)
+
+    /// Size of an element on disk (float or double)
+    size_t ElementSize_(void) const;
+
+    // Read and write data in the precision stored on disk
+    virtual void WriteRaw_(const char * data, int nij, int ijstart);
+    virtual void WriteByQRaw_(const char * data, int nq, int qstart);
+    virtual void ReadRaw_(char * data, int nij, int ijstart);
+    virtual void ReadByQRaw_(char * data, int nq, int qstart);
+
+    /*!
+     * \brief Read some columns of the matrix stored on disk, transposed
+     *
+     * The file holds a matrix with rows of length \p rowlen. Columns [\p col0, \p col0 + \p ncol)
+     * of rows [\p row0, \p row0 + \p nrow) are read in tiles of rows and stored in \p data
+     * as an \p ncol x \p nrow matrix with leading dimension \p lddata.
+     */
+    template<typename T>
+    void ReadColumns_(T * data, size_t lddata, int row0, int nrow, int rowlen, int ncol, int col0);
+
+    /*!
+     * \brief Write some columns of the matrix stored on disk, from a transposed buffer
+     *
+     * Opposite of ReadColumns_().
+     */
+    template<typename T>
+    void WriteColumns_(const T * data, size_t lddata, int row0, int nrow, int rowlen, int ncol, int col0);
+
+    /*!
+     * \brief Read a rectangular part of the matrix stored on disk
+     *
+     * Columns [\p col0, \p col0 + \p ncol) of rows [\p row0, \p row0 + \p nrow)
+     * are stored in \p data as an \p nrow x \p ncol matrix (in the precision stored).
+     * Rows are read in one piece if \p ncol is the whole row.
+     */
+    virtual void ReadRegion_(char * data, int row0, int nrow, int col0, int ncol);
+
+    /// Write to the file at a given offset (in bytes, from the start of the data)
+    void PWrite_(const char * data, size_t nbytes, size_t offset);
 
-    virtual void GenDFQso_(const SharedFittingMetric fit,
-                           const SharedBasisSet primary,
-                           const SharedBasisSet auxiliary,
-                           int nthreads);
+    /// Read from the file at a given offset (in bytes, from the start of the data)
+    void PRead_(char * data, size_t nbytes, size_t offset);
 
 private:
-    std::unique_ptr<std::fstream> file_;
-
-    int f_naux_; //!< naux on the dim file
-    int f_ndim1_; //!< ndim1 on the dim file
-    int f_ndim2_; //!< ndim2 on the dim file
-    int f_ndim12_; //!< ndim12 on the dim file
-    int f_packed_; //!< ispacked on the dim file
-    int f_byq_; //!< byq on the dim file
-
-    void ReadDimFile_(void);
-    void WriteDimFile_(void);
-    void OpenForReadWrite_(void);
-    bool OpenForRead_(bool required);
+    std::vector<int> fds_; //!< Descriptors of the open files, one per stripe (empty if not open)
+
+    /// Gather_() for a file in the given precision
+    template<typename T>
+    void GatherRegions_(double * data, const int * ij, int nij, int qstart, int nq);
+
+    /// Copy all data from a tensor in memory, in the given precision
+    template<typename T>
+    void CopyFrom_(MemoryQTensor * memqt);
+
+    /*!
+     * \brief Open the files (truncating them if not \p readonly)
+     *
+     * \return False if \p readonly and one of the files for the stripes can't be opened
+     */
+    bool Open_(bool readonly);
+
+    /// Close the files (if open)
+    void Close_(void);
+
+    /*!
+     * \brief Read or write part of the data, split across the stripes
+     *
+     * \param [in] data Data to read or write
+     * \param [in] nbytes Number of bytes to read or write
+     * \param [in] offset Where to start (in bytes, from the start of the data)
+     * \param [in] write True to write, false to read
+     */
+    void StripeIO_(char * data, size_t nbytes, size_t offset, bool write);
 };
 
 } // close namespace panache
@@ -0,0 +1,231 @@
+/*! \file
+ * \brief Three-index tensor storage partly in memory, partly on disk (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <algorithm>
+
+#include "panache/Flags.h"
+#include "panache/storedqtensor/HybridQTensor.h"
+#include "panache/Output.h"
+
+namespace panache
+{
+
+HybridQTensor::HybridQTensor(int storeflags, const std::string & name, const std::string & directory,
+                             const QTensorOrigin & origin, size_t maxmem)
+              : DiskQTensor(storeflags, name, directory, origin),
+                maxmem_(maxmem), nres_(0)
+{
+    // An existing file was read by the DiskQTensor constructor,
+    // (which only checked the header). Bring part of it into memory
+    if(filled())
+    {
+        Allocate_();
+        PRead_(res_.get(), static_cast<size_t>(nres_)*rowlen_()*ElementSize_(), 0);
+    }
+}
+
+
+HybridQTensor::~HybridQTensor()
+{
+    // The rows in memory must be written for the file to be complete.
+    // The checksums are then written by the DiskQTensor destructor
+    if((storeflags() & QSTORAGE_KEEPDISK) && !readonly_ && filled() && nres_ > 0)
+    {
+        try {
+            PWrite_(res_.get(), static_cast<size_t>(nres_)*rowlen_()*ElementSize_(), 0);
+        }
+        catch(const std::exception & ex)
+        {
+            output::printf("  Unable to finish writing file %s: %s\n", filename_.c_str(), ex.what());
+        }
+    }
+}
+
+
+size_t HybridQTensor::MemoryUsed(void) const
+{
+    return static_cast<size_t>(nres_)*rowlen_()*ElementSize_();
+}
+
+
+int HybridQTensor::nrow_(void) const
+{
+    return (byq() ? naux() : ndim12());
+}
+
+
+int HybridQTensor::rowlen_(void) const
+{
+    return (byq() ? ndim12() : naux());
+}
+
+
+void HybridQTensor::Allocate_(void)
+{
+    size_t rowbytes = static_cast<size_t>(rowlen_())*ElementSize_();
+
+    if(rowbytes == 0)
+        nres_ = nrow_();
+    else
+        nres_ = static_cast<int>(std::min(maxmem_ / rowbytes, static_cast<size_t>(nrow_())));
+
+    res_ = std::unique_ptr<char[]>(new char[nres_*rowbytes]);
+}
+
+
+void HybridQTensor::Init_(void)
+{
+    // sets up the file (which is the full size,
+    // but is not written where the rows are in memory)
+    DiskQTensor::Init_();
+    Allocate_();
+}
+
+
+void HybridQTensor::RowIO_(char * data, int n, int start, bool write)
+{
+    size_t rowbytes = static_cast<size_t>(rowlen_())*ElementSize_();
+
+    // rows in memory
+    int nmem = std::max(0, std::min(start + n, nres_) - start);
+
+    if(nmem > 0)
+    {
+        char * mem = res_.get() + start*rowbytes;
+
+        if(write)
+            std::copy(data, data + nmem*rowbytes, mem);
+        else
+            std::copy(mem, mem + nmem*rowbytes, data);
+    }
+
+    // the rest are contiguous on disk
+    if(n > nmem)
+    {
+        size_t nbytes = (n-nmem)*rowbytes;
+        size_t offset = (start+nmem)*rowbytes;
+
+        if(write)
+            PWrite_(data + nmem*rowbytes, nbytes, offset);
+        else
+            PRead_(data + nmem*rowbytes, nbytes, offset);
+    }
+}
+
+
+template<typename T>
+void HybridQTensor::ReadCols_(T * data, int ncol, int col0)
+{
+    size_t nrow = nrow_();
+    size_t rowlen = rowlen_();
+    const T * mem = reinterpret_cast<const T *>(res_.get());
+
+    for(size_t r = 0; r < static_cast<size_t>(nres_); r++)
+    {
+        const T * memrow = mem + r*rowlen + col0;
+        for(size_t c = 0; c < static_cast<size_t>(ncol); c++)
+            data[c*nrow + r] = memrow[c];
+    }
+
+    if(nres_ < nrow_())
+        ReadColumns_(data + nres_, nrow, nres_, nrow_() - nres_, rowlen_(), ncol, col0);
+}
+
+
+template<typename T>
+void HybridQTensor::WriteCols_(const T * data, int ncol, int col0)
+{
+    size_t nrow = nrow_();
+    size_t rowlen = rowlen_();
+    T * mem = reinterpret_cast<T *>(res_.get());
+
+    for(size_t r = 0; r < static_cast<size_t>(nres_); r++)
+    {
+        T * memrow = mem + r*rowlen + col0;
+        for(size_t c = 0; c < static_cast<size_t>(ncol); c++)
+            memrow[c] = data[c*nrow + r];
+    }
+
+    if(nres_ < nrow_())
+        WriteColumns_(data + nres_, nrow, nres_, nrow_() - nres_, rowlen_(), ncol, col0);
+}
+
+
+// Reads and writes in the orientation the tensor is stored in
+// are whole rows. Otherwise, they are parts of every row.
+
+void HybridQTensor::WriteRaw_(const char * data, int nij, int ijstart)
+{
+    if(!byq())
+        RowIO_(const_cast<char *>(data), nij, ijstart, true);
+    else if(isfloat())
+        WriteCols_(reinterpret_cast<const float *>(data), nij, ijstart);
+    else
+        WriteCols_(reinterpret_cast<const double *>(data), nij, ijstart);
+}
+
+void HybridQTensor::WriteByQRaw_(const char * data, int nq, int qstart)
+{
+    if(byq())
+        RowIO_(const_cast<char *>(data), nq, qstart, true);
+    else if(isfloat())
+        WriteCols_(reinterpret_cast<const float *>(data), nq, qstart);
+    else
+        WriteCols_(reinterpret_cast<const double *>(data), nq, qstart);
+}
+
+void HybridQTensor::ReadRaw_(char * data, int nij, int ijstart)
+{
+    if(!byq())
+        RowIO_(data, nij, ijstart, false);
+    else if(isfloat())
+        ReadCols_(reinterpret_cast<float *>(data), nij, ijstart);
+    else
+        ReadCols_(reinterpret_cast<double *>(data), nij, ijstart);
+}
+
+void HybridQTensor::ReadByQRaw_(char * data, int nq, int qstart)
+{
+    if(byq())
+        RowIO_(data, nq, qstart, false);
+    else if(isfloat())
+        ReadCols_(reinterpret_cast<float *>(data), nq, qstart);
+    else
+        ReadCols_(reinterpret_cast<double *>(data), nq, qstart);
+}
+
+
+void HybridQTensor::ReadRegion_(char * data, int row0, int nrow, int col0, int ncol)
+{
+    size_t elsize = ElementSize_();
+    size_t rowbytes = static_cast<size_t>(rowlen_())*elsize;
+    size_t nbytes = elsize*ncol;
+
+    // rows in memory
+    int nmem = std::max(0, std::min(row0 + nrow, nres_) - row0);
+
+    for(int r = 0; r < nmem; r++)
+    {
+        const char * mem = res_.get() + (row0+r)*rowbytes + col0*elsize;
+        std::copy(mem, mem + nbytes, data + r*nbytes);
+    }
+
+    // the rest are on disk
+    if(nrow > nmem)
+        DiskQTensor::ReadRegion_(data + nmem*nbytes, row0 + nmem, nrow - nmem, col0, ncol);
+}
+
+
+const double * HybridQTensor::View_(bool byqview, int n, int start)
+{
+    // only rows kept in memory, in double precision
+    if(isfloat() || byqview != (byq() != 0) || start + n > nres_)
+        return nullptr;
+
+    return reinterpret_cast<const double *>(res_.get()) + static_cast<size_t>(start)*rowlen_();
+}
+
+} // close namespace panache
+
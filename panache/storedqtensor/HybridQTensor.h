@@ -0,0 +1,101 @@
+/*! \file
+ * \brief Three-index tensor storage partly in memory, partly on disk (header)
+ * \ingroup storedqgroup
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_HYBRIDQTENSOR_H
+#define PANACHE_HYBRIDQTENSOR_H
+
+#include "panache/storedqtensor/DiskQTensor.h"
+
+namespace panache
+{
+
+/*!
+ *  \brief Class for storing a 3-index tensor partly in memory and partly on disk
+ *  \ingroup storedqgroup
+ *
+ *  The tensor is stored as a matrix whose rows are the slowest index (q if
+ *  stored by q, ij otherwise). As many of the leading rows as fit in the
+ *  memory given to the constructor are kept in memory, and the rest are
+ *  stored in a file, as in DiskQTensor. Reading in the orientation the tensor
+ *  is stored in then reads mostly from memory and, if it goes past the rows in
+ *  memory, continues with one contiguous read of the file.
+ *
+ *  The file has the same layout as the one written by DiskQTensor (the part
+ *  for the rows in memory is left empty until the file is finished), so
+ *  QSTORAGE_KEEPDISK and QSTORAGE_READDISK work the same way, and
+ *  files can be shared between the two.
+ */
+class HybridQTensor : public DiskQTensor
+{
+public:
+    /*
+     * \brief Construct with some basic information
+     *
+     * \param [in] storeflags How the tensor should be stored (packed, etc)
+     * \param [in] name Some descriptive name
+     * \param [in] directory Directory where to store the files (or a list
+     *                       of directories separated by ':', to stripe across)
+     * \param [in] origin Calculation the tensor comes from
+     * \param [in] maxmem Memory available for the rows kept in memory (in bytes)
+     */
+    HybridQTensor(int storeflags, const std::string & name, const std::string & directory,
+                  const QTensorOrigin & origin, size_t maxmem);
+
+    virtual ~HybridQTensor();
+
+    virtual size_t MemoryUsed(void) const;
+
+protected:
+    virtual void Init_(void);
+
+    virtual void WriteRaw_(const char * data, int nij, int ijstart);
+    virtual void WriteByQRaw_(const char * data, int nq, int qstart);
+    virtual void ReadRaw_(char * data, int nij, int ijstart);
+    virtual void ReadByQRaw_(char * data, int nq, int qstart);
+    virtual const double * View_(bool byqview, int n, int start);
+    virtual void ReadRegion_(char * data, int row0, int nrow, int col0, int ncol);
+
+private:
+    size_t maxmem_;  //!< Memory available for the rows in memory (in bytes)
+    int nres_;       //!< Number of rows kept in memory
+    std::unique_ptr<char[]> res_; //!< The rows kept in memory (in the precision stored)
+
+    /// Number of rows of the stored matrix
+    int nrow_(void) const;
+
+    /// Length of the rows of the stored matrix
+    int rowlen_(void) const;
+
+    /// Decide how many rows are kept in memory, and allocate them
+    void Allocate_(void);
+
+    /*!
+     * \brief Read or write whole rows of the stored matrix
+     *
+     * \param [in] data Data to read or write (\p n rows)
+     * \param [in] n Number of rows
+     * \param [in] start First row
+     * \param [in] write True to write, false to read
+     */
+    void RowIO_(char * data, int n, int start, bool write);
+
+    /*!
+     * \brief Read some columns of the stored matrix, transposed
+     *
+     * \p data is an \p ncol x nrow_() matrix
+     */
+    template<typename T>
+    void ReadCols_(T * data, int ncol, int col0);
+
+    /// Opposite of ReadCols_()
+    template<typename T>
+    void WriteCols_(const T * data, int ncol, int col0);
+};
+
+} // close namespace panache
+
+#endif
+
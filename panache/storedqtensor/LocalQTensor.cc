@@ -3,15 +3,28 @@
  * \author Benjamin Pritchard (ben@bennyp.org)
  */
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
+#include <array>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <future>
+
+#include <unistd.h>
 
 #include "panache/storedqtensor/LocalQTensor.h"
 #include "panache/BasisSet.h"
+#include "panache/Exception.h"
 #include "panache/Lapack.h"
 #include "panache/ERI.h"
 #include "panache/Flags.h"
 #include "panache/Iterator.h"
+#include "panache/Math.h"
+#include "panache/ShellTasks.h"
+#include "panache/Output.h"
+#include "panache/Hash.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -20,19 +33,43 @@
 namespace panache
 {
 
+// Number of mn columns to gather before applying
+// the fitting metric in GenDFQsoWithMetric_
+#define DFQSO_BATCH_COLS 256
+
+// Number of rows computed at a time for
+// symmetric results in Transform_
+#define TRANSFORM_TRI_BLOCK 64
+
 
 //////////////////////////////
 // LocalQTensor
 //////////////////////////////
 
-LocalQTensor::LocalQTensor(int storeflags, const std::string & name, const std::string & directory) 
-              : StoredQTensor(storeflags, name), directory_(directory)
+LocalQTensor::LocalQTensor(int storeflags, const std::string & name, const std::string & directory,
+                           const QTensorOrigin & origin) 
+              : StoredQTensor(storeflags, name), directory_(directory),
+                nstripe_(1), stripebytes_(0), origin_(origin),
+                chunkbytes_(0), nunverified_(0)
 {
-    filename_ = directory_;
-    filename_.append("/");
-    filename_.append(name);
-    dimfilename_ = filename_;
-    dimfilename_.append(".dim");
+    // one file in each directory of the list
+    std::stringstream ss(directory_);
+    std::string dir;
+
+    while(std::getline(ss, dir, ':'))
+    {
+        //remove trailing slashes
+        while(dir.size() > 1 && dir.back() == '/')
+            dir.pop_back();
+
+        if(dir.size() > 0)
+            filenames_.push_back(dir + "/" + name);
+    }
+
+    if(filenames_.size() == 0)
+        filenames_.push_back(directory_ + "/" + name);
+
+    filename_ = filenames_[0];
 
     existed_ = FileExists();
 }
@@ -42,13 +79,355 @@ const std::string & LocalQTensor::filename(void) const { return filename_; }
 
 const std::string & LocalQTensor::directory(void) const { return directory_; }
 
-const std::string & LocalQTensor::dimfilename(void) const { return dimfilename_; }
+const QTensorOrigin & LocalQTensor::origin(void) const { return origin_; }
 
 bool LocalQTensor::FileExists(void) const
 {
     std::ifstream ifs(filename_.c_str());
-    std::ifstream ifsd(dimfilename_.c_str());
-    return (ifs.is_open() && ifsd.is_open());
+    return ifs.is_open();
+}
+
+
+//////////////////////////////
+// Tensor files
+//////////////////////////////
+
+/*
+ * Layout of a tensor file:
+ *
+ *   QFileHeader, padded to QFILE_HEADER_BYTES
+ *   data (storesize() elements, in the orientation and precision of the tensor)
+ *   checksums of each QFILE_CHUNK_BYTES of the data (uint64_t)
+ *
+ * The header is first written with complete = 0, and is rewritten
+ * with complete = 1 once the checksums are written.
+ *
+ * If the data is striped across several files, pieces of stripebytes
+ * go to each file in turn. Each file has a header, and the checksums
+ * (of the whole data) follow the data in the first file.
+ */
+#define QFILE_MAGIC "PANACHEQ"
+#define QFILE_VERSION 1
+#define QFILE_ENDIAN 0x01020304
+#define QFILE_HEADER_BYTES 4096
+#define QFILE_CHUNK_BYTES (static_cast<size_t>(4*1024*1024))
+
+struct QFileHeader
+{
+    char magic[8];        // QFILE_MAGIC (not null terminated)
+    uint32_t version;     // QFILE_VERSION
+    uint32_t endian;      // QFILE_ENDIAN, as written by this machine
+    uint64_t headerbytes; // Offset of the data
+    int64_t naux;
+    int64_t ndim1;
+    int64_t ndim2;
+    int64_t ndim12;
+    int32_t packed;
+    int32_t byq;
+    int32_t isfloat;
+    int32_t complete;     // Data and checksums have been written
+    int32_t qtype;
+    int32_t bsorder;
+    int32_t nstripe;      // Number of files the data is striped across
+    int32_t stripe;       // Which of those files this is
+    uint64_t options;
+    uint64_t inputhash;
+    uint64_t orbhash;
+    uint64_t chunkbytes;  // Size of each checksummed chunk
+    uint64_t nchunks;     // Number of checksums after the data
+    uint64_t stripebytes; // Size of each piece of data stored in a file in turn
+};
+
+static_assert(sizeof(QFileHeader) <= QFILE_HEADER_BYTES, "Tensor file header is too large");
+
+
+static size_t NChunks_(size_t databytes, size_t chunkbytes)
+{
+    return (databytes + chunkbytes - 1) / chunkbytes;
+}
+
+
+// How much of the data is stored in one of the striped files
+static size_t StripeBytes_(size_t databytes, int nstripe, size_t stripebytes, int stripe)
+{
+    if(nstripe <= 1 || stripebytes == 0)
+        return databytes;
+
+    size_t npiece = NChunks_(databytes, stripebytes);
+    size_t nmine = (npiece > static_cast<size_t>(stripe)) ? (npiece - stripe + nstripe - 1) / nstripe : 0;
+    size_t bytes = nmine * stripebytes;
+
+    // the last piece may be short
+    if(nmine > 0 && (npiece - 1) % nstripe == static_cast<size_t>(stripe))
+        bytes -= npiece * stripebytes - databytes;
+
+    return bytes;
+}
+
+
+size_t LocalQTensor::DataOffset_(void)
+{
+    return QFILE_HEADER_BYTES;
+}
+
+
+size_t LocalQTensor::DataBytes_(void) const
+{
+    return storesize() * (isfloat() ? sizeof(float) : sizeof(double));
+}
+
+
+size_t LocalQTensor::StripeDataBytes_(int stripe) const
+{
+    return StripeBytes_(DataBytes_(), nstripe_, stripebytes_, stripe);
+}
+
+
+void LocalQTensor::ReadData_(char * data, size_t nbytes, size_t offset)
+{
+    throw RuntimeError(std::string("Tensor ") + name() + " is not stored in a file");
+}
+
+
+void LocalQTensor::FileRead_(int fd, char * data, size_t nbytes, size_t offset) const
+{
+    while(nbytes > 0)
+    {
+        ssize_t n = pread(fd, data, nbytes, static_cast<off_t>(offset));
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            throw RuntimeError(std::string("Error reading from file ") + filename_ + ": " + strerror(errno));
+        }
+        else if(n == 0)
+            throw RuntimeError(std::string("Unexpected end of file ") + filename_);
+
+        data += n;
+        nbytes -= n;
+        offset += n;
+    }
+}
+
+
+void LocalQTensor::FileWrite_(int fd, const char * data, size_t nbytes, size_t offset) const
+{
+    while(nbytes > 0)
+    {
+        ssize_t n = pwrite(fd, data, nbytes, static_cast<off_t>(offset));
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            throw RuntimeError(std::string("Error writing to file ") + filename_ + ": " + strerror(errno));
+        }
+
+        data += n;
+        nbytes -= n;
+        offset += n;
+    }
+}
+
+
+void LocalQTensor::WriteHeader_(int fd, bool complete, int stripe) const
+{
+    QFileHeader hdr;
+    std::memset(&hdr, 0, sizeof(QFileHeader));
+
+    std::memcpy(hdr.magic, QFILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = QFILE_VERSION;
+    hdr.endian = QFILE_ENDIAN;
+    hdr.headerbytes = QFILE_HEADER_BYTES;
+
+    hdr.naux = naux();
+    hdr.ndim1 = ndim1();
+    hdr.ndim2 = ndim2();
+    hdr.ndim12 = ndim12();
+
+    // careful. byq() and packed() are ints and would represent QSTORAGE_BYQ, etc, not just a simple bool
+    hdr.packed = (packed() ? 1 : 0);
+    hdr.byq = (byq() ? 1 : 0);
+    hdr.isfloat = (isfloat() ? 1 : 0);
+    hdr.complete = (complete ? 1 : 0);
+
+    hdr.qtype = origin_.qtype;
+    hdr.bsorder = origin_.bsorder;
+    hdr.nstripe = nstripe_;
+    hdr.stripe = stripe;
+    hdr.options = origin_.options;
+    hdr.inputhash = origin_.inputhash;
+    hdr.orbhash = origin_.orbhash;
+
+    hdr.chunkbytes = QFILE_CHUNK_BYTES;
+    hdr.nchunks = NChunks_(DataBytes_(), QFILE_CHUNK_BYTES);
+    hdr.stripebytes = stripebytes_;
+
+    std::unique_ptr<char[]> buf(new char[QFILE_HEADER_BYTES]);
+    std::fill(buf.get(), buf.get() + QFILE_HEADER_BYTES, 0);
+    std::memcpy(buf.get(), &hdr, sizeof(QFileHeader));
+
+    FileWrite_(fd, buf.get(), QFILE_HEADER_BYTES, 0);
+}
+
+
+bool LocalQTensor::ReadHeader_(int fd, int stripe)
+{
+    QFileHeader hdr;
+    std::memset(&hdr, 0, sizeof(QFileHeader));
+
+    off_t fsize = lseek(fd, 0, SEEK_END);
+    if(fsize < 0)
+        throw RuntimeError(std::string("Unable to get the size of file ") + filename_ + ": " + strerror(errno));
+
+    const char * why = nullptr;
+    size_t databytes = 0;
+    size_t filebytes = 0;
+
+    if(static_cast<size_t>(fsize) < QFILE_HEADER_BYTES)
+        why = "it is not a tensor file";
+    else
+    {
+        FileRead_(fd, reinterpret_cast<char *>(&hdr), sizeof(QFileHeader), 0);
+
+        size_t elsize = (hdr.isfloat ? sizeof(float) : sizeof(double));
+        databytes = static_cast<size_t>(hdr.naux) * static_cast<size_t>(hdr.ndim12) * elsize;
+
+        // the checksums are in the first file
+        filebytes = QFILE_HEADER_BYTES + StripeBytes_(databytes, hdr.nstripe, hdr.stripebytes, stripe);
+        if(stripe == 0)
+            filebytes += hdr.nchunks*sizeof(uint64_t);
+
+        if(std::memcmp(hdr.magic, QFILE_MAGIC, sizeof(hdr.magic)) != 0)
+            why = "it is not a tensor file";
+        else if(hdr.version != QFILE_VERSION || hdr.endian != QFILE_ENDIAN
+                || hdr.headerbytes != QFILE_HEADER_BYTES)
+            why = "it was written by a different version or on a different type of machine";
+        else if(!hdr.complete)
+            why = "it was not completely written";
+        else if((hdr.byq != 0) != (byq() != 0))
+            why = "it has a different orientation";
+        else if((hdr.packed != 0) != (packed() != 0))
+            why = "it has a different packing";
+        else if((hdr.isfloat != 0) != (isfloat() != 0))
+            why = "it has a different precision";
+        else if(hdr.qtype != origin_.qtype || hdr.bsorder != origin_.bsorder ||
+                hdr.options != origin_.options || hdr.inputhash != origin_.inputhash ||
+                hdr.orbhash != origin_.orbhash)
+            why = "it is from a different calculation (basis sets, geometry, options, or orbitals)";
+        else if(hdr.nstripe != nstripe_ || hdr.stripe != stripe || hdr.stripebytes != stripebytes_)
+            why = "it is striped across a different set of directories";
+        else if(hdr.chunkbytes == 0 || hdr.nchunks != NChunks_(databytes, hdr.chunkbytes) ||
+                static_cast<size_t>(fsize) < filebytes)
+            why = "it is truncated or damaged";
+        else if(stripe > 0 && (hdr.naux != naux() || hdr.ndim1 != ndim1() || hdr.ndim2 != ndim2()))
+            why = "it does not match the file for the first stripe";
+    }
+
+    if(why != nullptr)
+    {
+        output::printf("  Not reusing file %s, since %s. It will be regenerated.\n", filename_.c_str(), why);
+        existed_ = false;
+        return false;
+    }
+
+    // the rest was set from the first file
+    if(stripe > 0)
+        return true;
+
+    Init(hdr.naux, hdr.ndim1, hdr.ndim2);
+
+    if(static_cast<int64_t>(ndim12()) != hdr.ndim12)
+        throw RuntimeError(std::string("Inconsistent dimensions in file ") + filename_);
+
+    // load the checksums, to be checked as the data is read
+    chunkbytes_ = hdr.chunkbytes;
+    checksums_.resize(hdr.nchunks);
+    verified_.assign(hdr.nchunks, 0);
+    FileRead_(fd, reinterpret_cast<char *>(checksums_.data()), hdr.nchunks*sizeof(uint64_t),
+              QFILE_HEADER_BYTES + StripeDataBytes_(0));
+    nunverified_ = hdr.nchunks;
+
+    return true;
+}
+
+
+void LocalQTensor::WriteChecksums_(int fd)
+{
+    size_t databytes = DataBytes_();
+    size_t nchunks = NChunks_(databytes, QFILE_CHUNK_BYTES);
+
+    std::vector<uint64_t> sums(nchunks);
+    std::unique_ptr<char[]> buf(new char[std::min(databytes, QFILE_CHUNK_BYTES)]);
+
+    for(size_t c = 0; c < nchunks; c++)
+    {
+        size_t cstart = c * QFILE_CHUNK_BYTES;
+        size_t clen = std::min(QFILE_CHUNK_BYTES, databytes - cstart);
+
+        ReadData_(buf.get(), clen, cstart);
+        sums[c] = Checksum(buf.get(), clen);
+    }
+
+    FileWrite_(fd, reinterpret_cast<const char *>(sums.data()), nchunks*sizeof(uint64_t),
+               QFILE_HEADER_BYTES + StripeDataBytes_(0));
+
+    // only now is the file usable
+    WriteHeader_(fd, true);
+}
+
+
+void LocalQTensor::VerifyChunks_(size_t offset, size_t nbytes)
+{
+    if(nbytes == 0 || nunverified_ == 0)
+        return;
+
+    size_t databytes = DataBytes_();
+    size_t c0 = offset / chunkbytes_;
+    size_t c1 = std::min((offset + nbytes - 1) / chunkbytes_ + 1, checksums_.size());
+
+    std::unique_ptr<char[]> buf;
+
+    for(size_t c = c0; c < c1; c++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(verifymtx_);
+            if(verified_[c])
+                continue;
+        }
+
+        // Checked outside the lock. Threads reading the same
+        // chunk at the same time may both check it.
+        size_t cstart = c * chunkbytes_;
+        size_t clen = std::min(chunkbytes_, databytes - cstart);
+
+        if(!buf)
+            buf = std::unique_ptr<char[]>(new char[chunkbytes_]);
+
+        ReadData_(buf.get(), clen, cstart);
+
+        if(Checksum(buf.get(), clen) != checksums_[c])
+        {
+            std::stringstream ss;
+            ss << "Checksum mismatch in file " << filename_ << " for bytes "
+               << cstart << " to " << (cstart + clen) << " of the data. The file is damaged.";
+            throw RuntimeError(ss.str());
+        }
+
+        std::lock_guard<std::mutex> lock(verifymtx_);
+        if(!verified_[c])
+        {
+            verified_[c] = 1;
+            nunverified_--;
+        }
+    }
+}
+
+
+bool LocalQTensor::Verified_(void) const
+{
+    return nunverified_ == 0;
 }
 
 
@@ -272,6 +651,301 @@ void LocalQTensor::GenCHQso_(const SharedBasisSet primary,
 }
 
 
+int LocalQTensor::FitThreads_(int nthreads, size_t perthread, size_t shared) const
+{
+    if(perthread == 0)
+        return nthreads;
+
+    size_t avail = workspace() - std::min(workspace(), shared);
+    int fit = static_cast<int>(std::min(avail / perthread, static_cast<size_t>(nthreads)));
+    fit = std::max(fit, 1);
+
+    if(fit < nthreads)
+        output::printf("  Using %d thread(s) rather than %d for %s, to fit in the memory available\n",
+                       fit, nthreads, name().c_str());
+
+    return fit;
+}
+
+
+void LocalQTensor::GenDFQsoWithMetric_(const SharedFittingMetric fit,
+                                       const SharedBasisSet primary,
+                                       const SharedBasisSet auxiliary,
+                                       int nthreads,
+                                       bool postpone)
+{
+    int maxpershell = primary->max_function_per_shell();
+    int naux = StoredQTensor::naux();
+
+    // Two naux x ncolmax buffers for each thread must fit in the
+    // workspace, and must at least hold one shell pair. Use fewer
+    // columns and then, if needed, fewer threads.
+    size_t colbytes = 2*sizeof(double)*naux;
+    int mincol = maxpershell*maxpershell;
+
+    nthreads = FitThreads_(nthreads, colbytes*mincol, 0);
+
+    size_t fitcol = workspace() / (colbytes*nthreads);
+    int ncolmax = static_cast<int>(std::min(static_cast<size_t>(DFQSO_BATCH_COLS), fitcol));
+    ncolmax = std::max(ncolmax, mincol);
+
+    double * J = fit->get_metric();
+
+    // default constructor = zero basis
+    SharedBasisSet zero(new BasisSet);
+
+    std::vector<SharedTwoBodyAOInt> eris;
+    std::vector<const double *> eribuffers;
+    std::vector<double *> A, B;
+
+    for(int i = 0; i < nthreads; i++)
+    {
+        eris.push_back(GetERI(auxiliary, zero, primary, primary));
+        eribuffers.push_back(eris.back()->buffer());
+
+        // temporary buffers
+        A.push_back(new double[naux*ncolmax]);
+        B.push_back(new double[naux*ncolmax]);
+    }
+
+    const int nauxshell = auxiliary->nshell();
+
+    // Split into chunks of (roughly) equal cost
+    // Each chunk needs all of the auxiliary shells
+    ShellTaskScheduler sched(BalancedShellTasks(auxiliary, primary, nthreads, false), nthreads);
+
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nthreads)
+#endif
+    {
+        int threadnum = 0;
+#ifdef _OPENMP
+        threadnum = omp_get_thread_num();
+#endif
+
+        double * myA = A[threadnum];
+        double * myB = B[threadnum];
+
+        // shell pairs currently in the buffer
+        // (M, N, starting column)
+        std::vector<std::array<int, 3>> inbuf;
+        int ncol = 0;
+
+        // Apply the metric to the buffered columns
+        // and write out each shell pair
+        auto Flush = [&]()
+        {
+            if(ncol == 0)
+                return;
+
+            // Access to J are only reads, so that is safe in parallel
+            if(postpone)
+            {
+                for(int q = 0; q < naux; q++)
+                for(int c = 0; c < ncol; c++)
+                    myA[c*naux + q] = myB[q*ncolmax + c];
+            }
+            else
+                C_DGEMM('T','T', ncol, naux, naux, 1.0, myB, ncolmax, J, naux, 0.0,
+                        myA, naux);
+
+            for(const auto & it : inbuf)
+            {
+                int M = it[0];
+                int N = it[1];
+                int nm = primary->shell(M).nfunction();
+                int mstart = primary->shell(M).function_index();
+                int mend = mstart + nm;
+                int nn = primary->shell(N).nfunction();
+                int nstart = primary->shell(N).function_index();
+
+                double * pairA = myA + it[2]*naux;
+
+                // write to disk or store in memory
+                if(N == M)
+                {
+                    int iwrite = 1;
+                    for (int m0 = 0, m = mstart; m < mend; m0++, m++)
+                        Write_(pairA + (m0*nm)*naux, iwrite++, calcindex(m, mstart));
+                }
+                else
+                {
+                    for (int m0 = 0, m = mstart; m < mend; m0++, m++)
+                        Write_(pairA + (m0*nn)*naux, nn, calcindex(m, nstart));
+                }
+            }
+
+            inbuf.clear();
+            ncol = 0;
+        };
+
+
+        ShellTask task;
+
+        while(sched.Next(threadnum, task))
+        {
+            auto mn = math::decomposeij_packed(task.mnstart);
+            int M = mn.first;
+            int N = mn.second;
+
+            for (int MN = task.mnstart; MN < task.mnend; MN++)
+            {
+                int nm = primary->shell(M).nfunction();
+                int nn = primary->shell(N).nfunction();
+                int nmn = nm*nn;
+
+                if(ncol + nmn > ncolmax)
+                    Flush();
+
+                inbuf.push_back({{M, N, ncol}});
+
+                for (int P = 0; P < nauxshell; P++)
+                {
+                    int np = auxiliary->shell(P).nfunction();
+                    int pstart = auxiliary->shell(P).function_index();
+                    int pend = pstart + np;
+
+                    int ncalc = eris[threadnum]->compute_shell(P,0,M,N);
+
+                    // B is naux x ncolmax, with this shell pair
+                    // taking columns [ncol, ncol+nmn)
+                    for (int p = pstart, index = 0; p < pend; p++, index += nmn)
+                    {
+                        double * bcol = myB + p*ncolmax + ncol;
+
+                        if(ncalc)
+                            std::copy(eribuffers[threadnum] + index,
+                                      eribuffers[threadnum] + index + nmn,
+                                      bcol);
+                        else
+                            std::fill(bcol, bcol + nmn, 0.0);
+                    }
+                }
+
+                ncol += nmn;
+
+                // next shell pair
+                if(++N > M)
+                {
+                    M++;
+                    N = 0;
+                }
+            }
+        }
+
+        Flush();
+    }
+
+    sched.PrintIdle(name());
+
+    for(int i = 0; i < nthreads; i++)
+    {
+        delete [] A[i];
+        delete [] B[i];
+    }
+
+    // Storing the metric signals that Finalize_ should apply it
+    if(postpone)
+        fittingmetric_ = fit;
+}
+
+
+void LocalQTensor::GenDFQso_(const SharedFittingMetric fit,
+                             const SharedBasisSet primary,
+                             const SharedBasisSet auxiliary,
+                             int nthreads)
+{
+    // With fast DF, the metric is applied to the (smaller)
+    // transformed tensors in Finalize_. Otherwise, it is
+    // applied while generating
+    bool postpone = (storeflags() & QSTORAGE_FASTDF);
+    GenDFQsoWithMetric_(fit, primary, auxiliary, nthreads, postpone);
+}
+
+
+void LocalQTensor::ApplyMetricByPanels_(int nthreads)
+{
+    if(!fittingmetric_)
+        return;
+
+    double * J = fittingmetric_->get_metric();
+
+    int inaux = naux();
+    int indim12 = ndim12();
+
+    if(inaux == 0 || indim12 == 0)
+        return;
+
+    // three buffers of the same size fit in the workspace
+    size_t paneldoubles = workspace() / (3*sizeof(double));
+    int npanel = static_cast<int>(std::min(std::max(static_cast<size_t>(1), paneldoubles / inaux),
+                                           static_cast<size_t>(indim12)));
+
+    // two input buffers (one being read while the other is used)
+    std::unique_ptr<double[]> in[2];
+    in[0] = std::unique_ptr<double[]>(new double[static_cast<size_t>(npanel)*inaux]);
+    in[1] = std::unique_ptr<double[]>(new double[static_cast<size_t>(npanel)*inaux]);
+    std::unique_ptr<double[]> out(new double[static_cast<size_t>(npanel)*inaux]);
+
+    auto ReadPanel = [this, npanel, indim12](double * buf, int ij0)
+    {
+        Read_(buf, std::min(npanel, indim12 - ij0), ij0);
+    };
+
+    std::future<void> next = std::async(std::launch::async, ReadPanel, in[0].get(), 0);
+
+    for(int ij0 = 0, b = 0; ij0 < indim12; ij0 += npanel, b ^= 1)
+    {
+        next.get();
+
+        int nij = std::min(npanel, indim12 - ij0);
+
+        // the panels are disjoint, so the next can be read
+        // while this one is being written
+        if(ij0 + npanel < indim12)
+            next = std::async(std::launch::async, ReadPanel, in[b^1].get(), ij0 + npanel);
+
+        double * inptr = in[b].get();
+        double * outptr = out.get();
+
+        // rows of the panel split between threads
+        int nper = (nij + nthreads - 1) / nthreads;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for num_threads(nthreads) schedule(static)
+        #endif
+        for(int t = 0; t < nthreads; t++)
+        {
+            int r0 = t*nper;
+            int nr = std::min(nper, nij - r0);
+
+            if(nr > 0)
+                C_DGEMM('N', 'T', nr, inaux, inaux, 1.0, inptr + static_cast<size_t>(r0)*inaux, inaux,
+                        J, inaux, 0.0, outptr + static_cast<size_t>(r0)*inaux, inaux);
+        }
+
+        Write_(outptr, nij, ij0);
+    }
+
+    fittingmetric_.reset();
+}
+
+
+/*!
+ * \brief Copy part of a transformed result to the double or float output buffer
+ *
+ * Exactly one of \p dout and \p fout should be non-null
+ */
+static inline void CopyOut_(const double * first, const double * last,
+                            double * dout, float * fout, size_t offset)
+{
+    if(fout)
+        std::copy(first, last, fout + offset);
+    else
+        std::copy(first, last, dout + offset);
+}
+
+
 void LocalQTensor::Transform_(const std::vector<TransformMat> & left,
                                         const std::vector<TransformMat> & right,
                                         std::vector<StoredQTensor *> results,
@@ -287,6 +961,27 @@ void LocalQTensor::Transform_(const std::vector<TransformMat> & left,
     if(left.size() != results.size())
         throw RuntimeError("Error - not enough results in vector");
 
+    // The first matrix applied to Q gives a half-transformed
+    // intermediate. Results with the same first matrix share it.
+    //
+    // If this tensor is packed (and therefore symmetric), the left
+    // matrix is applied first, since Q L = (L(t) Q)(t). Otherwise, the
+    // right matrix must be applied first.
+    bool leftfirst = packed();
+    const std::vector<TransformMat> & firstmat = (leftfirst ? left : right);
+
+    std::vector<std::vector<size_t>> groups;
+
+    for(size_t i = 0; i < firstmat.size(); i++)
+    {
+        auto it = std::find_if(groups.begin(), groups.end(),
+                               [&](const std::vector<size_t> & g) { return firstmat[g[0]] == firstmat[i]; });
+        if(it == groups.end())
+            groups.push_back(std::vector<size_t>(1, i));
+        else
+            it->push_back(i);
+    }
+
     // find the max dimension of the transformation matrices
     int maxl = 0;
     int maxr = 0;
@@ -295,18 +990,23 @@ void LocalQTensor::Transform_(const std::vector<TransformMat> & left,
     for(const auto & it : right)
         maxr = (it.second > maxr) ? it.second : maxr;
 
-    // temporary space
-    double * qe = new double[ndim1*ndim2*nthreads];   // expanded q
-    double * qc = new double[maxl*ndim2*nthreads];     // C(t) Q
-    double * cqc = new double[maxl*maxr*nthreads];    // C(t) Q C
+    int maxf = (leftfirst ? maxl : maxr);
 
-    double * qp = qe;
-    if(packed())
-        qp = new double[ndim12*nthreads];         // packed q
+    // Results of the form C(t) Q C are symmetric, and only the
+    // lower triangle needs to be calculated (a block of rows at a time)
+    std::vector<bool> symmetric(left.size());
+
+    // rows of scratch space needed for packing
+    int ncqcrows = 0;
 
 
     std::vector<LocalQTensor *> localresults;
 
+    // memory needed for each q in a batch
+    size_t perq = static_cast<size_t>(ndim1)*ndim2 + static_cast<size_t>(ndim1)*maxf;   // expanded q + half transformed
+    if(packed())
+        perq += ndim12;                       // packed q
+
     for(size_t i = 0; i < left.size(); i++)
     {
         LocalQTensor * qout = dynamic_cast<LocalQTensor *>(results[i]);
@@ -319,97 +1019,293 @@ void LocalQTensor::Transform_(const std::vector<TransformMat> & left,
         qout->fittingmetric_ = fittingmetric_;
 
         localresults.push_back(qout);
+
+        perq += qout->ndim12();
+
+        symmetric[i] = (leftfirst && qout->packed() && left[i] == right[i]);
+
+        // results stored as float are always converted from scratch
+        if(symmetric[i])
+            ncqcrows = std::max(ncqcrows, TRANSFORM_TRI_BLOCK);
+        else if(qout->packed() || qout->isfloat())
+            ncqcrows = std::max(ncqcrows, maxl);
     }
 
 
-    #ifdef _OPENMP
-        #pragma omp parallel for num_threads(nthreads)
-    #endif
-    for(int q = 0; q < naux; q++)
+    // The scratch space for packing (for each thread) comes out of the
+    // workspace first, leaving room for at least one q
+    size_t perthread = sizeof(double)*ncqcrows*maxr;
+    nthreads = FitThreads_(nthreads, perthread, sizeof(double)*perq);
+
+    // How many q to handle at once. Each batch of this tensor is
+    // read (and expanded) only once for all the results
+    size_t qbytes = workspace() - std::min(workspace(), perthread*nthreads);
+    int nqbatch = static_cast<int>(std::min(qbytes / (sizeof(double)*perq), static_cast<size_t>(naux)));
+    nqbatch = std::max(1, nqbatch);
+
+    // temporary space
+    std::unique_ptr<double[]> qe(new double[static_cast<size_t>(nqbatch)*ndim1*ndim2]);  // expanded q
+    std::unique_ptr<double[]> qc(new double[static_cast<size_t>(nqbatch)*ndim1*maxf]);   // half transformed
+    std::unique_ptr<double[]> cqc(new double[static_cast<size_t>(ncqcrows)*maxr*nthreads]);  // C(t) Q C (for packing)
+
+    std::unique_ptr<double[]> qp;
+    if(packed())
+        qp = std::unique_ptr<double[]>(new double[static_cast<size_t>(nqbatch)*ndim12]); // packed q
+
+    // output buffers. Conversion to single precision
+    // is done when filling these
+    std::vector<std::unique_ptr<double[]>> qouts;
+    std::vector<std::unique_ptr<float[]>> fqouts;
+    for(const auto & it : localresults)
     {
-        int threadnum = 0;
+        if(it->isfloat())
+        {
+            qouts.push_back(std::unique_ptr<double[]>());
+            fqouts.push_back(std::unique_ptr<float[]>(new float[static_cast<size_t>(nqbatch)*it->ndim12()]));
+        }
+        else
+        {
+            qouts.push_back(std::unique_ptr<double[]>(new double[static_cast<size_t>(nqbatch)*it->ndim12()]));
+            fqouts.push_back(std::unique_ptr<float[]>());
+        }
+    }
 
-        #ifdef _OPENMP
-            threadnum = omp_get_thread_num();
+
+    for(int qstart = 0; qstart < naux; qstart += nqbatch)
+    {
+        int nq = std::min(nqbatch, naux - qstart);
+
+        #ifdef PANACHE_TIMING
+            Timer readtim;
+            readtim.Start();
         #endif
 
-        for(size_t i = 0; i < left.size(); i++)
+        // read this tensor by Q
+        if(packed())
         {
+            this->ReadByQ(qp.get(), nq, qstart);
 
-            LocalQTensor * qout = localresults[i];
+            // expand packed matrices
+            // ndim1 should equal ndim2. Only the lower
+            // triangle is referenced by DSYMM
+            #ifdef _OPENMP
+                #pragma omp parallel for num_threads(nthreads)
+            #endif
+            for(int q = 0; q < nq; q++)
+            {
+                double * myqe = qe.get() + static_cast<size_t>(q)*ndim1*ndim2;
+                double * myqp = qp.get() + static_cast<size_t>(q)*ndim12;
 
+                for(int i = 0, index = 0; i < ndim1; i++, index += i)
+                    std::copy(myqp + index, myqp + index + i + 1, myqe + i*ndim1);
+            }
+        }
+        else
+            this->ReadByQ(qe.get(), nq, qstart);
+
+        // The read is shared by all the results, so it
+        // is counted once, as a read of this tensor
+        #ifdef PANACHE_TIMING
+            readtim.Stop();
+            GetQBatchTimer().AddTime(readtim);
+        #endif
+
+
+        for(const auto & group : groups)
+        {
             #ifdef PANACHE_TIMING
                 Timer tim;
                 tim.Start();
             #endif
 
-            int lncols = left[i].second;
-            int rncols = right[i].second;
-            double * lptr = left[i].first;
-            double * rptr = right[i].first;
-
-
-            double * myqe = qe + threadnum*ndim1*ndim2;
-            double * myqc = qc + threadnum*maxl*ndim2;
-            double * mycqc = cqc + threadnum*maxl*maxr;
-
-            double * myqp = myqe;
-            if(packed())
-                myqp = qp + threadnum*ndim12;
+            double * fptr = firstmat[group[0]].first;
+            int fncols = firstmat[group[0]].second;
 
-            // read this tensor by Q
-            this->ReadByQ(myqp, 1, q);
-
-            if(packed())
+            // each thread gets a contiguous set of q
+            #ifdef _OPENMP
+                #pragma omp parallel num_threads(nthreads)
+            #endif
             {
-                // expand packed matrix
-                // ndim1 should equal ndim2
-                int index = 0;
-                for(int i = 0; i < ndim1; i++)
-                    for(int j = 0; j <= i; j++)
-                        myqe[i*ndim1+j] = myqe[j*ndim2+i] = myqp[index++];
-            }
+                int threadnum = 0;
+                int nth = 1;
 
+                #ifdef _OPENMP
+                    threadnum = omp_get_thread_num();
+                    nth = omp_get_num_threads();
+                #endif
 
-            // actually do the transformation
-            C_DGEMM('T', 'N', lncols, ndim2, ndim1, 1.0, lptr, lncols, myqe, ndim2, 0.0, myqc, ndim2);
-            C_DGEMM('N', 'N', lncols, rncols, ndim2, 1.0, myqc, ndim2, rptr, rncols, 0.0, mycqc, rncols);
+                int q0 = (nq * threadnum) / nth;
+                int q1 = (nq * (threadnum+1)) / nth;
 
+                if(q1 > q0)
+                {
+                    if(leftfirst)
+                    {
+                        // Q is symmetric
+                        for(int q = q0; q < q1; q++)
+                            C_DSYMM('L', 'L', ndim1, fncols, 1.0, qe.get() + static_cast<size_t>(q)*ndim1*ndim2, ndim2,
+                                    fptr, fncols, 0.0, qc.get() + static_cast<size_t>(q)*ndim1*fncols, fncols);
+                    }
+                    else
+                    {
+                        // Q C for all q at once
+                        C_DGEMM('N', 'N', (q1-q0)*ndim1, fncols, ndim2, 1.0, qe.get() + static_cast<size_t>(q0)*ndim1*ndim2, ndim2,
+                                fptr, fncols, 0.0, qc.get() + static_cast<size_t>(q0)*ndim1*fncols, fncols);
+                    }
+
+                    double * mycqc = cqc.get() + static_cast<size_t>(threadnum)*ncqcrows*maxr;
+
+                    for(size_t i : group)
+                    {
+                        int lncols = left[i].second;
+                        int rncols = right[i].second;
+                        double * lptr = left[i].first;
+                        double * rptr = right[i].first;
+                        bool outpacked = localresults[i]->packed();
+                        int outndim12 = localresults[i]->ndim12();
+                        double * myqout = qouts[i].get();
+                        float * myfqout = fqouts[i].get();
+
+                        for(int q = q0; q < q1; q++)
+                        {
+                            double * myqc = qc.get() + static_cast<size_t>(q)*ndim1*fncols;
+                            size_t qoff = static_cast<size_t>(q)*outndim12;
+
+                            if(symmetric[i])
+                            {
+                                // myqc = Q L. Compute the lower triangle of
+                                // L(t) Q L, a block of rows at a time
+                                for(int a0 = 0; a0 < lncols; a0 += TRANSFORM_TRI_BLOCK)
+                                {
+                                    int na = std::min(TRANSFORM_TRI_BLOCK, lncols - a0);
+                                    int nb = a0 + na;
+
+                                    C_DGEMM('T', 'N', na, nb, ndim1, 1.0, myqc + a0, fncols,
+                                            rptr, rncols, 0.0, mycqc, nb);
+
+                                    for(int a = 0; a < na; a++)
+                                        CopyOut_(mycqc + a*nb, mycqc + a*nb + a0 + a + 1,
+                                                 myqout, myfqout, qoff + (((a0+a)*(a0+a+1))>>1));
+                                }
+
+                                continue;
+                            }
+
+                            double * target = ((outpacked || myfqout) ? mycqc : myqout + qoff);
+
+                            if(leftfirst) // myqc = (L(t) Q)(t)
+                                C_DGEMM('T', 'N', lncols, rncols, ndim1, 1.0, myqc, lncols,
+                                        rptr, rncols, 0.0, target, rncols);
+                            else          // myqc = Q R
+                                C_DGEMM('T', 'N', lncols, rncols, ndim1, 1.0, lptr, lncols,
+                                        myqc, rncols, 0.0, target, rncols);
+
+                            if(outpacked)
+                            {
+                                for(int i = 0; i < lncols; i++)
+                                    CopyOut_(mycqc + i*rncols, mycqc + i*rncols + i + 1,
+                                             myqout, myfqout, qoff + ((i*(i+1))>>1));
+                            }
+                            else if(myfqout)
+                                CopyOut_(mycqc, mycqc + static_cast<size_t>(lncols)*rncols, myqout, myfqout, qoff);
+                        }
+                    }
+                }
+            }
 
-            // write out
             // Write to memory or disk
-            if(qout->packed())
+            for(size_t i : group)
             {
-                // can use qc for scratch
-                for(int i = 0, index = 0; i < lncols; i++)
-                for(int j = 0; j <= i; j++, index++)
-                    myqc[index] = mycqc[i*rncols+j];
-
-                qout->WriteByQ_(myqc, 1, q);
+                if(fqouts[i])
+                    localresults[i]->WriteByQ_(fqouts[i].get(), nq, qstart);
+                else
+                    localresults[i]->WriteByQ_(qouts[i].get(), nq, qstart);
             }
-            else
-                qout->WriteByQ_(mycqc, 1, q);
 
             #ifdef PANACHE_TIMING
             tim.Stop();
-            qout->GenTimer().AddTime(tim);
+            for(size_t i : group)
+                localresults[i]->GenTimer().AddTime(tim);
             #endif
         }
     }
+}
 
-    // done with stuff
-    delete [] qe;
-    delete [] qc;
-    delete [] cqc;
 
-    if(packed())
-        delete [] qp;
+bool LocalQTensor::Slice_(int start1, int start2, StoredQTensor * result, int nthreads)
+{
+    LocalQTensor * qout = dynamic_cast<LocalQTensor *>(result);
+    if(qout == nullptr)
+        return false;
+
+    int naux = StoredQTensor::naux();
+    int ndim12 = StoredQTensor::ndim12();
+    int outndim1 = qout->ndim1();
+    int outndim2 = qout->ndim2();
+    int outndim12 = qout->ndim12();
+
+    if(start1 + outndim1 > ndim1() || start2 + outndim2 > ndim2())
+        throw RuntimeError("Error - slice is larger than the tensor");
+    if(qout->packed() && (start1 != start2 || outndim1 != outndim2))
+        throw RuntimeError("Error - packed slice must be on the diagonal");
+
+    // same as Transform_
+    qout->fittingmetric_ = fittingmetric_;
+
+    size_t perq = sizeof(double)*(ndim12 + outndim12);
+    int nqbatch = static_cast<int>(std::min(workspace() / perq, static_cast<size_t>(naux)));
+    nqbatch = std::max(1, nqbatch);
+
+    std::unique_ptr<double[]> qin(new double[static_cast<size_t>(nqbatch)*ndim12]);
+    std::unique_ptr<double[]> qsl(new double[static_cast<size_t>(nqbatch)*outndim12]);
+
+    bool outpacked = qout->packed();
+
+    for(int qstart = 0; qstart < naux; qstart += nqbatch)
+    {
+        int nq = std::min(nqbatch, naux - qstart);
+
+        this->ReadByQ(qin.get(), nq, qstart);
+
+        #ifdef _OPENMP
+            #pragma omp parallel for num_threads(nthreads)
+        #endif
+        for(int q = 0; q < nq; q++)
+        {
+            double * myqin = qin.get() + static_cast<size_t>(q)*ndim12;
+            double * myqsl = qsl.get() + static_cast<size_t>(q)*outndim12;
+
+            // this tensor is symmetric if packed, so take
+            // anything in the upper triangle from the lower one
+            for(int i = 0, index = 0; i < outndim1; i++)
+            for(int j = 0; j < (outpacked ? i+1 : outndim2); j++, index++)
+            {
+                int ii = start1 + i;
+                int jj = start2 + j;
+                if(packed() && jj > ii)
+                    std::swap(ii, jj);
+                myqsl[index] = myqin[calcindex(ii, jj)];
+            }
+        }
+
+        qout->WriteByQ_(qsl.get(), nq, qstart);
+    }
+
+    return true;
 }
 
+void LocalQTensor::Finalize_(int nthreads)
+{
+    // Only does something if the metric was postponed (fast DF)
+    ApplyMetricByPanels_(nthreads);
+}
+
+
 void LocalQTensor::NoFinalize_(void)
 {
-    // release my pointer to the fitting metric
-    fittingmetric_.reset();
+    // A postponed metric has not been applied, so it is kept.
+    // Tensors transformed from this one later (ie, Qso reused by
+    // another call to GenQTensors) still need it applied.
 }
 
 } // close namespace panache
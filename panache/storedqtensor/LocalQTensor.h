@@ -7,6 +7,9 @@
 #ifndef PANACHE_LOCALQTENSOR_H
 #define PANACHE_LOCALQTENSOR_H
 
+#include <mutex>
+#include <atomic>
+
 #include "panache/storedqtensor/StoredQTensor.h"
 #include "panache/FittingMetric.h"
 
@@ -26,6 +29,13 @@ typedef std::shared_ptr<BasisSet> SharedBasisSet;
  *
  *  Classes for storing in memory or on disk are derived from this. This class
  *  handles all the transformations, however.
+ *
+ *  It also handles the format of the files tensors are stored in. A file
+ *  starts with a header describing the tensor (sizes, orientation, precision)
+ *  and the calculation it came from (see QTensorOrigin), followed by the data
+ *  and a table of checksums of each chunk of the data. A file is only reused
+ *  (QSTORAGE_READDISK) if the header matches, and each chunk is checked
+ *  the first time it is read.
  */
 class LocalQTensor : public StoredQTensor
 {
@@ -35,9 +45,12 @@ public:
      *
      * \param [in] storeflags How the tensor should be stored (packed, etc)
      * \param [in] name Some descriptive name
-     * \param [in] directory Directory where to store files if necessary
+     * \param [in] directory Directory where to store files if necessary (may be
+     *                       a list of directories separated by ':')
+     * \param [in] origin Calculation the tensor comes from
      */
-    LocalQTensor(int storeflags, const std::string & name, const std::string & directory);
+    LocalQTensor(int storeflags, const std::string & name, const std::string & directory,
+                 const QTensorOrigin & origin);
 
     /// Get the directory where this tensor may be stored
     const std::string & directory(void) const;
@@ -45,8 +58,8 @@ public:
     /// Get the filename for this tensor
     const std::string & filename(void) const;
 
-    /// Get the .dim filename for this tensor
-    const std::string & dimfilename(void) const;
+    /// Get the description of the calculation this tensor comes from
+    const QTensorOrigin & origin(void) const;
 
 
 protected:
@@ -70,35 +83,185 @@ protected:
      */
     virtual void WriteByQ_(double * data, int nq, int qstart) = 0;
 
-    // Implemented in MemoryQTensor and DiskQTensor
+    /// \copydoc Write_(double *, int, int)
+    /// Data is converted if this tensor is stored in double precision
+    virtual void Write_(float * data, int nij, int ijstart) = 0;
+
+    /// \copydoc WriteByQ_(double *, int, int)
+    /// Data is converted if this tensor is stored in double precision
+    virtual void WriteByQ_(float * data, int nq, int qstart) = 0;
+
+    /*!
+     * \brief Generate the DF Qso through Write_() (see GenDFQsoWithMetric_())
+     *
+     * With QSTORAGE_FASTDF, the metric is postponed and applied by Finalize_().
+     * MemoryQTensor overrides this to work on its storage directly.
+     */
     virtual void GenDFQso_(const SharedFittingMetric fit,
                            const SharedBasisSet primary,
                            const SharedBasisSet auxiliary,
-                           int nthreads) = 0;
+                           int nthreads);
 
     virtual void GenCHQso_(const SharedBasisSet primary,
                            double delta,
                            int nthreads);
 
+    /*!
+     * \brief Generate the DF Qso, applying the metric as the integrals are computed
+     *
+     * Blocks of contiguous shell pairs are gathered into a buffer for each thread
+     * so that the metric is applied with a few large DGEMMs. Results are written
+     * through Write_().
+     *
+     * If \p postpone is true, the integrals are written without applying the metric.
+     * The metric is then stored in fittingmetric_, to be applied by Finalize_()
+     * (see ApplyMetricByPanels_()).
+     *
+     * \param [in] fit Fitting metric to apply
+     * \param [in] primary Primary basis set
+     * \param [in] auxiliary Auxiliary basis set
+     * \param [in] nthreads Number of threads to use
+     * \param [in] postpone Don't apply the metric now
+     */
+    void GenDFQsoWithMetric_(const SharedFittingMetric fit,
+                             const SharedBasisSet primary,
+                             const SharedBasisSet auxiliary,
+                             int nthreads,
+                             bool postpone = false);
+
+    /*!
+     * \brief Number of threads whose buffers fit in the workspace
+     *
+     * Prints a notice if it is fewer than requested
+     *
+     * \param [in] nthreads Number of threads requested
+     * \param [in] perthread Size of the buffers for each thread (in bytes)
+     * \param [in] shared Size of the buffers shared by all threads (in bytes)
+     * \return Number of threads to use (at least one)
+     */
+    int FitThreads_(int nthreads, size_t perthread, size_t shared) const;
+
+    /*!
+     * \brief Apply the fitting metric stored in fittingmetric_, a panel at a time
+     *
+     * Panels of orbital indices (all auxiliary indices for a range of ij) are read
+     * through Read_(), multiplied by the metric, and written back through Write_(). The next
+     * panel is read in the background while the current one is multiplied, so this is suited
+     * to tensors that are not in memory. The three panel buffers fit in workspace().
+     * Does nothing if fittingmetric_ is not set.
+     *
+     * \param [in] nthreads Number of threads to use
+     */
+    void ApplyMetricByPanels_(int nthreads);
+
     virtual void Transform_(const std::vector<TransformMat> & left,
                             const std::vector<TransformMat> & right,
                             std::vector<StoredQTensor *> results,
                             int nthreads);
 
-    // pass through to derived classes
-    virtual void Finalize_(int nthreads) = 0;
+    virtual bool Slice_(int start1, int start2, StoredQTensor * result, int nthreads);
+
+    /// Applies a postponed metric with ApplyMetricByPanels_() (MemoryQTensor overrides this)
+    virtual void Finalize_(int nthreads);
+
+    /// Keeps a postponed metric, for tensors transformed from this one later
     virtual void NoFinalize_(void);
 
+    /// Offset of the data in a tensor file (in bytes)
+    static size_t DataOffset_(void);
+
+    /// Size of the data in a tensor file (in bytes)
+    size_t DataBytes_(void) const;
+
+    /// Size of the part of the data stored in one of the files (in bytes)
+    size_t StripeDataBytes_(int stripe) const;
+
+    /*!
+     * \brief Read data from the file(s), without checking checksums
+     *
+     * Used for computing and checking the checksums. Throws by
+     * default (for tensors not stored in a file).
+     *
+     * \param [in] data Where to put the data
+     * \param [in] nbytes Number of bytes to read
+     * \param [in] offset Where to start reading (in bytes, from the start of the data)
+     */
+    virtual void ReadData_(char * data, size_t nbytes, size_t offset);
+
+    /// Read from a file at an offset (in bytes), throwing on errors and end of file
+    void FileRead_(int fd, char * data, size_t nbytes, size_t offset) const;
+
+    /// Write to a file at an offset (in bytes), throwing on errors
+    void FileWrite_(int fd, const char * data, size_t nbytes, size_t offset) const;
+
+    /*!
+     * \brief Read the header of a tensor file and initialize this tensor
+     *
+     * If the file is not a complete tensor file from the same calculation, with
+     * the same orientation, packing, and precision as this tensor, a notice is printed,
+     * existed_ is set to false, and false is returned. The tensor should then be
+     * regenerated. Otherwise, the sizes are taken from the file and the checksums
+     * are loaded, to be checked with VerifyChunks_().
+     *
+     * The file for the first stripe must be read first. For the others, the sizes
+     * are checked rather than set.
+     *
+     * \param [in] fd Descriptor of the open file
+     * \param [in] stripe Which of the striped files this is
+     * \return True if the file can be used
+     */
+    bool ReadHeader_(int fd, int stripe = 0);
+
+    /*!
+     * \brief Write the header for this tensor
+     *
+     * \param [in] fd Descriptor of the open file
+     * \param [in] complete Whether the data and checksums have been written
+     * \param [in] stripe Which of the striped files this is
+     */
+    void WriteHeader_(int fd, bool complete, int stripe = 0) const;
+
+    /*!
+     * \brief Compute and write the checksums of the data, and mark the file as complete
+     *
+     * The checksums are stored in the file for the first stripe, which is
+     * marked complete last. The others should be marked complete before this.
+     *
+     * \param [in] fd Descriptor of the file for the first stripe
+     */
+    void WriteChecksums_(int fd);
+
+    /*!
+     * \brief Check the checksums of the data in a file
+     *
+     * Only the chunks overlapping the given range (relative to the start of the data),
+     * and that have not been checked before, are read and checked. Throws on a mismatch.
+     * Does nothing if no checksums were loaded by ReadHeader_().
+     */
+    void VerifyChunks_(size_t offset, size_t nbytes);
+
+    /// True once every chunk loaded by ReadHeader_() has been checked
+    virtual bool Verified_(void) const;
+
     std::string directory_; //!< Directory where to store files if necessary
-    std::string filename_;
-    std::string dimfilename_;
+    std::string filename_;  //!< File in the first directory
+    std::vector<std::string> filenames_; //!< File in each directory
+    int nstripe_;           //!< Number of files the data is striped across
+    size_t stripebytes_;    //!< Size of each piece of data stored in a file in turn
     bool existed_;
+    QTensorOrigin origin_; //!< Calculation this tensor comes from
 
     // Fitting metric for DF calculations
     // held for application after MO transformation
     SharedFittingMetric fittingmetric_;
 
 private:
+    size_t chunkbytes_;              //!< Size of each checksummed chunk of a file that was read
+    std::vector<uint64_t> checksums_; //!< Checksums of each chunk of a file that was read
+    std::vector<char> verified_;     //!< Which chunks have been checked
+    std::atomic<size_t> nunverified_; //!< Number of chunks not yet checked
+    std::mutex verifymtx_;           //!< Protects verified_
+
     /*!
      * \brief Compute the cholesky diagonal
      *
@@ -123,7 +286,7 @@ private:
     static void ComputeRow_(std::vector<SharedTwoBodyAOInt> & eris, int row, double* target);
 
     /*!
-     *  \brief Tests to see if the files corresponding to this tensor exists
+     *  \brief Tests to see if the file corresponding to this tensor exists
      */ 
     bool FileExists(void) const;
 
@@ -3,14 +3,19 @@
  * \author Benjamin Pritchard (ben@bennyp.org)
  */
 
+#include <algorithm>
+
 #include "panache/storedqtensor/MemoryQTensor.h"
 #include "panache/storedqtensor/DiskQTensor.h"
+#include "panache/storedqtensor/StoreCopy.h"
 #include "panache/Lapack.h"
 #include "panache/ERI.h"
 #include "panache/Flags.h"
 #include "panache/Exception.h"
 #include "panache/BasisSet.h"
 #include "panache/FittingMetric.h"
+#include "panache/ShellTasks.h"
+#include "panache/Math.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -22,92 +27,84 @@ namespace panache
 
 void MemoryQTensor::Write_(double * data, int nij, int ijstart)
 {
-    int inaux = naux();
-
-    if(byq())
-    {
-        int indim12 = ndim12();
-
-        for(int q = 0, qoff = 0; q < inaux; q++, qoff += indim12)
-            for(int ij = 0, ijoff = 0; ij < nij; ij++, ijoff += inaux)
-                data_[qoff+ijstart+ij] = data[ijoff+q];
-    }
+    if(fdata_)
+        StoreWriteIJ(fdata_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
     else
-    {
-        double * start = data_.get() + ijstart * inaux;
-        std::copy(data, data+inaux, start);
-    }
+        StoreWriteIJ(data_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
 }
 
+void MemoryQTensor::Write_(float * data, int nij, int ijstart)
+{
+    if(fdata_)
+        StoreWriteIJ(fdata_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreWriteIJ(data_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
 
 void MemoryQTensor::WriteByQ_(double * data, int nq, int qstart)
 {
-    int indim12 = ndim12();
-
-    if(byq())
-    {
-        std::copy(data,
-                  data + nq*indim12,
-                  data_.get()+qstart*indim12);
-    }
+    if(fdata_)
+        StoreWriteQ(fdata_.get(), data, byq(), naux(), ndim12(), nq, qstart);
     else
-    {
-        int inaux = naux();
+        StoreWriteQ(data_.get(), data, byq(), naux(), ndim12(), nq, qstart);
+}
 
-        for(int q = 0, qoff = 0; q < nq; q++, qoff += indim12)
-            for(int ij = 0, ijoff = 0; ij < indim12; ij++, ijoff += inaux)
-                data_[ijoff+qstart+q] = data[qoff+ij];
-    }
+void MemoryQTensor::WriteByQ_(float * data, int nq, int qstart)
+{
+    if(fdata_)
+        StoreWriteQ(fdata_.get(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreWriteQ(data_.get(), data, byq(), naux(), ndim12(), nq, qstart);
 }
 
 void MemoryQTensor::Read_(double * data, int nij, int ijstart)
 {
-    int inaux = naux();
-
-    if(byq())
-    {
-        int indim12 = ndim12();
+    if(fdata_)
+        StoreReadIJ(fdata_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreReadIJ(data_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
 
-        for(int q = 0, qoff = 0; q < inaux; q++, qoff += indim12)
-            for(int ij = 0, ijoff = 0; ij < nij; ij++, ijoff += inaux)
-                data[ijoff+q] = data_[qoff+ijstart+ij];
-    }
+void MemoryQTensor::Read_(float * data, int nij, int ijstart)
+{
+    if(fdata_)
+        StoreReadIJ(fdata_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
     else
-    {
-        double * start = data_.get() + ijstart * inaux;
-        std::copy(start, start+nij*inaux, data);
-    }
+        StoreReadIJ(data_.get(), data, byq(), naux(), ndim12(), nij, ijstart);
 }
 
 void MemoryQTensor::ReadByQ_(double * data, int nq, int qstart)
 {
-    int indim12 = ndim12();
-
-    if(byq())
-    {
-        double * start = data_.get()+qstart*indim12;
-        std::copy(start, start+nq*indim12, data);
-    }
+    if(fdata_)
+        StoreReadQ(fdata_.get(), data, byq(), naux(), ndim12(), nq, qstart);
     else
-    {
-        int inaux = naux();
+        StoreReadQ(data_.get(), data, byq(), naux(), ndim12(), nq, qstart);
+}
 
-        for(int q = 0, qoff = 0; q < nq; q++, qoff += indim12)
-            for(int ij = 0, ijoff = 0; ij < indim12; ij++, ijoff += inaux)
-                data[qoff+ij] = data_[ijoff+qstart+q];
-    }
+void MemoryQTensor::ReadByQ_(float * data, int nq, int qstart)
+{
+    if(fdata_)
+        StoreReadQ(fdata_.get(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreReadQ(data_.get(), data, byq(), naux(), ndim12(), nq, qstart);
 }
 
 
 void MemoryQTensor::Init_(void)
 {
-    if(!data_)
+    if(isfloat())
+    {
+        if(!fdata_)
+            fdata_ = std::unique_ptr<float []>(new float[storesize()]);
+    }
+    else if(!data_)
         data_ = std::unique_ptr<double []>(new double[storesize()]);
 }
 
 
-MemoryQTensor::MemoryQTensor(int storeflags, const std::string & name, const std::string & directory) 
-    : LocalQTensor(storeflags, name, directory)
+MemoryQTensor::MemoryQTensor(int storeflags, const std::string & name, const std::string & directory,
+                             const QTensorOrigin & origin) 
+    : LocalQTensor(storeflags, name, directory, origin)
 {
     // does the file exist?
     // (set by LocalQTensor constructor)
@@ -115,21 +112,36 @@ MemoryQTensor::MemoryQTensor(int storeflags, const std::string & name, const std
     {
         // note - don't do diskqt(this) since this isn't completely constructed yet!
         // note2 - it's ok if the INMEM vs. DISK flags are incorrect in diskqt. They
-        // aren't saved to the .dim file or matter much after construction
-        DiskQTensor diskqt(storeflags, name, directory);
+        // aren't saved to the file or matter much after construction
+        DiskQTensor diskqt(storeflags, name, directory, origin_);
 
+        // File is from a different calculation, etc. Regenerate it
+        // (and rewrite it in the destructor, if it is to be kept)
         if(!diskqt.filled())
-            throw RuntimeError("Can't read from disk, but file exists?");
+        {
+            existed_ = false;
+            return;
+        }
 
         // Init sizes, etc, 
         // from StoredQTensor base class
         // (calls MemoryQTensor::Init_)
         Init(diskqt);
 
-        if(byq())
-          diskqt.ReadByQ(data_.get(), naux(), 0);
+        if(fdata_)
+        {
+            if(byq())
+              diskqt.ReadByQ(fdata_.get(), naux(), 0);
+            else
+              diskqt.Read(fdata_.get(), ndim12(), 0);
+        }
         else
-          diskqt.Read(data_.get(), ndim12(), 0);
+        {
+            if(byq())
+              diskqt.ReadByQ(data_.get(), naux(), 0);
+            else
+              diskqt.Read(data_.get(), ndim12(), 0);
+        }
 
         markfilled();
 
@@ -139,21 +151,50 @@ MemoryQTensor::MemoryQTensor(int storeflags, const std::string & name, const std
 
 MemoryQTensor::~MemoryQTensor()
 {
-    if(!existed_ && (storeflags() & QSTORAGE_KEEPDISK))
+    if(!existed_ && filled() && (storeflags() & QSTORAGE_KEEPDISK))
     {
         // file doesn't exist, but is wanted
         DiskQTensor diskqt(this);  // should do everything in there
         // note - it's ok if the INMEM vs. DISK flags are incorrect in diskqt. They
-        // aren't saved to the .dim file
+        // aren't saved to the file
     }
 }
 
+void MemoryQTensor::Gather_(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    if(fdata_)
+        StoreGather(fdata_.get(), data, byq(), naux(), ndim12(), ij, nij, qstart, nq);
+    else
+        StoreGather(data_.get(), data, byq(), naux(), ndim12(), ij, nij, qstart, nq);
+}
+
+const double * MemoryQTensor::View_(bool byqview, int n, int start)
+{
+    // only rows of the stored matrix are contiguous
+    if(fdata_ || !data_ || byqview != (byq() != 0))
+        return nullptr;
+
+    size_t rowlen = (byq() ? ndim12() : naux());
+    return data_.get() + static_cast<size_t>(start)*rowlen;
+}
+
+size_t MemoryQTensor::MemoryUsed(void) const
+{
+    if(fdata_)
+        return storesize()*sizeof(float);
+    else if(data_)
+        return storesize()*sizeof(double);
+    else
+        return 0;
+}
+
 void MemoryQTensor::GenDFQso_(const SharedFittingMetric fit,
                               const SharedBasisSet primary,
                               const SharedBasisSet auxiliary,
                               int nthreads)
 {
-    if(storeflags() & QSTORAGE_FASTDF)
+    // Fast generation writes directly to double precision storage
+    if((storeflags() & QSTORAGE_FASTDF) && !isfloat())
         MemoryQTensor::GenDFQso_Fast_(fit, primary, auxiliary, nthreads);
     else
         MemoryQTensor::GenDFQso_Slow_(fit, primary, auxiliary, nthreads);
@@ -170,7 +211,7 @@ void MemoryQTensor::GenDFQso_Fast_(const SharedFittingMetric fit,
     // Storing the metric signals that Finalize_ should apply it
     fittingmetric_ = fit;
     
-    int nd12 = ndim12();
+    size_t nd12 = ndim12();
 
     // default constructor = zero basis
     SharedBasisSet zero(new BasisSet);
@@ -185,76 +226,74 @@ void MemoryQTensor::GenDFQso_Fast_(const SharedFittingMetric fit,
     }
 
 
-    const int nprimshell = primary->nshell();
-    const int nauxshell = auxiliary->nshell();
+    // Split into chunks of (roughly) equal cost
+    ShellTaskScheduler sched(BalancedShellTasks(auxiliary, primary, nthreads, true), nthreads);
 
 #ifdef _OPENMP
-    #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+    #pragma omp parallel num_threads(nthreads)
 #endif
-    for (int P = 0; P < nauxshell; P++)
     {
         int threadnum = 0;
 #ifdef _OPENMP
         threadnum = omp_get_thread_num();
 #endif
-        int np = auxiliary->shell(P).nfunction();
-        int pstart = auxiliary->shell(P).function_index();
-        int pend = pstart + np;
 
-        for (int M = 0; M < nprimshell; M++)
+        ShellTask task;
+
+        while(sched.Next(threadnum, task))
         {
+            for (int P = task.pstart; P < task.pend; P++)
+            {
+                int np = auxiliary->shell(P).nfunction();
+                int pstart = auxiliary->shell(P).function_index();
+                int pend = pstart + np;
 
+                auto mn = math::decomposeij_packed(task.mnstart);
+                int M = mn.first;
+                int N = mn.second;
 
-            int nm = primary->shell(M).nfunction();
-            int mstart = primary->shell(M).function_index();
-            int mend = mstart + nm;
+                for (int MN = task.mnstart; MN < task.mnend; MN++)
+                {
+                    int nm = primary->shell(M).nfunction();
+                    int mstart = primary->shell(M).function_index();
+                    int mend = mstart + nm;
 
-            for (int N = 0; N <= M; N++)
-            {
-                int nn = primary->shell(N).nfunction();
-                int nstart = primary->shell(N).function_index();
-                //int nend = nstart + nn;
+                    int nn = primary->shell(N).nfunction();
+                    int nstart = primary->shell(N).function_index();
 
-                int ncalc = eris[threadnum]->compute_shell(P,0,M,N);
+                    int ncalc = eris[threadnum]->compute_shell(P,0,M,N);
 
-                // keep in mind that we are storing this packed
-                if(ncalc)
-                {
-                    if(N == M)
+                    // keep in mind that we are storing this packed
+                    if(ncalc)
                     {
                         for (int p = pstart, p0 = 0; p < pend; p++, p0++)
                         {
-                            int pp = p*nd12;
+                            size_t pp = p*nd12;
                             int pp0 = p0*nm*nn;
-                        
+
                             // index math is tricky
-                            // m0+1 is the number of elements to store, and would increase by
+                            // if N == M, m0+1 is the number of elements to store, and would increase by
                             // one as we move down the triangular part
-                            // Remember, this is only for if N==M
                             for (int m = mstart, m0 = 0; m < mend; m++, m0++)
-                                std::copy(&(eribuffers[threadnum][pp0 + m0*nn]), 
-                                          &(eribuffers[threadnum][pp0 + m0*nn + m0+1]), 
+                                std::copy(&(eribuffers[threadnum][pp0 + m0*nn]),
+                                          &(eribuffers[threadnum][pp0 + m0*nn + ((N == M) ? m0+1 : nn)]),
                                           &(data_[pp + calcindex(m, nstart)]));
                         }
                     }
-                    else
+
+                    // next shell pair
+                    if(++N > M)
                     {
-                        for (int p = pstart, p0 = 0; p < pend; p++, p0++)
-                        {
-                            int pp = p*nd12;
-                            int pp0 = p0*nm*nn;
-                        
-                            for (int m = mstart, m0 = 0; m < mend; m++, m0++)
-                                std::copy(&(eribuffers[threadnum][pp0 + m0*nn]), 
-                                          &(eribuffers[threadnum][pp0 + m0*nn + nn]),
-                                          &(data_[pp + calcindex(m, nstart)]));
-                        }
+                        M++;
+                        N = 0;
                     }
                 }
             }
         }
     }
 
+    sched.PrintIdle(name());
+
     // MULTIPLICATION BY METRIC HAS BEEN MOVED TO FINALIZE
 }
 
@@ -267,143 +306,146 @@ void MemoryQTensor::GenDFQso_Slow_(const SharedFittingMetric fit,
     //std::cout << "SLOW DFQSO GENERATION\n";
     // don't store the fitting metric!
     // Storing the metric signals that Finalize_ should apply it
+    GenDFQsoWithMetric_(fit, primary, auxiliary, nthreads);
+}
 
+void MemoryQTensor::Finalize_(int nthreads)
+{
+    // done with fitting metric
+    //std::cout << "Calling memoryqtensor finalize for " << name() << "\n";
+    if(!fittingmetric_) // maybe this wasn't fast df
+        return;
 
-    int maxpershell = primary->max_function_per_shell();
-    int maxpershell2 = maxpershell*maxpershell;
-
-    double * J = fit->get_metric();
-
-    // default constructor = zero basis
-    SharedBasisSet zero(new BasisSet);
+    if(fdata_)
+        FinalizeFloat_(nthreads);
+    else
+        FinalizeDouble_(nthreads);
 
-    std::vector<SharedTwoBodyAOInt> eris;
-    std::vector<const double *> eribuffers;
-    std::vector<double *> A, B;
+    fittingmetric_.reset();
+}
 
-    int naux = StoredQTensor::naux();
 
-    for(int i = 0; i < nthreads; i++)
-    {
-        eris.push_back(GetERI(auxiliary, zero, primary, primary));
-        eribuffers.push_back(eris.back()->buffer());
+int MemoryQTensor::FinalizeBlockSize_(int nthreads, int nbuf) const
+{
+    // Each thread has nbuf buffers of (block size * naux) doubles,
+    // and all of them must fit in the workspace
+    size_t perthread = workspace() / (static_cast<size_t>(nthreads)*nbuf*sizeof(double));
+    size_t nblock = std::max(static_cast<size_t>(1), perthread / naux());
+
+    // but give every thread something to do
+    size_t nper = (static_cast<size_t>(ndim12()) + nthreads - 1) / nthreads;
+    return static_cast<int>(std::max(static_cast<size_t>(1), std::min(nblock, nper)));
+}
 
-        // temporary buffers
-        A.push_back(new double[naux*maxpershell2]);
-        B.push_back(new double[naux*maxpershell2]);
-    }
 
+void MemoryQTensor::FinalizeDouble_(int nthreads)
+{
+    // Done in place, a block of orbital indices at a time. The block
+    // is copied to a buffer, and the product is written back over it.
+    double * J = fittingmetric_->get_metric();
 
-    const int nprimshell = primary->nshell();
-    const int nauxshell = auxiliary->nshell();
+    int inaux = naux();
+    int indim12 = ndim12();
+    int blocksize = FinalizeBlockSize_(nthreads, 1);
+    int nblock = (indim12 + blocksize - 1) / blocksize;
+    bool isbyq = byq();
 
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
-#endif
-    for (int M = 0; M < nprimshell; M++)
+    #ifdef _OPENMP
+        #pragma omp parallel num_threads(nthreads)
+    #endif
     {
-        int threadnum = 0;
-
-#ifdef _OPENMP
-        threadnum = omp_get_thread_num();
-#endif
-
-        int nm = primary->shell(M).nfunction();
-        int mstart = primary->shell(M).function_index();
-        int mend = mstart + nm;
+        std::unique_ptr<double[]> in(new double[static_cast<size_t>(inaux)*blocksize]);
 
-        for (int N = 0; N <= M; N++)
+        #ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+        #endif
+        for(int b = 0; b < nblock; b++)
         {
-            int nn = primary->shell(N).nfunction();
-            int nstart = primary->shell(N).function_index();
-            //int nend = nstart + nn;
+            int ij0 = b*blocksize;
+            int nij = std::min(blocksize, indim12 - ij0);
 
-            for (int P = 0; P < nauxshell; P++)
+            if(isbyq)
             {
-                int np = auxiliary->shell(P).nfunction();
-                int pstart = auxiliary->shell(P).function_index();
-                int pend = pstart + np;
-
-                int ncalc = eris[threadnum]->compute_shell(P,0,M,N);
-
-                if(ncalc)
+                // a block of columns
+                for(int q = 0; q < inaux; q++)
                 {
-                    for (int p = pstart, index = 0; p < pend; p++)
-                    {
-                        for (int m = 0; m < nm; m++)
-                        {
-                            for (int n = 0; n < nn; n++, index++)
-                            {
-                                B[threadnum][p*nm*nn + m*nn + n] = eribuffers[threadnum][index];
-                            }
-                        }
-                    }
+                    double * qstart = data_.get() + static_cast<size_t>(q)*indim12 + ij0;
+                    std::copy(qstart, qstart + nij, in.get() + static_cast<size_t>(q)*nij);
                 }
-            }
-
-            // we now have a set of columns of B, although "condensed"
-            // we can do a DGEMM with J
-            // Access to J are only reads, so that is safe in parallel
-            C_DGEMM('T','T',nm*nn, naux, naux, 1.0, B[threadnum], nm*nn, J, naux, 0.0,
-                    A[threadnum], naux);
 
-
-            // write to disk or store in memory
-            if(N == M)
-            {
-                int iwrite = 1;
-                for (int m0 = 0, m = mstart; m < mend; m0++, m++)
-                    Write_(A[threadnum] + (m0*nm)*naux, iwrite++, calcindex(m, mstart));
+                C_DGEMM('N', 'N', inaux, nij, inaux, 1.0, J, inaux,
+                        in.get(), nij, 0.0, data_.get() + ij0, indim12);
             }
             else
             {
-                for (int m0 = 0, m = mstart; m < mend; m0++, m++)
-                    Write_(A[threadnum] + (m0*nn)*naux, nn, calcindex(m, nstart));
+                // a block of rows
+                double * start = data_.get() + static_cast<size_t>(ij0)*inaux;
+                std::copy(start, start + static_cast<size_t>(nij)*inaux, in.get());
+
+                C_DGEMM('N', 'T', nij, inaux, inaux, 1.0, in.get(), inaux,
+                        J, inaux, 0.0, start, inaux);
             }
         }
     }
-
-    for(int i = 0; i < nthreads; i++)
-    {
-        delete [] A[i];
-        delete [] B[i];
-    }
 }
 
-void MemoryQTensor::Finalize_(int nthreads)
-{
-    using std::swap;
-
-    // done with fitting metric
-    //std::cout << "Calling memoryqtensor finalize for " << name() << "\n";
-    if(!fittingmetric_) // maybe this wasn't fast df
-        return;
 
+void MemoryQTensor::FinalizeFloat_(int nthreads)
+{
+    // Done a block of orbital indices at a time, since
+    // the metric has to be applied in double precision
     double * J = fittingmetric_->get_metric();
 
-    std::unique_ptr<double[]> newdata(new double[storesize()]);
-   
-    if(byq()) 
-    {
-        C_DGEMM('N', 'N', naux(), ndim12(), naux(),
-                     1.0, J, naux(),
-                     data_.get(), ndim12(), 
-                     0.0, newdata.get(), ndim12());
-    }
-    else
+    int inaux = naux();
+    int indim12 = ndim12();
+    int blocksize = FinalizeBlockSize_(nthreads, 2);
+    int nblock = (indim12 + blocksize - 1) / blocksize;
+    bool isbyq = byq();
+
+    #ifdef _OPENMP
+        #pragma omp parallel num_threads(nthreads)
+    #endif
     {
-        C_DGEMM('N', 'T', ndim12(), naux(), naux(),
-                     1.0, data_.get(), naux(), 
-                     J, naux(),
-                     0.0, newdata.get(), naux());
-    }
+        std::unique_ptr<double[]> in(new double[static_cast<size_t>(inaux)*blocksize]);
+        std::unique_ptr<double[]> out(new double[static_cast<size_t>(inaux)*blocksize]);
 
-    swap(data_, newdata);   
+        #ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+        #endif
+        for(int b = 0; b < nblock; b++)
+        {
+            int ij0 = b*blocksize;
+            int nij = std::min(blocksize, indim12 - ij0);
 
-    fittingmetric_.reset();
+            if(isbyq)
+            {
+                // a block of columns
+                for(int q = 0; q < inaux; q++)
+                {
+                    float * qstart = fdata_.get() + static_cast<size_t>(q)*indim12 + ij0;
+                    std::copy(qstart, qstart + nij, in.get() + static_cast<size_t>(q)*nij);
+                }
 
-    // newdata will be deleted here
+                C_DGEMM('N', 'N', inaux, nij, inaux, 1.0, J, inaux,
+                        in.get(), nij, 0.0, out.get(), nij);
+
+                for(int q = 0; q < inaux; q++)
+                    std::copy(out.get() + static_cast<size_t>(q)*nij, out.get() + static_cast<size_t>(q+1)*nij,
+                              fdata_.get() + static_cast<size_t>(q)*indim12 + ij0);
+            }
+            else
+            {
+                // a block of rows
+                float * start = fdata_.get() + static_cast<size_t>(ij0)*inaux;
+                std::copy(start, start + static_cast<size_t>(nij)*inaux, in.get());
+
+                C_DGEMM('N', 'T', nij, inaux, inaux, 1.0, in.get(), inaux,
+                        J, inaux, 0.0, out.get(), inaux);
+
+                std::copy(out.get(), out.get() + static_cast<size_t>(nij)*inaux, start);
+            }
+        }
+    }
 }
 
 } // close namespace panache
-
@@ -27,16 +27,26 @@ public:
      * \param [in] storeflags How the tensor should be stored (packed, etc)
      * \param [in] name Some descriptive name
      * \param [in] directory Directory where to store the files (if needed)
+     * \param [in] origin Calculation the tensor comes from
      */
-    MemoryQTensor(int storeflags, const std::string & name, const std::string & directory);
+    MemoryQTensor(int storeflags, const std::string & name, const std::string & directory,
+                  const QTensorOrigin & origin);
 
     ~MemoryQTensor();
 
+    virtual size_t MemoryUsed(void) const;
+
 protected:
     virtual void Write_(double * data, int nij, int ijstart);
     virtual void WriteByQ_(double * data, int nij, int ijstart);
     virtual void Read_(double * data, int nij, int ijstart);
     virtual void ReadByQ_(double * data, int nq, int qstart);
+    virtual void Write_(float * data, int nij, int ijstart);
+    virtual void WriteByQ_(float * data, int nq, int qstart);
+    virtual void Read_(float * data, int nij, int ijstart);
+    virtual void ReadByQ_(float * data, int nq, int qstart);
+    virtual const double * View_(bool byqview, int n, int start);
+    virtual void Gather_(double * data, const int * ij, int nij, int qstart, int nq);
     virtual void Init_(void);
     virtual void Finalize_(int nthreads);
 
@@ -49,7 +59,21 @@ protected:
                            int nthreads);
 
 private:
-    std::unique_ptr<double[]> data_;
+    std::unique_ptr<double[]> data_;  //!< Storage (double precision)
+    std::unique_ptr<float[]> fdata_;  //!< Storage (if QSTORAGE_FLOAT)
+
+    /*!
+     * \brief Number of orbital indices to apply the metric to at a time
+     *
+     * Chosen so that \p nbuf buffers for each thread fit in workspace()
+     */
+    int FinalizeBlockSize_(int nthreads, int nbuf) const;
+
+    /// Apply the fitting metric to double precision storage in place, a block at a time
+    void FinalizeDouble_(int nthreads);
+
+    /// Apply the fitting metric to single precision storage, a block at a time
+    void FinalizeFloat_(int nthreads);
 
     virtual void GenDFQso_Slow_(const SharedFittingMetric fit,
                                 const SharedBasisSet primary,
@@ -0,0 +1,312 @@
+/*! \file
+ * \brief Three-index tensor storage in a memory-mapped file (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include <cstdio> // for remove()
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "panache/Exception.h"
+#include "panache/Flags.h"
+#include "panache/storedqtensor/MmapQTensor.h"
+#include "panache/storedqtensor/StoreCopy.h"
+#include "panache/Output.h"
+
+namespace panache
+{
+
+MmapQTensor::MmapQTensor(int storeflags, const std::string & name, const std::string & directory,
+                         const QTensorOrigin & origin)
+             : LocalQTensor(storeflags, name, directory, origin),
+               fd_(-1), map_(nullptr), mapsize_(0), readonly_(false)
+{
+    if(filename_.length() == 0 || name.length() == 0)
+        throw RuntimeError("Error - no file specified!");
+
+    if(existed_ && (storeflags & QSTORAGE_READDISK))
+    {
+        Open_(true);
+
+        // Init() (called from ReadHeader_) maps the existing file.
+        // If the file can't be used, it is regenerated
+        if(ReadHeader_(fd_))
+            markfilled();
+        else
+            Close_();
+    }
+
+    if(!filled())
+        Open_(false);
+}
+
+
+MmapQTensor::~MmapQTensor()
+{
+    // Finish a file that is being kept. If that fails, the
+    // file is left marked incomplete and won't be reused.
+    if((storeflags() & QSTORAGE_KEEPDISK) && !readonly_ && filled() && fd_ >= 0)
+    {
+        try {
+            WriteChecksums_(fd_);
+        }
+        catch(const std::exception & ex)
+        {
+            output::printf("  Unable to finish writing file %s: %s\n", filename_.c_str(), ex.what());
+        }
+    }
+
+    Unmap_();
+    Close_();
+
+    // Erase the file
+    if(!(storeflags() & QSTORAGE_KEEPDISK))
+        std::remove(filename_.c_str());
+}
+
+
+void MmapQTensor::Init_(void)
+{
+    if(!readonly_)
+    {
+        // Not complete until the checksums are written
+        WriteHeader_(fd_, false);
+
+        size_t nbytes = DataOffset_() + DataBytes_();
+        if(ftruncate(fd_, static_cast<off_t>(nbytes)) != 0)
+            throw RuntimeError(std::string("Unable to resize file ") + filename_ + ": " + strerror(errno));
+    }
+
+    Map_();
+}
+
+
+void MmapQTensor::Open_(bool readonly)
+{
+    readonly_ = readonly;
+
+    if(readonly)
+        fd_ = open(filename_.c_str(), O_RDONLY);
+    else
+        fd_ = open(filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd_ < 0)
+        throw RuntimeError(std::string("Unable to open file ") + filename_ + ": " + strerror(errno));
+}
+
+
+void MmapQTensor::Close_(void)
+{
+    if(fd_ >= 0)
+    {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+
+void MmapQTensor::Map_(void)
+{
+    Unmap_();
+
+    // The header is mapped too, so that the
+    // data starts on a page boundary
+    mapsize_ = DataOffset_() + DataBytes_();
+
+    int prot = (readonly_ ? PROT_READ : (PROT_READ | PROT_WRITE));
+    void * m = mmap(nullptr, mapsize_, prot, MAP_SHARED, fd_, 0);
+
+    if(m == MAP_FAILED)
+        throw RuntimeError(std::string("Unable to map file ") + filename_ + ": " + strerror(errno));
+
+    map_ = m;
+}
+
+
+void MmapQTensor::Unmap_(void)
+{
+    if(map_)
+    {
+        munmap(map_, mapsize_);
+        map_ = nullptr;
+    }
+}
+
+
+void MmapQTensor::VerifyRead_(bool byqread, int n, int start)
+{
+    if(!readonly_ || n <= 0)
+        return;
+
+    // rows of the matrix in the file
+    size_t nrow = (byq() ? naux() : ndim12());
+    size_t rowlen = (byq() ? ndim12() : naux());
+    size_t elsize = (isfloat() ? sizeof(float) : sizeof(double));
+
+    size_t first, count;
+
+    if(byqread == (byq() != 0))
+    {
+        // whole rows
+        first = static_cast<size_t>(start)*rowlen;
+        count = static_cast<size_t>(n)*rowlen;
+    }
+    else
+    {
+        // part of every row
+        first = start;
+        count = (nrow-1)*rowlen + n;
+    }
+
+    VerifyChunks_(first*elsize, count*elsize);
+}
+
+
+void MmapQTensor::ReadData_(char * data, size_t nbytes, size_t offset)
+{
+    const char * src = static_cast<const char *>(map_) + DataOffset_() + offset;
+    std::copy(src, src + nbytes, data);
+}
+
+
+void MmapQTensor::CheckWritable_(void) const
+{
+    if(readonly_)
+        throw RuntimeError(std::string("Tensor ") + name() + " was read from disk and can't be written to");
+}
+
+
+double * MmapQTensor::DoubleData_(void) const
+{
+    return reinterpret_cast<double *>(static_cast<char *>(map_) + DataOffset_());
+}
+
+
+float * MmapQTensor::FloatData_(void) const
+{
+    return reinterpret_cast<float *>(static_cast<char *>(map_) + DataOffset_());
+}
+
+
+// Different threads write to different parts of the mapping,
+// so no synchronization is needed.
+
+void MmapQTensor::Write_(double * data, int nij, int ijstart)
+{
+    CheckWritable_();
+
+    if(isfloat())
+        StoreWriteIJ(FloatData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreWriteIJ(DoubleData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
+
+void MmapQTensor::Write_(float * data, int nij, int ijstart)
+{
+    CheckWritable_();
+
+    if(isfloat())
+        StoreWriteIJ(FloatData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreWriteIJ(DoubleData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
+
+void MmapQTensor::WriteByQ_(double * data, int nq, int qstart)
+{
+    CheckWritable_();
+
+    if(isfloat())
+        StoreWriteQ(FloatData_(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreWriteQ(DoubleData_(), data, byq(), naux(), ndim12(), nq, qstart);
+}
+
+void MmapQTensor::WriteByQ_(float * data, int nq, int qstart)
+{
+    CheckWritable_();
+
+    if(isfloat())
+        StoreWriteQ(FloatData_(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreWriteQ(DoubleData_(), data, byq(), naux(), ndim12(), nq, qstart);
+}
+
+void MmapQTensor::Read_(double * data, int nij, int ijstart)
+{
+    VerifyRead_(false, nij, ijstart);
+
+    if(isfloat())
+        StoreReadIJ(FloatData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreReadIJ(DoubleData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
+
+void MmapQTensor::Read_(float * data, int nij, int ijstart)
+{
+    VerifyRead_(false, nij, ijstart);
+
+    if(isfloat())
+        StoreReadIJ(FloatData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+    else
+        StoreReadIJ(DoubleData_(), data, byq(), naux(), ndim12(), nij, ijstart);
+}
+
+void MmapQTensor::ReadByQ_(double * data, int nq, int qstart)
+{
+    VerifyRead_(true, nq, qstart);
+
+    if(isfloat())
+        StoreReadQ(FloatData_(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreReadQ(DoubleData_(), data, byq(), naux(), ndim12(), nq, qstart);
+}
+
+void MmapQTensor::ReadByQ_(float * data, int nq, int qstart)
+{
+    VerifyRead_(true, nq, qstart);
+
+    if(isfloat())
+        StoreReadQ(FloatData_(), data, byq(), naux(), ndim12(), nq, qstart);
+    else
+        StoreReadQ(DoubleData_(), data, byq(), naux(), ndim12(), nq, qstart);
+}
+
+
+void MmapQTensor::Gather_(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    // check everything between the first and last rows used
+    if(byq())
+        VerifyRead_(true, nq, qstart);
+    else
+    {
+        auto range = std::minmax_element(ij, ij + nij);
+        VerifyRead_(false, *range.second - *range.first + 1, *range.first);
+    }
+
+    if(isfloat())
+        StoreGather(FloatData_(), data, byq(), naux(), ndim12(), ij, nij, qstart, nq);
+    else
+        StoreGather(DoubleData_(), data, byq(), naux(), ndim12(), ij, nij, qstart, nq);
+}
+
+
+const double * MmapQTensor::View_(bool byqview, int n, int start)
+{
+    // only rows of the stored matrix are contiguous
+    if(isfloat() || !map_ || byqview != (byq() != 0))
+        return nullptr;
+
+    // the caller reads the mapping directly, so check it first
+    VerifyRead_(byqview, n, start);
+
+    size_t rowlen = (byq() ? ndim12() : naux());
+    return DoubleData_() + static_cast<size_t>(start)*rowlen;
+}
+
+} // close namespace panache
+
@@ -0,0 +1,110 @@
+/*! \file
+ * \brief Three-index tensor storage in a memory-mapped file (header)
+ * \ingroup storedqgroup
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_MMAPQTENSOR_H
+#define PANACHE_MMAPQTENSOR_H
+
+#include "panache/storedqtensor/LocalQTensor.h"
+
+namespace panache
+{
+
+/*!
+ *  \brief Class for storing a 3-index tensor in a memory-mapped file
+ *  \ingroup storedqgroup
+ *
+ *  The file has the same layout as the one written by DiskQTensor, but is
+ *  accessed through a shared mapping. Reads and writes are plain copies
+ *  to and from the mapping, so there are no seeks and no critical
+ *  sections, and the kernel page cache keeps recently used parts of the
+ *  tensor in memory.
+ *
+ *  A file read with QSTORAGE_READDISK is mapped read-only, and its
+ *  checksums are checked as parts of it are first read.
+ *
+ *  The file is not striped. If several directories are given, only
+ *  the first is used.
+ */
+class MmapQTensor : public LocalQTensor
+{
+public:
+    /*
+     * \brief Construct with some basic information
+     *
+     * \param [in] storeflags How the tensor should be stored (packed, etc)
+     * \param [in] name Some descriptive name
+     * \param [in] directory Directory where to store the files
+     * \param [in] origin Calculation the tensor comes from
+     */
+    MmapQTensor(int storeflags, const std::string & name, const std::string & directory,
+                const QTensorOrigin & origin);
+
+    virtual ~MmapQTensor();
+
+protected:
+    virtual void Write_(double * data, int nij, int ijstart);
+    virtual void WriteByQ_(double * data, int nq, int qstart);
+    virtual void Read_(double * data, int nij, int ijstart);
+    virtual void ReadByQ_(double * data, int nq, int qstart);
+    virtual void Write_(float * data, int nij, int ijstart);
+    virtual void WriteByQ_(float * data, int nq, int qstart);
+    virtual void Read_(float * data, int nij, int ijstart);
+    virtual void ReadByQ_(float * data, int nq, int qstart);
+    virtual const double * View_(bool byqview, int n, int start);
+    virtual void Gather_(double * data, const int * ij, int nij, int qstart, int nq);
+    virtual void Init_(void);
+
+    // Now in LocalQTensor class
+    //virtual void Finalize_(int nthreads);
+    //virtual void NoFinalize_(void);
+    //virtual void GenDFQso_(const SharedFittingMetric fit, const SharedBasisSet primary,
+    //                       const SharedBasisSet auxiliary, int nthreads);
+
+    virtual void ReadData_(char * data, size_t nbytes, size_t offset);
+
+private:
+    int fd_;          //!< File descriptor of the mapped file
+    void * map_;      //!< Start of the mapping (null if not mapped)
+    size_t mapsize_;  //!< Size of the mapping (in bytes)
+    bool readonly_;   //!< File was opened read-only (QSTORAGE_READDISK)
+
+    /// Open the file (truncating it if not \p readonly)
+    void Open_(bool readonly);
+
+    /// Close the file (if open)
+    void Close_(void);
+
+    /// Map the (already sized) file
+    void Map_(void);
+
+    /// Remove the mapping
+    void Unmap_(void);
+
+    /*!
+     * \brief Check the checksums of the part of the file used by a read
+     *
+     * Only done for files read with QSTORAGE_READDISK
+     *
+     * \param [in] byqread Whether the read is by Q
+     * \param [in] n Number of indices read
+     * \param [in] start First index read
+     */
+    void VerifyRead_(bool byqread, int n, int start);
+
+    /// Throws if the mapping can't be written to
+    void CheckWritable_(void) const;
+
+    /// The mapping, as double precision
+    double * DoubleData_(void) const;
+
+    /// The mapping, as single precision
+    float * FloatData_(void) const;
+};
+
+} // close namespace panache
+
+#endif
+
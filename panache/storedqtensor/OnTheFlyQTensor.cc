@@ -0,0 +1,411 @@
+/*! \file
+ * \brief Three-index tensor generated on-the-fly (source)
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#include "panache/storedqtensor/OnTheFlyQTensor.h"
+#include "panache/Exception.h"
+#include "panache/Lapack.h"
+#include "panache/ERI.h"
+#include "panache/Flags.h"
+#include "panache/Iterator.h"
+#include "panache/BasisSet.h"
+#include "panache/FittingMetric.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace panache
+{
+
+OnTheFlyQTensor::OnTheFlyQTensor(int storeflags, const std::string & name)
+    : StoredQTensor(storeflags, name), nthreads_(1)
+{
+}
+
+
+void OnTheFlyQTensor::Init_(void)
+{
+    // Nothing to allocate
+}
+
+
+void OnTheFlyQTensor::GenDFQso_(const SharedFittingMetric fit,
+                                const SharedBasisSet primary,
+                                const SharedBasisSet auxiliary,
+                                int nthreads)
+{
+    // Nothing is computed here. Just keep what we need
+    // to compute the integrals later
+    fittingmetric_ = fit;
+    primary_ = primary;
+    auxiliary_ = auxiliary;
+    nthreads_ = nthreads;
+
+    // default constructor = zero basis
+    SharedBasisSet zero(new BasisSet);
+
+    eris_.clear();
+    for(int i = 0; i < nthreads_; i++)
+        eris_.push_back(GetERI(auxiliary_, zero, primary_, primary_));
+}
+
+
+void OnTheFlyQTensor::GenCHQso_(const SharedBasisSet primary,
+                                double delta,
+                                int nthreads)
+{
+    throw RuntimeError("Cholesky tensors cannot be generated on-the-fly");
+}
+
+
+void OnTheFlyQTensor::CopyGenInfo_(const OnTheFlyQTensor & rhs, int nthreads)
+{
+    fittingmetric_ = rhs.fittingmetric_;
+    primary_ = rhs.primary_;
+    auxiliary_ = rhs.auxiliary_;
+    nthreads_ = nthreads;
+
+    SharedBasisSet zero(new BasisSet);
+
+    eris_.clear();
+    for(int i = 0; i < nthreads_; i++)
+        eris_.push_back(GetERI(auxiliary_, zero, primary_, primary_));
+}
+
+
+void OnTheFlyQTensor::Transform_(const std::vector<TransformMat> & left,
+                                 const std::vector<TransformMat> & right,
+                                 std::vector<StoredQTensor *> results,
+                                 int nthreads)
+{
+    if(left.size() != right.size())
+        throw RuntimeError("Error - imbalanced left & right transformation matrix sizes!");
+    if(left.size() != results.size())
+        throw RuntimeError("Error - not enough results in vector");
+
+    int nso = primary_->nbf();
+
+    for(size_t i = 0; i < left.size(); i++)
+    {
+        OnTheFlyQTensor * qout = dynamic_cast<OnTheFlyQTensor *>(results[i]);
+        if(qout == nullptr)
+            throw RuntimeError("Cannot transform OnTheFlyQTensor into another type!");
+
+        int lncols = left[i].second;
+        int rncols = right[i].second;
+
+        if(lncols != qout->ndim1() || rncols != qout->ndim2())
+            throw RuntimeError("Error - transformation matrices don't match the result dimensions");
+
+        qout->CopyGenInfo_(*this, nthreads);
+        qout->cleft_ = std::unique_ptr<double[]>(new double[nso*lncols]);
+        qout->cright_ = std::unique_ptr<double[]>(new double[nso*rncols]);
+
+        // If this tensor is already transformed, the transformations
+        // are combined into a single nso x ncols matrix
+        if(cleft_)
+        {
+            C_DGEMM('N', 'N', nso, lncols, ndim1(), 1.0, cleft_.get(), ndim1(),
+                    left[i].first, lncols, 0.0, qout->cleft_.get(), lncols);
+            C_DGEMM('N', 'N', nso, rncols, ndim2(), 1.0, cright_.get(), ndim2(),
+                    right[i].first, rncols, 0.0, qout->cright_.get(), rncols);
+        }
+        else
+        {
+            std::copy(left[i].first, left[i].first + nso*lncols, qout->cleft_.get());
+            std::copy(right[i].first, right[i].first + nso*rncols, qout->cright_.get());
+        }
+    }
+}
+
+
+bool OnTheFlyQTensor::Slice_(int start1, int start2, StoredQTensor * result, int nthreads)
+{
+    // Slicing Qso would need a transformation anyway
+    if(!cleft_)
+        return false;
+
+    OnTheFlyQTensor * qout = dynamic_cast<OnTheFlyQTensor *>(result);
+    if(qout == nullptr)
+        return false;
+
+    int nso = primary_->nbf();
+    int lncols = qout->ndim1();
+    int rncols = qout->ndim2();
+
+    if(start1 + lncols > ndim1() || start2 + rncols > ndim2())
+        throw RuntimeError("Error - slice is larger than the tensor");
+
+    // A slice just uses some of the columns
+    // of the transformation matrices
+    qout->CopyGenInfo_(*this, nthreads);
+    qout->cleft_ = std::unique_ptr<double[]>(new double[nso*lncols]);
+    qout->cright_ = std::unique_ptr<double[]>(new double[nso*rncols]);
+
+    for(int i = 0; i < nso; i++)
+    {
+        std::copy(cleft_.get() + i*ndim1() + start1,
+                  cleft_.get() + i*ndim1() + start1 + lncols,
+                  qout->cleft_.get() + i*lncols);
+        std::copy(cright_.get() + i*ndim2() + start2,
+                  cright_.get() + i*ndim2() + start2 + rncols,
+                  qout->cright_.get() + i*rncols);
+    }
+
+    return true;
+}
+
+
+void OnTheFlyQTensor::Finalize_(int nthreads)
+{
+    // The metric is applied on every read
+}
+
+
+void OnTheFlyQTensor::NoFinalize_(void)
+{
+    // Don't release the metric - it is still
+    // needed when reading
+}
+
+
+size_t OnTheFlyQTensor::ScratchSize_(void) const
+{
+    if(!cleft_)
+        return 0;
+
+    size_t nso = primary_->nbf();
+
+    // expanded q + C(t) Q + C(t) Q C, for each thread
+    return nthreads_ * (nso*nso + ndim1()*nso + ndim1()*ndim2());
+}
+
+
+size_t OnTheFlyQTensor::RowOffset_(int i) const
+{
+    if(packed())
+        return (static_cast<size_t>(i)*(i+1))>>1;
+    else
+        return static_cast<size_t>(i)*ndim2();
+}
+
+
+void OnTheFlyQTensor::ComputeBlock_(int P, int mshell0, int mshell1, int i0, int i1,
+                                    double * rawso, double * scratch, double * target)
+{
+    int nso = primary_->nbf();
+    int nsotri = (nso*(nso+1))/2;
+
+    int np = auxiliary_->shell(P).nfunction();
+
+    // LibERD interface may not fill every value
+    std::fill(rawso, rawso + np*nsotri, 0.0);
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(nthreads_)
+#endif
+    for (int M = mshell0; M < mshell1; M++)
+    {
+        int threadnum = 0;
+#ifdef _OPENMP
+        threadnum = omp_get_thread_num();
+#endif
+        TwoBodyAOInt * integral = eris_[threadnum].get();
+        const double * buffer = integral->buffer();
+
+        int nm = primary_->shell(M).nfunction();
+        int mstart = primary_->shell(M).function_index();
+
+        for (int N = 0; N <= M; N++)
+        {
+            int nn = primary_->shell(N).nfunction();
+            int nstart = primary_->shell(N).function_index();
+
+            int ncalc = integral->compute_shell(P,0,M,N);
+
+            if(ncalc)
+            {
+                for (int p0 = 0; p0 < np; p0++)
+                {
+                    double * prow = rawso + p0*nsotri;
+                    const double * pbuf = buffer + p0*nm*nn;
+
+                    // if N == M, only the lower triangle (m0+1 elements) is stored
+                    for (int m0 = 0, m = mstart; m0 < nm; m0++, m++)
+                        std::copy(pbuf + m0*nn,
+                                  pbuf + m0*nn + ((N == M) ? m0+1 : nn),
+                                  prow + ((m*(m+1))>>1) + nstart);
+                }
+            }
+        }
+    }
+
+    // Qso - nothing else to do
+    if(!cleft_)
+    {
+        if(target != rawso)
+            std::copy(rawso, rawso + np*nsotri, target);
+        return;
+    }
+
+    int lncols = ndim1();
+    int rncols = ndim2();
+    bool ispacked = packed();
+
+    // Only rows [i0, i1) of the transformed tensor. If packed, only
+    // columns j <= i are needed
+    int ni = i1 - i0;
+    int njcols = (ispacked ? i1 : rncols);
+    size_t blk12 = RowOffset_(i1) - RowOffset_(i0);
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nthreads_)
+#endif
+    for (int p0 = 0; p0 < np; p0++)
+    {
+        int threadnum = 0;
+#ifdef _OPENMP
+        threadnum = omp_get_thread_num();
+#endif
+
+        double * myqe = scratch + threadnum*(nso*nso + lncols*nso + lncols*rncols);
+        double * myqc = myqe + nso*nso;
+        double * mycqc = myqc + lncols*nso;
+
+        // expand packed matrix
+        const double * myqp = rawso + p0*nsotri;
+        for(int i = 0, index = 0; i < nso; i++)
+            for(int j = 0; j <= i; j++)
+                myqe[i*nso+j] = myqe[j*nso+i] = myqp[index++];
+
+        C_DGEMM('T', 'N', ni, nso, nso, 1.0, cleft_.get() + i0, lncols, myqe, nso, 0.0, myqc, nso);
+        C_DGEMM('N', 'N', ni, njcols, nso, 1.0, myqc, nso, cright_.get(), rncols, 0.0, mycqc, rncols);
+
+        double * ptarget = target + p0*blk12;
+
+        if(ispacked)
+        {
+            for(int i = i0, index = 0; i < i1; i++)
+            for(int j = 0; j <= i; j++, index++)
+                ptarget[index] = mycqc[(i-i0)*rncols+j];
+        }
+        else
+            std::copy(mycqc, mycqc + static_cast<size_t>(ni)*rncols, ptarget);
+    }
+}
+
+
+void OnTheFlyQTensor::ReadByQ_(double * data, int nq, int qstart)
+{
+    std::lock_guard<std::mutex> l(readmtx_);
+
+    int inaux = naux();
+    int indim12 = ndim12();
+
+    std::fill(data, data + static_cast<size_t>(nq)*indim12, 0.0);
+
+    if(nq == 0)
+        return;
+
+    int nso = primary_->nbf();
+    int nsotri = (nso*(nso+1))/2;
+    int maxnp = auxiliary_->max_function_per_shell();
+
+    double * J = fittingmetric_->get_metric();
+
+    std::unique_ptr<double[]> rawso(new double[static_cast<size_t>(maxnp)*nsotri]);
+    std::unique_ptr<double[]> scratch(new double[ScratchSize_()]);
+    std::unique_ptr<double[]> block;
+
+    double * blockptr = rawso.get();
+    if(cleft_)
+    {
+        block = std::unique_ptr<double[]>(new double[static_cast<size_t>(maxnp)*indim12]);
+        blockptr = block.get();
+    }
+
+    for(int P = 0; P < auxiliary_->nshell(); P++)
+    {
+        int np = auxiliary_->shell(P).nfunction();
+        int pstart = auxiliary_->shell(P).function_index();
+
+        ComputeBlock_(P, 0, primary_->nshell(), 0, ndim1(), rawso.get(), scratch.get(), blockptr);
+
+        // Q(q,ij) += J(q,p) B(p,ij)
+        C_DGEMM('N', 'N', nq, indim12, np, 1.0, J + qstart*inaux + pstart, inaux,
+                blockptr, indim12, 1.0, data, indim12);
+    }
+}
+
+
+void OnTheFlyQTensor::Read_(double * data, int nij, int ijstart)
+{
+    std::lock_guard<std::mutex> l(readmtx_);
+
+    int inaux = naux();
+    int indim12 = ndim12();
+
+    std::fill(data, data + static_cast<size_t>(nij)*inaux, 0.0);
+
+    if(nij == 0)
+        return;
+
+    int nso = primary_->nbf();
+    int nsotri = (nso*(nso+1))/2;
+    int maxnp = auxiliary_->max_function_per_shell();
+
+    // Rows (first index) containing the requested ij
+    IJIterator itfirst(ndim1(), ndim2(), packed());
+    IJIterator itlast(itfirst);
+    itfirst += ijstart;
+    itlast += (ijstart + nij - 1);
+
+    int i0 = itfirst.i();
+    int i1 = itlast.i() + 1;
+
+    // For Qso, only the shells containing the requested
+    // rows have to be calculated. For transformed tensors, all
+    // shells are needed, but only these rows are transformed
+    int mshell0 = 0;
+    int mshell1 = primary_->nshell();
+
+    if(!cleft_)
+    {
+        mshell0 = primary_->function_to_shell(i0);
+        mshell1 = primary_->function_to_shell(i1 - 1) + 1;
+    }
+
+    // Where the block starts and how long it is
+    size_t off0 = (cleft_ ? RowOffset_(i0) : 0);
+    size_t blk12 = (cleft_ ? RowOffset_(i1) - off0 : indim12);
+
+    double * J = fittingmetric_->get_metric();
+
+    std::unique_ptr<double[]> rawso(new double[static_cast<size_t>(maxnp)*nsotri]);
+    std::unique_ptr<double[]> scratch(new double[ScratchSize_()]);
+    std::unique_ptr<double[]> block;
+
+    double * blockptr = rawso.get();
+    if(cleft_)
+    {
+        block = std::unique_ptr<double[]>(new double[static_cast<size_t>(maxnp)*blk12]);
+        blockptr = block.get();
+    }
+
+    for(int P = 0; P < auxiliary_->nshell(); P++)
+    {
+        int np = auxiliary_->shell(P).nfunction();
+        int pstart = auxiliary_->shell(P).function_index();
+
+        ComputeBlock_(P, mshell0, mshell1, i0, i1, rawso.get(), scratch.get(), blockptr);
+
+        // Q(ij,q) += B(p,ij) J(q,p)
+        C_DGEMM('T', 'T', nij, inaux, np, 1.0, blockptr + (ijstart - off0), blk12,
+                J + pstart, inaux, 1.0, data, inaux);
+    }
+}
+
+} // close namespace panache
+
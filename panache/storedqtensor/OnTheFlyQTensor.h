@@ -0,0 +1,131 @@
+/*! \file
+ * \brief Three-index tensor generated on-the-fly (header)
+ * \ingroup storedqgroup
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_ONTHEFLYQTENSOR_H
+#define PANACHE_ONTHEFLYQTENSOR_H
+
+#include <mutex>
+
+#include "panache/storedqtensor/StoredQTensor.h"
+
+namespace panache
+{
+
+class TwoBodyAOInt;
+typedef std::shared_ptr<TwoBodyAOInt> SharedTwoBodyAOInt;
+
+
+/*!
+ *  \brief Class for a 3-index tensor that is never stored
+ *  \ingroup storedqgroup
+ *
+ *  Nothing is kept except the basis sets, the fitting metric, and
+ *  (for transformed tensors) the transformation matrices. Every read
+ *  recomputes the needed three-center integrals, transforms them, and
+ *  applies the metric.
+ *
+ *  This trades (a lot of) recomputation for memory and disk. Reads should
+ *  therefore be done in batches that are as large as possible, since each
+ *  call to Read() or ReadByQ() loops over all auxiliary shells.
+ *
+ *  Reads from multiple threads are serialized, since they share the
+ *  integral objects (each read uses all the threads it was generated with).
+ */
+class OnTheFlyQTensor : public StoredQTensor
+{
+public:
+    /*
+     * \brief Construct with some basic information
+     *
+     * \param [in] storeflags How the tensor should be stored (packed, etc)
+     * \param [in] name Some descriptive name
+     */
+    OnTheFlyQTensor(int storeflags, const std::string & name);
+
+protected:
+    virtual void Read_(double * data, int nij, int ijstart);
+    virtual void ReadByQ_(double * data, int nq, int qstart);
+    virtual void Init_(void);
+
+    virtual void GenDFQso_(const SharedFittingMetric fit,
+                           const SharedBasisSet primary,
+                           const SharedBasisSet auxiliary,
+                           int nthreads);
+
+    virtual void GenCHQso_(const SharedBasisSet primary,
+                           double delta,
+                           int nthreads);
+
+    virtual void Transform_(const std::vector<TransformMat> & left,
+                            const std::vector<TransformMat> & right,
+                            std::vector<StoredQTensor *> results,
+                            int nthreads);
+
+    virtual bool Slice_(int start1, int start2, StoredQTensor * result, int nthreads);
+
+    virtual void Finalize_(int nthreads);
+    virtual void NoFinalize_(void);
+
+private:
+    SharedFittingMetric fittingmetric_; //!< Metric applied on every read
+    SharedBasisSet primary_;            //!< Primary basis set
+    SharedBasisSet auxiliary_;          //!< Auxiliary basis set
+    std::vector<SharedTwoBodyAOInt> eris_; //!< One integral object per thread
+    int nthreads_;                      //!< Number of threads to use when reading
+    std::mutex readmtx_;                //!< Serializes reads from different threads
+
+    std::unique_ptr<double[]> cleft_;  //!< Left transformation (nso x ndim1). Null for Qso
+    std::unique_ptr<double[]> cright_; //!< Right transformation (nso x ndim2). Null for Qso
+
+    /*!
+     * \brief Copy the generation information from another tensor
+     *
+     * Integral objects are created anew, so that different tensors
+     * can be read independently.
+     */
+    void CopyGenInfo_(const OnTheFlyQTensor & rhs, int nthreads);
+
+    /*!
+     * \brief Size of the scratch space needed by ComputeBlock_ (in number of doubles)
+     */
+    size_t ScratchSize_(void) const;
+
+    /*!
+     * \brief Compute the (transformed) integrals for a single auxiliary shell
+     *
+     * The metric is not applied. On return, \p target holds
+     * np x ndim12 elements (np is the number of functions in shell \p P).
+     * If this tensor is not transformed, \p target may be the same as \p rawso.
+     *
+     * Only shells \p M in the range [\p mshell0, \p mshell1) are computed. This is only
+     * meaningful for untransformed tensors.
+     *
+     * For transformed tensors, only rows [\p i0, \p i1) of the first index are transformed,
+     * and \p target holds np x (RowOffset_(i1) - RowOffset_(i0)) elements, starting
+     * at row \p i0.
+     *
+     * \param [in] P Auxiliary shell index
+     * \param [in] mshell0 First primary shell (first index) to compute
+     * \param [in] mshell1 One past the last primary shell to compute
+     * \param [in] i0 First row of a transformed tensor
+     * \param [in] i1 One past the last row of a transformed tensor
+     * \param [in] rawso Scratch for the packed integrals (np x nso*(nso+1)/2)
+     * \param [in] scratch Scratch for the transformation (of size ScratchSize_())
+     * \param [in] target Where to put the computed block
+     */
+    void ComputeBlock_(int P, int mshell0, int mshell1, int i0, int i1,
+                       double * rawso, double * scratch, double * target);
+
+    /*!
+     * \brief Combined orbital index at which row \p i of the first index starts
+     */
+    size_t RowOffset_(int i) const;
+};
+
+} // close namespace panache
+
+#endif
+
@@ -0,0 +1,113 @@
+/*! \file
+ * \brief Copying between contiguous tensor storage and a buffer
+ * \ingroup storedqgroup
+ * \author Benjamin Pritchard (ben@bennyp.org)
+ */
+
+#ifndef PANACHE_STORECOPY_H
+#define PANACHE_STORECOPY_H
+
+#include <algorithm>
+#include <cstddef>
+
+namespace panache
+{
+
+// Copies between the stored tensor and a buffer. The stored
+// tensor and buffer may be of different precision.
+
+// Write with the orbital index as the slowest index
+template<typename TS, typename TD>
+inline void StoreWriteIJ(TS * store, const TD * data, bool byq,
+                         size_t naux, size_t ndim12, int nij, int ijstart)
+{
+    if(byq)
+    {
+        for(size_t q = 0, qoff = 0; q < naux; q++, qoff += ndim12)
+            for(size_t ij = 0, ijoff = 0; ij < static_cast<size_t>(nij); ij++, ijoff += naux)
+                store[qoff+ijstart+ij] = data[ijoff+q];
+    }
+    else
+        std::copy(data, data+nij*naux, store + ijstart*naux);
+}
+
+// Write with the auxiliary index as the slowest index
+template<typename TS, typename TD>
+inline void StoreWriteQ(TS * store, const TD * data, bool byq,
+                        size_t naux, size_t ndim12, int nq, int qstart)
+{
+    if(byq)
+        std::copy(data, data + nq*ndim12, store + qstart*ndim12);
+    else
+    {
+        for(size_t q = 0, qoff = 0; q < static_cast<size_t>(nq); q++, qoff += ndim12)
+            for(size_t ij = 0, ijoff = 0; ij < ndim12; ij++, ijoff += naux)
+                store[ijoff+qstart+q] = data[qoff+ij];
+    }
+}
+
+// Read with the orbital index as the slowest index
+template<typename TS, typename TD>
+inline void StoreReadIJ(const TS * store, TD * data, bool byq,
+                        size_t naux, size_t ndim12, int nij, int ijstart)
+{
+    if(byq)
+    {
+        for(size_t q = 0, qoff = 0; q < naux; q++, qoff += ndim12)
+            for(size_t ij = 0, ijoff = 0; ij < static_cast<size_t>(nij); ij++, ijoff += naux)
+                data[ijoff+q] = store[qoff+ijstart+ij];
+    }
+    else
+    {
+        const TS * start = store + ijstart * naux;
+        std::copy(start, start+nij*naux, data);
+    }
+}
+
+// Read with the auxiliary index as the slowest index
+template<typename TS, typename TD>
+inline void StoreReadQ(const TS * store, TD * data, bool byq,
+                       size_t naux, size_t ndim12, int nq, int qstart)
+{
+    if(byq)
+    {
+        const TS * start = store + qstart*ndim12;
+        std::copy(start, start+nq*ndim12, data);
+    }
+    else
+    {
+        for(size_t q = 0, qoff = 0; q < static_cast<size_t>(nq); q++, qoff += ndim12)
+            for(size_t ij = 0, ijoff = 0; ij < ndim12; ij++, ijoff += naux)
+                data[qoff+ij] = store[ijoff+qstart+q];
+    }
+}
+
+// Read a list of orbital indices, for a range of auxiliary indices.
+// The data is stored with the orbital index as the slowest index
+template<typename TS, typename TD>
+inline void StoreGather(const TS * store, TD * data, bool byq,
+                        size_t naux, size_t ndim12, const int * ij, int nij, int qstart, int nq)
+{
+    if(byq)
+    {
+        for(size_t q = 0; q < static_cast<size_t>(nq); q++)
+        {
+            const TS * row = store + (qstart+q)*ndim12;
+            for(size_t k = 0, koff = 0; k < static_cast<size_t>(nij); k++, koff += nq)
+                data[koff+q] = row[ij[k]];
+        }
+    }
+    else
+    {
+        for(size_t k = 0, koff = 0; k < static_cast<size_t>(nij); k++, koff += nq)
+        {
+            const TS * start = store + static_cast<size_t>(ij[k])*naux + qstart;
+            std::copy(start, start+nq, data+koff);
+        }
+    }
+}
+
+} // close namespace panache
+
+#endif
+
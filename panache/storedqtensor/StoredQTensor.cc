@@ -3,6 +3,10 @@
  * \author Benjamin Pritchard (ben@bennyp.org)
  */
 
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
 #include "panache/storedqtensor/StoredQTensor.h"
 #include "panache/Exception.h"
 #include "panache/Flags.h"
@@ -10,12 +14,35 @@
 namespace panache
 {
 
+// Default memory for temporary buffers (128MB)
+#define DEFAULT_WORKSPACE_BYTES (static_cast<size_t>(128*1024*1024))
+
 StoredQTensor::StoredQTensor(int storeflags, const std::string & name)
-               : name_(name), storeflags_(storeflags)
+               : name_(name), storeflags_(storeflags), workspace_(DEFAULT_WORKSPACE_BYTES)
 {
     filled_ = false;
 }
 
+void StoredQTensor::SetWorkspace(size_t nbytes)
+{
+    workspace_ = nbytes;
+}
+
+size_t StoredQTensor::DefaultWorkspace(void)
+{
+    return DEFAULT_WORKSPACE_BYTES;
+}
+
+size_t StoredQTensor::workspace(void) const
+{
+    return workspace_;
+}
+
+size_t StoredQTensor::MemoryUsed(void) const
+{
+    return 0;
+}
+
 int StoredQTensor::naux(void) const
 {
     return naux_;
@@ -36,9 +63,9 @@ int StoredQTensor::ndim12(void) const
     return ndim12_;
 }
 
-int StoredQTensor::storesize(void) const
+size_t StoredQTensor::storesize(void) const
 {
-    return ndim12_*naux_;
+    return static_cast<size_t>(ndim12_)*naux_;
 }
 
 int StoredQTensor::storeflags(void) const
@@ -56,11 +83,21 @@ int StoredQTensor::byq(void) const
     return (storeflags_ & QSTORAGE_BYQ);
 }
 
+int StoredQTensor::isfloat(void) const
+{
+    return (storeflags_ & QSTORAGE_FLOAT);
+}
+
 bool StoredQTensor::filled(void) const
 {
     return filled_;
 }
 
+bool StoredQTensor::verified(void) const
+{
+    return Verified_();
+}
+
 void StoredQTensor::markfilled(void)
 {
     filled_ = true;
@@ -76,9 +113,9 @@ int StoredQTensor::calcindex(int i, int j) const
     if(!packed())
         return (i*ndim2_+j);
     else if(i >= j)
-        return ((i*(i+1))>>1) + j;
+        return static_cast<int>((static_cast<int64_t>(i)*(i+1))>>1) + j;
     else
-        return ((j*(j+1))>>1) + i;
+        return static_cast<int>((static_cast<int64_t>(j)*(j+1))>>1) + i;
 }
 
 void StoredQTensor::Init(int naux, int ndim1, int ndim2)
@@ -90,7 +127,14 @@ void StoredQTensor::Init(int naux, int ndim1, int ndim2)
     if(packed() && ndim1 != ndim2)
         throw RuntimeError("non square packed matrices?");
 
-    ndim12_ = (packed() ? (ndim1_ * (ndim2_+1))/2 : ndim1_*ndim2_);
+    // orbital indices are ints. The total size is not
+    int64_t ndim12 = (packed() ? (static_cast<int64_t>(ndim1_) * (ndim2_+1))/2
+                               : static_cast<int64_t>(ndim1_)*ndim2_);
+
+    if(ndim12 > std::numeric_limits<int>::max())
+        throw RuntimeError("Too many combined orbital indices for tensor " + name_);
+
+    ndim12_ = static_cast<int>(ndim12);
 
     Init_();
 }
@@ -141,6 +185,166 @@ int StoredQTensor::ReadByQ(double * data, int nq, int qstart)
     return nq;
 }
 
+void StoredQTensor::Gather(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    if(nij < 0 || nq < 0)
+        throw RuntimeError("Gather() passed with negative nij or nq!");
+
+    if(qstart < 0 || qstart + nq > naux_)
+        throw RuntimeError("Gather() passed with auxiliary indices out of range!");
+
+    for(int k = 0; k < nij; k++)
+        if(ij[k] < 0 || ij[k] >= ndim12_)
+            throw RuntimeError("Gather() passed with orbital indices out of range!");
+
+    if(nij > 0 && nq > 0)
+        Gather_(data, ij, nij, qstart, nq);
+}
+
+void StoredQTensor::ReadBlock(double * data, int istart, int ni, int jstart, int nj, int qstart, int nq)
+{
+    if(ni < 0 || nj < 0)
+        throw RuntimeError("ReadBlock() passed with negative ni or nj!");
+
+    if(istart < 0 || istart + ni > ndim1_ || jstart < 0 || jstart + nj > ndim2_)
+        throw RuntimeError("ReadBlock() passed with orbital indices out of range!");
+
+    std::vector<int> ij;
+    ij.reserve(static_cast<size_t>(ni)*nj);
+
+    for(int i = 0; i < ni; i++)
+    for(int j = 0; j < nj; j++)
+        ij.push_back(calcindex(istart+i, jstart+j));
+
+    Gather(data, ij.data(), static_cast<int>(ij.size()), qstart, nq);
+}
+
+void StoredQTensor::Gather_(double * data, const int * ij, int nij, int qstart, int nq)
+{
+    size_t inaux = naux_;
+
+    // Read_() may be expensive for each call (ie, on-the-fly), so the
+    // indices are read in order, in windows as large as the workspace allows
+    std::vector<std::pair<int, int>> sorted(nij);
+    for(int k = 0; k < nij; k++)
+        sorted[k] = std::make_pair(ij[k], k);
+    std::sort(sorted.begin(), sorted.end());
+
+    int window = static_cast<int>(std::min(std::max(static_cast<size_t>(1), workspace() / (sizeof(double)*inaux)),
+                                           static_cast<size_t>(ndim12_)));
+    std::unique_ptr<double[]> buf(new double[static_cast<size_t>(window)*inaux]);
+
+    for(size_t s = 0; s < sorted.size(); )
+    {
+        int ij0 = sorted[s].first;
+        int n = std::min(window, ndim12_ - ij0);
+        Read_(buf.get(), n, ij0);
+
+        for(; s < sorted.size() && sorted[s].first < ij0 + n; s++)
+        {
+            const double * start = buf.get() + (sorted[s].first - ij0)*inaux + qstart;
+            std::copy(start, start + nq, data + static_cast<size_t>(sorted[s].second)*nq);
+        }
+    }
+}
+
+int StoredQTensor::View(const double *& data, int nij, int ijstart)
+{
+    if(nij < 0)
+        throw RuntimeError("View() passed with negative nij!");
+
+    if(ijstart + nij >= ndim12())
+        nij = ndim12() - ijstart;
+
+    data = View_(false, nij, ijstart);
+    return nij;
+}
+
+int StoredQTensor::ViewByQ(const double *& data, int nq, int qstart)
+{
+    if(nq < 0)
+        throw RuntimeError("View() passed with negative nq!");
+
+    if(qstart + nq >= naux_)
+        nq = naux_-qstart;
+
+    data = View_(true, nq, qstart);
+    return nq;
+}
+
+const double * StoredQTensor::View_(bool, int, int)
+{
+    return nullptr;
+}
+
+bool StoredQTensor::Verified_(void) const
+{
+    return true;
+}
+
+int StoredQTensor::Read(float * data, int nij, int ijstart)
+{
+    if(nij < 0)
+        throw RuntimeError("Read() passed with negative nij!");
+
+    if(ijstart + nij >= ndim12())
+        nij = ndim12() - ijstart;
+
+    Read_(data, nij, ijstart);
+    return nij;
+}
+
+int StoredQTensor::ReadByQ(float * data, int nq, int qstart)
+{
+    if(nq < 0)
+        throw RuntimeError("Read() passed with negative nq!");
+
+    if(qstart + nq >= naux_)
+        nq = naux_-qstart;
+
+    ReadByQ_(data, nq, qstart);
+    return nq;
+}
+
+
+// Converting reads are done a piece at a time so that the
+// double precision buffer doesn't get too big
+#define CONVERT_MAXBATCH_DOUBLES (1024*1024)
+
+void StoredQTensor::Read_(float * data, int nij, int ijstart)
+{
+    if(nij <= 0)
+        return;
+
+    int nijbatch = std::max(1, std::min(nij, CONVERT_MAXBATCH_DOUBLES / naux_));
+    std::unique_ptr<double[]> buf(new double[nijbatch*naux_]);
+
+    for(int ij = 0; ij < nij; ij += nijbatch)
+    {
+        int n = std::min(nijbatch, nij - ij);
+        Read_(buf.get(), n, ijstart + ij);
+        std::copy(buf.get(), buf.get() + static_cast<size_t>(n)*naux_,
+                  data + static_cast<size_t>(ij)*naux_);
+    }
+}
+
+void StoredQTensor::ReadByQ_(float * data, int nq, int qstart)
+{
+    if(nq <= 0 || ndim12_ == 0)
+        return;
+
+    int nqbatch = std::max(1, std::min(nq, CONVERT_MAXBATCH_DOUBLES / ndim12_));
+    std::unique_ptr<double[]> buf(new double[nqbatch*ndim12_]);
+
+    for(int q = 0; q < nq; q += nqbatch)
+    {
+        int n = std::min(nqbatch, nq - q);
+        ReadByQ_(buf.get(), n, qstart + q);
+        std::copy(buf.get(), buf.get() + static_cast<size_t>(n)*ndim12_,
+                  data + static_cast<size_t>(q)*ndim12_);
+    }
+}
+
 
 CumulativeTime & StoredQTensor::GenTimer(void)
 {
@@ -205,6 +409,32 @@ void StoredQTensor::Transform(const std::vector<TransformMat> & left,
         it->filled_ = true;
 }
 
+bool StoredQTensor::Slice(int start1, int start2, StoredQTensor * result, int nthreads)
+{
+// Slicing is part of generation of the result
+#ifdef PANACHE_TIMING
+    Timer tim;
+    tim.Start();
+#endif
+
+    if(!Slice_(start1, start2, result, nthreads))
+        return false;
+
+    result->filled_ = true;
+
+#ifdef PANACHE_TIMING
+    tim.Stop();
+    result->GenTimer().AddTime(tim);
+#endif
+
+    return true;
+}
+
+bool StoredQTensor::Slice_(int start1, int start2, StoredQTensor * result, int nthreads)
+{
+    return false;
+}
+
 void StoredQTensor::Finalize(int nthreads)
 {
 // Finalizing is part of generation
@@ -11,6 +11,7 @@
 #include <memory>
 #include <string>
 #include <vector>
+#include <cstdint>
 
 #include "panache/Timing.h"
 
@@ -23,6 +24,25 @@ class BasisSet;
 typedef std::shared_ptr<BasisSet> SharedBasisSet;
 
 
+/*!
+ *  \brief Describes the calculation a tensor came from
+ *  \ingroup storedqgroup
+ *
+ *  This is stored with tensors saved to disk, so that a file
+ *  from a different calculation is not reused.
+ */
+struct QTensorOrigin
+{
+    int qtype;          //!< Type of tensor (QTYPE_DFQSO, etc)
+    int bsorder;        //!< Ordering of basis functions (BSORDER_PSI4, etc)
+    uint64_t options;   //!< Method options (fitting metric flags, or a hash of the cholesky delta)
+    uint64_t inputhash; //!< Hash of the basis sets and geometry
+    uint64_t orbhash;   //!< Hash of the orbitals the tensor is transformed with (0 if not transformed)
+
+    QTensorOrigin() : qtype(0), bsorder(0), options(0), inputhash(0), orbhash(0) { }
+};
+
+
 /*!
  *  \brief Generic/Abstract interface for storing a 3-index tensor
  *  \ingroup storedqgroup
@@ -48,6 +68,27 @@ public:
      */
     int StoreFlags(void) const;
 
+    /*!
+     * \brief Set the memory available for temporary buffers
+     *
+     * Limits the buffers used while generating and finalizing
+     * the tensor (not including the tensor itself). Must be
+     * set before generating the tensor.
+     *
+     * \param [in] nbytes Memory for buffers (in bytes)
+     */
+    void SetWorkspace(size_t nbytes);
+
+    /// Memory for temporary buffers used if not set with SetWorkspace() (in bytes)
+    static size_t DefaultWorkspace(void);
+
+    /*!
+     * \brief Get the memory used to store the tensor (in bytes)
+     *
+     * Does not include temporary buffers
+     */
+    virtual size_t MemoryUsed(void) const;
+
    
     /*!
      * \brief Read data with the orbital index as the slowest index
@@ -78,6 +119,78 @@ public:
     int ReadByQ(double * data, int nq, int qstart);
 
 
+    /*!
+     * \brief Read data in single precision with the orbital index as the slowest index
+     *
+     * Data stored in double precision is converted.
+     *
+     * \copydetails Read(double *, int, int)
+     */
+    int Read(float * data, int nij, int ijstart);
+
+
+    /*!
+     * \brief Read data in single precision with the auxiliary index as the slowest index
+     *
+     * Data stored in double precision is converted.
+     *
+     * \copydetails ReadByQ(double *, int, int)
+     */
+    int ReadByQ(float * data, int nq, int qstart);
+
+
+    /*!
+     * \brief Read a list of orbital indices, for a range of auxiliary indices
+     *
+     * The data is stored with the orbital index as the slowest index, in the
+     * order given in \p ij. The buffer should be nij * nq elements.
+     *
+     * \param [in] data Pointer to memory location to put the data
+     * \param [in] ij Combined orbital indices to obtain
+     * \param [in] nij Number of orbital indices in \p ij
+     * \param [in] qstart Starting auxiliary index
+     * \param [in] nq Number of auxiliary indices to obtain
+     */
+    void Gather(double * data, const int * ij, int nij, int qstart, int nq);
+
+
+    /*!
+     * \brief Read a block of the tensor
+     *
+     * Reads orbitals [\p istart, \p istart + \p ni) x [\p jstart, \p jstart + \p nj)
+     * and auxiliary indices [\p qstart, \p qstart + \p nq). The data is stored with i
+     * as the slowest index and q as the fastest (ie, data[(i*nj + j)*nq + q]), and is
+     * expanded if the tensor is packed. The buffer should be ni * nj * nq elements.
+     */
+    void ReadBlock(double * data, int istart, int ni, int jstart, int nj, int qstart, int nq);
+
+
+    /*!
+     * \brief Get a pointer to stored data with the orbital index as the slowest index
+     *
+     * Nothing is copied. The pointer is to the storage itself, and so is only
+     * available if the tensor is stored (in double precision) with the orbital index
+     * as the slowest index, somewhere it can be addressed directly. Otherwise
+     * \p data is set to null and the data should be read with Read().
+     *
+     * The data is valid until the tensor is destroyed.
+     *
+     * \param [out] data Pointer to \p nij * naux elements (or null)
+     * \param [in] nij Number of orbital pairs to obtain
+     * \param [in] ijstart Starting orbital index
+     * \return Number of orbital pairs (less than \p nij at the end of the tensor)
+     */
+    int View(const double *& data, int nij, int ijstart);
+
+
+    /*!
+     * \brief Get a pointer to stored data with the auxiliary index as the slowest index
+     *
+     * Same as View(), but for the auxiliary index. The data is \p nq * ndim12 elements.
+     */
+    int ViewByQ(const double *& data, int nq, int qstart);
+
+
     /*!
      * \brief Initialize storage for a given size
      *
@@ -142,6 +255,23 @@ public:
                    std::vector<StoredQTensor *> results,
                    int nthreads);
 
+    /*!
+     *  \brief Copy a block of orbital indices of this tensor into another tensor
+     *
+     *  \p result receives the elements (i, j) of this tensor with i in
+     *  [\p start1, \p start1 + result->ndim1()) and j in [\p start2, \p start2 + result->ndim2()).
+     *  If this tensor is packed, it is symmetric and elements above the diagonal
+     *  are taken from below it. A packed \p result must lie on the diagonal.
+     *
+     *  Used to obtain Qoo, Qov, and Qvv from Qmo without transforming Qso again.
+     *
+     *  The object in \p result must be created and initialized already.
+     *
+     *  \return False if slicing is not supported for this kind of tensor
+     *          (\p result is left untouched)
+     */
+    bool Slice(int start1, int start2, StoredQTensor * result, int nthreads);
+
     /*!
      * \brief Perform any final tranformations, etc, on the tensor
      *
@@ -192,9 +322,20 @@ public:
     /// Get whether or not this tensor is stored by q
     int byq(void) const;
 
+    /// Get whether or not this tensor is stored in single precision
+    int isfloat(void) const;
+
     /// Get whether or not this tensor is filled in
     bool filled(void) const;
 
+    /*!
+     * \brief Get whether all of the stored data has been checked
+     *
+     * Data reused from a file (QSTORAGE_READDISK) is checked against its checksums as it is
+     * first read. Until then, the data should not be accessed except through Read(), etc.
+     */
+    bool verified(void) const;
+
     /*!
      *  \brief Calculate the combined orbital index given a pair of orbitals.
      *
@@ -225,6 +366,34 @@ protected:
     /// To be implemented by derived classes
     virtual void ReadByQ_(double * data, int nq, int qstart) = 0;
 
+    /// \copydoc Read(float *, int, int)
+    /// Default reads in double precision and converts
+    virtual void Read_(float * data, int nij, int ijstart);
+
+    /// \copydoc ReadByQ(float *, int, int)
+    /// Default reads in double precision and converts
+    virtual void ReadByQ_(float * data, int nq, int qstart);
+
+    /// \copydoc Gather()
+    /// Default reads the indices in order, in windows that fit in workspace()
+    virtual void Gather_(double * data, const int * ij, int nij, int qstart, int nq);
+
+    /*!
+     * \brief Get a pointer to stored data, without copying
+     *
+     * Default returns null (the data can't be viewed)
+     *
+     * \param [in] byqview Whether the auxiliary index should be the slowest index
+     * \param [in] n Number of indices
+     * \param [in] start First index
+     * \return Pointer to the data, or null if it can't be viewed directly
+     */
+    virtual const double * View_(bool byqview, int n, int start);
+
+    /// \copydoc verified()
+    /// Default returns true (nothing to check)
+    virtual bool Verified_(void) const;
+
     /// \copydoc GenDFQso()
     /// To be implemented by derived classes
     virtual void GenDFQso_(const SharedFittingMetric fit,
@@ -246,6 +415,10 @@ protected:
                             std::vector<StoredQTensor *> results,
                             int nthreads) = 0;
 
+    /// \copydoc Slice()
+    /// Default does not support slicing
+    virtual bool Slice_(int start1, int start2, StoredQTensor * result, int nthreads);
+
     /// \copydoc Finalize()
     /// To be implemented by derived classes
     virtual void Finalize_(int nthreads) = 0;
@@ -255,11 +428,14 @@ protected:
     virtual void NoFinalize_(void) = 0;
 
     /// Get the total size of the stored tensor
-    int storesize(void) const;
+    size_t storesize(void) const;
 
     /// Mark this tensor object as filled in
     void markfilled(void);
 
+    /// Get the memory available for temporary buffers (in bytes)
+    size_t workspace(void) const;
+
 private:
     std::string name_;
 
@@ -269,6 +445,7 @@ private:
     int ndim12_; //!< Combined size of index 1 and 2 (depends on packing)
     int storeflags_; //!< How is this tensor stored
     bool filled_;    //!< Tensor has been filled in
+    size_t workspace_; //!< Memory available for buffers (in bytes)
 
     CumulativeTime gen_timer_; //!< Timer for the generation of this tensor
     CumulativeTime getijbatch_timer_; //!< Timer for getting batch by orbital index
@@ -9,6 +9,9 @@
 // All the different StoredQTensor types
 #include "panache/storedqtensor/MemoryQTensor.h"
 #include "panache/storedqtensor/DiskQTensor.h"
+#include "panache/storedqtensor/MmapQTensor.h"
+#include "panache/storedqtensor/HybridQTensor.h"
+#include "panache/storedqtensor/OnTheFlyQTensor.h"
 
 #ifdef PANACHE_CYCLOPS
 #include "panache/storedqtensor/CyclopsQTensor.h"
@@ -18,10 +21,20 @@ namespace panache
 {
 
 UniqueStoredQTensor 
-StoredQTensorFactory(int storeflags, const std::string & name, const std::string & directory)
+StoredQTensorFactory(int storeflags, const std::string & name, const std::string & directory,
+                     const QTensorOrigin & origin, size_t maxmem)
 {
-    if(storeflags & QSTORAGE_ONDISK)
-        return UniqueStoredQTensor(new DiskQTensor(storeflags, name, directory));
+    if(storeflags & QSTORAGE_MMAP)
+        return UniqueStoredQTensor(new MmapQTensor(storeflags, name, directory, origin));
+
+    else if(storeflags & QSTORAGE_HYBRID)
+        return UniqueStoredQTensor(new HybridQTensor(storeflags, name, directory, origin, maxmem));
+
+    else if(storeflags & QSTORAGE_ONDISK)
+        return UniqueStoredQTensor(new DiskQTensor(storeflags, name, directory, origin));
+
+    else if(storeflags & QSTORAGE_ONFLY)
+        return UniqueStoredQTensor(new OnTheFlyQTensor(storeflags, name));
 
     #ifdef PANACHE_CYCLOPS
     else if(storeflags & QSTORAGE_CYCLOPS)
@@ -29,18 +42,19 @@ StoredQTensorFactory(int storeflags, const std::string & name, const std::string
     #endif
 
     else
-        return UniqueStoredQTensor(new MemoryQTensor(storeflags, name, directory));
+        return UniqueStoredQTensor(new MemoryQTensor(storeflags, name, directory, origin));
 }
 
 UniqueStoredQTensor 
 StoredQTensorFactory(int naux, int ndim1, int ndim2,
                      int storeflags, const std::string & name,
-                     const std::string & directory)
+                     const std::string & directory,
+                     const QTensorOrigin & origin, size_t maxmem)
 {
     if(name == "")
         throw RuntimeError("NO NAME SPECIFIED");
 
-    auto ptr = StoredQTensorFactory(storeflags, name, directory);
+    auto ptr = StoredQTensorFactory(storeflags, name, directory, origin, maxmem);
 
     if(!ptr->filled()) // may have been filled already, ie disk file exists
         ptr->Init(naux, ndim1, ndim2);
@@ -14,6 +14,7 @@ namespace panache
 {
 
 class StoredQTensor;
+struct QTensorOrigin;
 
 /*!
  * \brief Create and initialize a StoredQTensor object
@@ -26,10 +27,13 @@ class StoredQTensor;
  * \param [in] storeflags How to store (disk, memory, packed, etc)
  * \param [in] name Name of the tensor
  * \param [in] directory Directory for disk storage (if needed)
+ * \param [in] origin Calculation the tensor comes from (checked when reading from disk)
+ * \param [in] maxmem Memory available to store the tensor (in bytes, used by QSTORAGE_HYBRID)
  * \return Pointer to a an object derived from StoredQTensor
  */
 UniqueStoredQTensor StoredQTensorFactory(int naux, int ndim1, int ndim2, int storeflags,
-        const std::string & name, const std::string & directory);
+        const std::string & name, const std::string & directory,
+        const QTensorOrigin & origin, size_t maxmem);
 
 
 /*!
@@ -41,9 +45,12 @@ UniqueStoredQTensor StoredQTensorFactory(int naux, int ndim1, int ndim2, int sto
  * \param [in] storeflags How to store (disk, memory, packed, etc)
  * \param [in] name Name of the tensor
  * \param [in] directory Directory for disk storage (if needed)
+ * \param [in] origin Calculation the tensor comes from (checked when reading from disk)
+ * \param [in] maxmem Memory available to store the tensor (in bytes, used by QSTORAGE_HYBRID)
  * \return Pointer to a an object derived from StoredQTensor
  */
-UniqueStoredQTensor StoredQTensorFactory(int storeflags, const std::string & name, const std::string & directory);
+UniqueStoredQTensor StoredQTensorFactory(int storeflags, const std::string & name, const std::string & directory,
+                                         const QTensorOrigin & origin, size_t maxmem);
 
 } // close namespace panache
 
@@ -25,6 +25,15 @@
 #define QMO_SUM_THRESHOLD 1e-6
 #define QMO_CHECKSUM_THRESHOLD 2.0
 
+// for transformed tensors stored in single precision
+#define QMOF_ELEMENT_THRESHOLD 1e-6
+#define QMOF_SUM_THRESHOLD 1e-3
+#define QMOF_CHECKSUM_THRESHOLD 50.0
+
+// relative, for J, K, and four-index integrals
+#define JK_THRESHOLD 1e-9
+#define JKF_THRESHOLD 1e-5
+
 using namespace panache;
 using namespace std;
 
@@ -36,6 +45,22 @@ using namespace std;
 
 ostream * out;
 
+void PrintPlan(const string & title, const QTensorPlan & plan)
+{
+    *out << "\n" << title << " plan:\n"
+         << "    Auxiliary functions: " << plan.naux << "\n"
+         << "     Store flags (Qso): " << plan.storeflags << " (" << plan.qsoflags << ")\n"
+         << "         Metric applied: " << (plan.fastdf ? "after transformation" : "to Qso") << "\n"
+         << "    Sliced from Qmo: " << (plan.sliceqmo ? "yes" : "no") << "\n"
+         << "     Store by Q: " << (plan.byq ? "yes" : "no") << "\n"
+         << "    Transform batch: " << plan.transformbatch << "\n"
+         << "    Peak memory (MB): " << plan.peakmemory/(1024.0*1024.0) << "\n"
+         << "     Disk usage (MB): " << plan.diskusage/(1024.0*1024.0) << "\n"
+         << "          Integrals: " << plan.nintegrals << "\n"
+         << "    Transform flops: " << plan.transformflops << "\n"
+         << "       Metric flops: " << plan.metricflops << "\n";
+}
+
 void PrintUsage(void)
 {
     *out << "\n"
@@ -46,15 +71,24 @@ void PrintUsage(void)
          << "Options:\n"
          << "-v           Verbose printing\n"
          << "-d           Write Q tensors to disk (rather than in core)\n"
+         << "-m           Write Q tensors to a memory-mapped file\n"
+         << "-H           Memory limit in kilobytes (tensors in memory spill the rest to disk)\n"
          << "-k           Keep Q tensors on disk when done\n"
+         << "-o           Generate Q tensors on-the-fly (not stored, requires -C)\n"
          << "-c           Use Cyclops Tensor Framework\n"
          << "-b           Number of batches to get at a time (default = all)\n"
+         << "-p           Number of batches to prefetch in the background (default = 1, none)\n"
+         << "-s           Number of directories to stripe disk tensors across (/tmp/df, /tmp/df.1, etc)\n"
          << "-t           Use transpose of C matrix\n"
          << "-g           Generate tests from basis/molecule info\n"
          << "-C           Disable cholesky runs\n"
          << "-S           Skip testing (useful for benchmarking)\n"
          << "-X           Skip getting batches + testing (useful for benchmarking)\n"
          << "-r           Read tensor from disk\n"
+         << "-F           Store transformed tensors in single precision\n"
+         << "-f           Only generate Qoo, Qov, and Qvv (metric applied after transformation)\n"
+         << "-V           Get batches without copying where possible (rather than with iterators)\n"
+         << "-P           Print the predicted resources for generating the tensors and exit\n"
          << "-h           Print help (you're looking at it\n"
          << "<dir>        Directory holding the test information\n"
          << "\n\n";
@@ -402,6 +436,34 @@ std::shared_ptr<SimpleMatrix> ReadCMatrixFile(const string & filename)
 }
 
 
+std::vector<double> ReadOrbEnFile(const string & filename)
+{
+    ifstream f(filename.c_str());
+
+    if(!f.is_open())
+        throw runtime_error("Cannot open orbital energy file!");
+
+    f.exceptions(std::ifstream::failbit |
+                 std::ifstream::badbit  |
+                 std::ifstream::eofbit);
+    try
+    {
+        int n;
+        f >> n;
+
+        std::vector<double> vec(n);
+        for(int i = 0; i < n; i++)
+            f >> vec[i];
+
+        return vec;
+    }
+    catch(...)
+    {
+        throw runtime_error("Error parsing orbital energy file");
+    }
+}
+
+
 int ReadNocc(const string & filename)
 {
     ifstream f(filename.c_str());
@@ -430,7 +492,7 @@ int ReadNocc(const string & filename)
 
 
 int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
-                  int batchsize, int tensorflag,
+                  int batchsize, int prefetch, bool useview, int tensorflag,
                   const string & reffile,
                   double sum_threshold, double checksum_threshold, double element_threshold,
                   bool skiptest, bool verbose)
@@ -452,12 +514,9 @@ int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
     //std::fill(mat.get(), mat.get()+matsize, 0.0);
     //std::fill(outbuf.get(), outbuf.get()+bufsize, 0.0);
 
-    // First, do by q
-    ThreeIndexTensor::IteratedQTensorByQ iqtq = dft.IterateByQ(tensorflag, outbuf.get(), bufsize);
-    while(iqtq)
+    // Store a row of the tensor
+    auto StoreQ = [&](int curq, const double * row)
     {
-        int curq = iqtq.q();
-
         // tests are always done on unpacked matrices
         if(dft.IsPacked(tensorflag))
         {
@@ -465,12 +524,31 @@ int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
             for(int j = 0; j <= i; j++)
                 mat[curq*ndim1*ndim2+i*ndim2+j] 
               = mat[curq*ndim1*ndim2+j*ndim1+i] 
-              = iqtq[i*(i+1)/2+j];
+              = row[i*(i+1)/2+j];
         }
         else
-            std::copy(iqtq.Get(), iqtq.Get() + ndim12, mat.get() + curq*ndim12);
+            std::copy(row, row + ndim12, mat.get() + curq*ndim12);
+    };
 
-        ++iqtq;
+    // First, do by q
+    if(useview)
+    {
+        const double * data;
+        int n;
+        for(int q = 0; (n = dft.GetQBatchView(tensorflag, data, outbuf.get(), bufsize, q)) > 0; q += n)
+        {
+            for(int k = 0; k < n; k++)
+                StoreQ(q+k, data + k*ndim12);
+        }
+    }
+    else
+    {
+        ThreeIndexTensor::IteratedQTensorByQ iqtq = dft.IterateByQ(tensorflag, outbuf.get(), bufsize, prefetch);
+        while(iqtq)
+        {
+            StoreQ(iqtq.q(), iqtq.Get());
+            ++iqtq;
+        }
     }
 
     string titleq(title);
@@ -495,12 +573,8 @@ int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
 
     // Note - The reference matrices are always stored "by q". So some
     // index math is appropriate
-    ThreeIndexTensor::IteratedQTensorByIJ iqtij = dft.IterateByIJ(tensorflag, outbuf.get(), bufsize);
-    while(iqtij)
+    auto StoreIJ = [&](int i, int j, const double * row)
     {
-        int i = iqtij.i();
-        int j = iqtij.j();
-
         // tests are always done on unpacked matrices
         if(dft.IsPacked(tensorflag))
         {
@@ -508,15 +582,34 @@ int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
             for(int q = 0; q < naux; q++)
                 mat[q*ndim1*ndim2 + i * ndim2 + j]
               = mat[q*ndim1*ndim2 + j * ndim1 + i]
-              = iqtij[q];
+              = row[q];
         }
         else
         {
             for(int q = 0; q < naux; q++)
-                mat[q*ndim1*ndim2 + i * ndim2 + j] = iqtij[q];
+                mat[q*ndim1*ndim2 + i * ndim2 + j] = row[q];
         }
+    };
 
-        ++iqtij;
+    if(useview)
+    {
+        const double * data;
+        int n;
+        IJIterator ijit(ndim1, ndim2, dft.IsPacked(tensorflag));
+        for(int ij = 0; (n = dft.GetBatchView(tensorflag, data, outbuf.get(), bufsize, ij)) > 0; ij += n)
+        {
+            for(int k = 0; k < n; k++, ++ijit)
+                StoreIJ(ijit.i(), ijit.j(), data + k*naux);
+        }
+    }
+    else
+    {
+        ThreeIndexTensor::IteratedQTensorByIJ iqtij = dft.IterateByIJ(tensorflag, outbuf.get(), bufsize, prefetch);
+        while(iqtij)
+        {
+            StoreIJ(iqtij.i(), iqtij.j(), iqtij.Get());
+            ++iqtij;
+        }
     }
 
     string titleij(title);
@@ -529,11 +622,356 @@ int RunTestMatrix(ThreeIndexTensor & dft, const string & title,
                           sum_threshold, checksum_threshold, element_threshold,
                           verbose);
 
+    // Blocks and gathers should match the elements from the batches. They are
+    // the same stored elements, except for on-the-fly tensors, where reads of different
+    // ranges may be computed with different rounding
+    if(!skiptest)
+    {
+        int i0 = ndim1/4, ni = std::max(1, ndim1/2);
+        int j0 = ndim2/3, nj = std::max(1, ndim2/2);
+        int q0 = naux/5, nq = std::max(1, naux/2);
+
+        // some scattered pairs, then a run
+        vector<int> pi, pj, ijlist;
+        for(int k = 0; k < 20; k++)
+        {
+            pi.push_back((k*7) % ndim1);
+            pj.push_back((k*3) % ndim2);
+        }
+        for(int j = 0; j < ndim2; j++)
+        {
+            pi.push_back(ndim1-1);
+            pj.push_back(j);
+        }
+        for(size_t k = 0; k < pi.size(); k++)
+            ijlist.push_back(dft.CalcIndex(tensorflag, pi[k], pj[k]));
+
+        size_t blocksize = std::max(static_cast<size_t>(ni)*nj*nq, ijlist.size()*nq);
+        unique_ptr<double[]> block(new double[blocksize]);
+
+        int nfailures = 0;
+
+        dft.GetBlock(tensorflag, block.get(), blocksize, i0, ni, j0, nj, q0, nq);
+        for(int i = 0; i < ni; i++)
+        for(int j = 0; j < nj; j++)
+        for(int q = 0; q < nq; q++)
+        {
+            if(std::abs(block[(i*nj+j)*nq+q] - mat[(q0+q)*ndim1*ndim2 + (i0+i)*ndim2 + j0+j]) > element_threshold)
+                nfailures++;
+        }
+
+        dft.GetGather(tensorflag, block.get(), blocksize, ijlist.data(), ijlist.size(), q0, nq);
+        for(size_t k = 0; k < ijlist.size(); k++)
+        for(int q = 0; q < nq; q++)
+        {
+            if(std::abs(block[k*nq+q] - mat[(q0+q)*ndim1*ndim2 + pi[k]*ndim2 + pj[k]]) > element_threshold)
+                nfailures++;
+        }
+
+        *out << "Matrix \"" << title << " (block/gather)\" result: " << (nfailures ? "FAIL" : "PASS");
+        if(nfailures)
+            *out << " (" << nfailures << " failures)";
+        *out << "\n\n";
+
+        if(nfailures)
+            ret++;
+    }
+
     return ret;
 
 }
 
 
+/*!
+ * \brief Test J and K matrices built from Qso against Qoo
+ *
+ * With D = C C^T for the occupied orbitals, sum D*J must equal
+ * sum_Q (sum_i (Q|ii))^2, and sum D*K must equal sum_Q sum_ij (Q|ij)^2.
+ * A second density (with half the occupied orbitals) is built at the same time,
+ * and J from the density itself is compared to J from the orbitals.
+ *
+ * \return Number of failures
+ */
+int TestJK(ThreeIndexTensor & dft, const string & title, const SimpleMatrix & cmat, bool transpose,
+           int nso, int nocc, double threshold, bool verbose)
+{
+    int naux = dft.BatchSize(QGEN_QOO);
+    int nocc2 = std::max(1, nocc/2);
+    size_t nso2 = static_cast<size_t>(nso)*nso;
+
+    // occupied part of the C matrix (nso x nocc)
+    vector<double> cocc(nso*nocc);
+    for(int mu = 0; mu < nso; mu++)
+    for(int i = 0; i < nocc; i++)
+        cocc[mu*nocc+i] = (transpose ? cmat(i, mu) : cmat(mu, i));
+
+    vector<double> cocc2(nso*nocc2);
+    for(int mu = 0; mu < nso; mu++)
+    for(int i = 0; i < nocc2; i++)
+        cocc2[mu*nocc2+i] = cocc[mu*nocc+i];
+
+    vector<double> jmat(2*nso2), kmat(2*nso2), jdens(nso2), dmat(nso2, 0.0);
+    const double * cp[2] = { cocc.data(), cocc2.data() };
+    const int no[2] = { nocc, nocc2 };
+    double * jp[2] = { jmat.data(), jmat.data() + nso2 };
+    double * kp[2] = { kmat.data(), kmat.data() + nso2 };
+
+    dft.BuildJK(2, cp, no, jp, kp);
+
+    for(int mu = 0; mu < nso; mu++)
+    for(int nu = 0; nu < nso; nu++)
+    for(int i = 0; i < nocc; i++)
+        dmat[mu*nso+nu] += cocc[mu*nocc+i]*cocc[nu*nocc+i];
+
+    const double * dp = dmat.data();
+    double * jdp = jdens.data();
+    dft.BuildJ(1, &dp, &jdp);
+
+    // reference from Qoo
+    vector<double> qoo(static_cast<size_t>(nocc)*nocc*naux);
+    dft.GetBlock(QGEN_QOO, qoo.data(), qoo.size(), 0, nocc, 0, nocc, 0, naux);
+
+    int nfailures = 0;
+
+    for(int n = 0; n < 2; n++)
+    {
+        double ejref = 0.0, ekref = 0.0;
+        for(int q = 0; q < naux; q++)
+        {
+            double dq = 0.0;
+            for(int i = 0; i < no[n]; i++)
+            {
+                dq += qoo[(i*nocc+i)*naux+q];
+                for(int j = 0; j < no[n]; j++)
+                    ekref += qoo[(i*nocc+j)*naux+q]*qoo[(i*nocc+j)*naux+q];
+            }
+            ejref += dq*dq;
+        }
+
+        // densities from the orbitals used for this J and K
+        double ej = 0.0, ek = 0.0;
+        for(int mu = 0; mu < nso; mu++)
+        for(int nu = 0; nu < nso; nu++)
+        {
+            double d = 0.0;
+            for(int i = 0; i < no[n]; i++)
+                d += cp[n][mu*no[n]+i]*cp[n][nu*no[n]+i];
+            ej += d*jp[n][mu*nso+nu];
+            ek += d*kp[n][mu*nso+nu];
+        }
+
+        string suffix = (n == 0 ? "" : " (half)");
+        nfailures += TestAndPrint("EJ" + suffix, ej, ejref, threshold*std::abs(ejref), verbose);
+        nfailures += TestAndPrint("EK" + suffix, ek, ekref, threshold*std::abs(ekref), verbose);
+    }
+
+    for(size_t k = 0; k < nso2; k++)
+    {
+        if(std::abs(jdens[k] - jmat[k]) > threshold*(1.0 + std::abs(jmat[k])))
+            nfailures++;
+    }
+
+    *out << "Matrix \"" << title << " (J/K)\" result: " << (nfailures ? "FAIL" : "PASS");
+    if(nfailures)
+        *out << " (" << nfailures << " failures)";
+    *out << "\n\n";
+
+    return (nfailures ? 1 : 0);
+}
+
+
+
+/*!
+ * \brief Test that J and K can't be built when Qso wasn't requested
+ *
+ * Qso is then only generated on the way to the other tensors, without the metric.
+ *
+ * \return Number of failures
+ */
+int TestJKNoQso(ThreeIndexTensor & dft, const string & title, int nso, bool verbose)
+{
+    size_t nso2 = static_cast<size_t>(nso)*nso;
+    vector<double> cocc(nso), jmat(nso2), kmat(nso2);
+    const double * cp = cocc.data();
+    const int no = 1;
+    double * jp = jmat.data();
+    double * kp = kmat.data();
+
+    bool threw = false;
+    try {
+        dft.BuildJK(1, &cp, &no, &jp, &kp);
+    }
+    catch(const std::exception & ex)
+    {
+        threw = true;
+        if(verbose)
+            *out << "    Caught: " << ex.what() << "\n";
+    }
+
+    *out << "Matrix \"" << title << " (J/K without Qso)\" result: " << (threw ? "PASS" : "FAIL") << "\n\n";
+    return (threw ? 0 : 1);
+}
+
+
+
+/*!
+ * \brief Test four-index integrals from the transformed tensors against Qmo
+ *
+ * (ia|jb) from Qov and (ij|ab) from Qoo and Qvv are compared to the same
+ * integrals assembled from Qmo.
+ *
+ * \return Number of failures
+ */
+int TestFourIndex(ThreeIndexTensor & dft, const string & title, int nocc, int nvir,
+                  double threshold, bool verbose)
+{
+    // some of the virtuals
+    int a0 = nvir/3, na = std::max(1, nvir/2);
+
+    size_t ovsize = static_cast<size_t>(nocc)*na;
+    vector<double> ints(ovsize*ovsize), ref(ovsize*ovsize);
+
+    int nfailures = 0;
+    double maxdiff = 0.0;
+
+    auto Compare = [&](const string & name) -> int
+    {
+        int nfail = 0;
+        for(size_t k = 0; k < ints.size(); k++)
+        {
+            double diff = std::abs(ints[k] - ref[k]);
+            maxdiff = std::max(maxdiff, diff);
+            if(diff > threshold*(1.0 + std::abs(ref[k])))
+                nfail++;
+        }
+
+        if(verbose || nfail)
+            *out << "    " << name << ": " << nfail << " failures\n";
+        return nfail;
+    };
+
+    // (ia|jb)
+    dft.GetFourIndex(QGEN_QOV, QGEN_QOV, ints.data(), ints.size(), 0, nocc, a0, na, 0, nocc, a0, na);
+    dft.GetFourIndex(QGEN_QMO, QGEN_QMO, ref.data(), ref.size(), 0, nocc, nocc+a0, na, 0, nocc, nocc+a0, na);
+    nfailures += Compare("(ia|jb)");
+
+    // some elements summed explicitly
+    int naux = dft.BatchSize(QGEN_QOV);
+    vector<double> bov(ovsize*naux);
+    dft.GetBlock(QGEN_QOV, bov.data(), bov.size(), 0, nocc, a0, na, 0, naux);
+
+    for(int k = 0; k < 10; k++)
+    {
+        int i = (k*3) % nocc, a = (k*7) % na;
+        int j = (k*5) % nocc, b = (k*2) % na;
+
+        const double * bia = bov.data() + (i*na + a)*naux;
+        const double * bjb = bov.data() + (j*na + b)*naux;
+
+        ref[k] = 0.0;
+        for(int q = 0; q < naux; q++)
+            ref[k] += bia[q]*bjb[q];
+        ints[k] = ints[((i*na + a)*nocc + j)*na + b];
+    }
+    ints.resize(10);
+    nfailures += Compare("(ia|jb) elements");
+    ints.resize(ref.size());
+
+    // (ij|ab)
+    dft.GetFourIndex(QGEN_QOO, QGEN_QVV, ints.data(), ints.size(), 0, nocc, 0, nocc, a0, na, a0, na);
+    dft.GetFourIndex(QGEN_QMO, QGEN_QMO, ref.data(), ref.size(), 0, nocc, 0, nocc, nocc+a0, na, nocc+a0, na);
+    nfailures += Compare("(ij|ab)");
+
+    *out << "Matrix \"" << title << " (four-index)\" result: " << (nfailures ? "FAIL" : "PASS");
+    if(nfailures)
+        *out << " (" << nfailures << " failures)";
+    if(verbose)
+        *out << " (max diff " << maxdiff << ")";
+    *out << "\n\n";
+
+    return (nfailures ? 1 : 0);
+}
+
+
+
+/*!
+ * \brief Test the MP2 energy from Qov against one from (ia|jb) assembled all at once
+ *
+ * \return Number of failures
+ */
+int TestMP2(ThreeIndexTensor & dft, const string & title, const vector<double> & orben,
+            int nocc, int nvir, double threshold, bool verbose)
+{
+    size_t ovsize = static_cast<size_t>(nocc)*nvir;
+    vector<double> iajb(ovsize*ovsize);
+    dft.GetFourIndex(QGEN_QOV, QGEN_QOV, iajb.data(), iajb.size(), 0, nocc, 0, nvir, 0, nocc, 0, nvir);
+
+    double esameref = 0.0, eoppref = 0.0;
+    for(int i = 0; i < nocc; i++)
+    for(int j = 0; j < nocc; j++)
+    for(int a = 0; a < nvir; a++)
+    for(int b = 0; b < nvir; b++)
+    {
+        double iajbval = iajb[(i*nvir+a)*ovsize + j*nvir+b];
+        double ibjaval = iajb[(i*nvir+b)*ovsize + j*nvir+a];
+        double denom = orben[i] + orben[j] - orben[nocc+a] - orben[nocc+b];
+
+        eoppref += (iajbval*iajbval)/denom;
+        esameref += (iajbval*(iajbval-ibjaval))/denom;
+    }
+
+    double esame, eopp;
+    double e2 = dft.DFMP2Energy(orben.data(), esame, eopp);
+
+    int nfailures = 0;
+    nfailures += TestAndPrint("E(same spin)", esame, esameref, threshold*std::abs(esameref), verbose);
+    nfailures += TestAndPrint("E(opposite spin)", eopp, eoppref, threshold*std::abs(eoppref), verbose);
+    nfailures += TestAndPrint("E(MP2)", e2, esameref + eoppref, threshold*std::abs(esameref + eoppref), verbose);
+
+    *out << "Matrix \"" << title << " (MP2)\" result: " << (nfailures ? "FAIL" : "PASS");
+    if(nfailures)
+        *out << " (" << nfailures << " failures)";
+    *out << "\n\n";
+
+    return (nfailures ? 1 : 0);
+}
+
+
+
+/*!
+ * \brief Test the MP2 energy with all orbitals occupied (no virtuals)
+ *
+ * Uses a separate DF object, with tensors in memory.
+ *
+ * \return Number of failures
+ */
+int TestMP2NoVir(SharedBasisSet primary, const string & auxfile, const string & dfdir,
+                 SimpleMatrix & cmat, bool transpose, int nmo, const vector<double> & orben,
+                 bool verbose)
+{
+    DFTensor dft(primary, auxfile, dfdir, DFOPT_COULOMB | DFOPT_EIGINV, BSORDER_PSI4, 0);
+    dft.SetCMatrix(cmat.pointer(), nmo, transpose);
+    dft.SetNOcc(nmo);
+    dft.GenQTensors(QGEN_QOV, QSTORAGE_INMEM);
+
+    double esame = 1.0, eopp = 1.0;
+    double e2 = dft.DFMP2Energy(orben.data(), esame, eopp);
+
+    int nfailures = 0;
+    nfailures += TestAndPrint("E(same spin)", esame, 0.0, 0.0, verbose);
+    nfailures += TestAndPrint("E(opposite spin)", eopp, 0.0, 0.0, verbose);
+    nfailures += TestAndPrint("E(MP2)", e2, 0.0, 0.0, verbose);
+
+    *out << "Matrix \"QOV (MP2, no virtuals)\" result: " << (nfailures ? "FAIL" : "PASS");
+    if(nfailures)
+        *out << " (" << nfailures << " failures)";
+    *out << "\n\n";
+
+    return (nfailures ? 1 : 0);
+}
+
+
+
 void GenTestMatrix(ThreeIndexTensor & dft, const string & title,
                   int tensorflag, int batchsize,
                   const string & reffile,
@@ -693,14 +1131,23 @@ int main(int argc, char ** argv)
         bool byq = false;
         bool transpose = false;
         int batchsize = 0;
+        int prefetch = 1;
+        int nstripe = 1;
         bool cyclops = false;
         bool disk = false;
+        bool mmapdisk = false;
+        int hybridkb = -1;
         bool docholesky = true;
         bool generate = false;
         bool skiptest = false;
         bool skipgetbatch = false;
         bool keepdisk = false;
         bool readdisk = false;
+        bool onthefly = false;
+        bool singleprec = false;
+        bool fastdf = false;
+        bool planonly = false;
+        bool useview = false;
 
         int i = 1;
         while(i < argc)
@@ -714,16 +1161,34 @@ int main(int argc, char ** argv)
                 byq = true;
             else if(starg == "-b")
                 batchsize = GetIArg(i, argc, argv);
+            else if(starg == "-p")
+                prefetch = GetIArg(i, argc, argv);
+            else if(starg == "-s")
+                nstripe = GetIArg(i, argc, argv);
             else if(starg == "-C")
                 docholesky = false;
             else if(starg == "-S")
                 skiptest = true;
             else if(starg == "-d")
                 disk = true;
+            else if(starg == "-m")
+                mmapdisk = true;
+            else if(starg == "-H")
+                hybridkb = GetIArg(i, argc, argv);
             else if(starg == "-k")
                 keepdisk = true;
             else if(starg == "-r")
                 readdisk = true;
+            else if(starg == "-o")
+                onthefly = true;
+            else if(starg == "-F")
+                singleprec = true;
+            else if(starg == "-f")
+                fastdf = true;
+            else if(starg == "-V")
+                useview = true;
+            else if(starg == "-P")
+                planonly = true;
             else if(starg == "-c")
                 cyclops = true;
             else if(starg == "-g")
@@ -764,6 +1229,18 @@ int main(int argc, char ** argv)
             throw std::runtime_error("Incompatible options: cyclops and disk");
         #endif
 
+        if(onthefly && (disk || mmapdisk || cyclops))
+            throw std::runtime_error("Incompatible options: on-the-fly and disk/cyclops");
+
+        if(disk && mmapdisk)
+            throw std::runtime_error("Incompatible options: disk and memory-mapped");
+
+        if(hybridkb >= 0 && (onthefly || cyclops))
+            throw std::runtime_error("Incompatible options: memory limit and on-the-fly/cyclops");
+
+        if(onthefly && docholesky)
+            throw std::runtime_error("On-the-fly generation is not available for cholesky!");
+
         if(generate && !docholesky)
             throw std::runtime_error("Generate must include cholesky!");
 
@@ -812,14 +1289,24 @@ int main(int argc, char ** argv)
         int nso = primary->nbf();
         int nocc = ReadNocc(dir + "nocc");
         int nmo = nso;
+        auto orben = ReadOrbEnFile(dir + "orben");
+
+        // list of directories to stripe across
+        string dfdir = "/tmp/df";
+        string chdir = "/tmp/ch";
+        for(int s = 1; s < nstripe; s++)
+        {
+            dfdir += ":/tmp/df." + std::to_string(s);
+            chdir += ":/tmp/ch." + std::to_string(s);
+        }
 
-        DFTensor dft(primary, dir + "basis.aux.gbs", "/tmp/df",
+        DFTensor dft(primary, dir + "basis.aux.gbs", dfdir,
                      DFOPT_COULOMB | DFOPT_EIGINV,
                      BSORDER_PSI4, 0);
 
         // *** We are only testing Qso from CHTensor               *** //
         // *** But generating them all (to test for memory issues) *** //
-        CHTensor cht(primary, CHOLESKY_DELTA, "/tmp/ch", BSORDER_PSI4, 0);
+        CHTensor cht(primary, CHOLESKY_DELTA, chdir, BSORDER_PSI4, 0);
 
         dft.SetCMatrix(cmat->pointer(), nmo, transpose);
         cht.SetCMatrix(cmat->pointer(), nmo, transpose);
@@ -827,6 +1314,10 @@ int main(int argc, char ** argv)
         cht.SetNOcc(nocc);
 
         int dfqflags = (QGEN_QSO | QGEN_QMO | QGEN_QOO | QGEN_QOV | QGEN_QVV);
+
+        // Without Qso and Qmo, the metric is applied to the transformed tensors
+        if(fastdf)
+            dfqflags = (QGEN_QOO | QGEN_QOV | QGEN_QVV);
         int chqflags = (QGEN_QSO | QGEN_QMO | QGEN_QOO | QGEN_QOV | QGEN_QVV);
 
         int qstore = 0;
@@ -835,10 +1326,21 @@ int main(int argc, char ** argv)
 
         if(disk)
             qstore |= QSTORAGE_ONDISK;
+        if(mmapdisk)
+            qstore |= QSTORAGE_MMAP;
+        if(hybridkb >= 0)
+        {
+            dft.SetMemoryLimit(static_cast<size_t>(hybridkb)*1024);
+            cht.SetMemoryLimit(static_cast<size_t>(hybridkb)*1024);
+        }
         if(keepdisk)
             qstore |= QSTORAGE_KEEPDISK;
+        if(singleprec)
+            qstore |= QSTORAGE_FLOAT;
         if(readdisk)
             qstore |= QSTORAGE_READDISK;
+        else if(onthefly)
+            qstore |= QSTORAGE_ONFLY;
         #ifdef PANACHE_CYCLOPS
         else if(cyclops)
             qstore |= QSTORAGE_CYCLOPS;
@@ -846,7 +1348,23 @@ int main(int argc, char ** argv)
         else
             qstore |= QSTORAGE_INMEM;
 
-        dft.GenQTensors(dfqflags, qstore);
+        if(planonly)
+        {
+            PrintPlan("DF", dft.Plan(dfqflags, qstore));
+            if(docholesky)
+                PrintPlan("Cholesky", cht.Plan(chqflags, qstore));
+            return 0;
+        }
+
+        // With fast DF, Qoo is generated first, and the others in a second call
+        // (from the same Qso, which still needs the metric applied to them)
+        if(fastdf)
+        {
+            dft.GenQTensors(QGEN_QOO, qstore);
+            dft.GenQTensors(dfqflags & ~QGEN_QOO, qstore);
+        }
+        else
+            dft.GenQTensors(dfqflags, qstore);
 
         if(docholesky)
             cht.GenQTensors(chqflags, qstore);
@@ -892,50 +1410,88 @@ int main(int argc, char ** argv)
         }
         else if(!skipgetbatch)
         {
-            ///////////
-            // Test Qso
-            ///////////
-            ret += RunTestMatrix(dft, "QSO",
-                                 batchsize, QGEN_QSO,
-                                 dir + "qso", 
-                                 QSO_SUM_THRESHOLD, QSO_CHECKSUM_THRESHOLD, QSO_ELEMENT_THRESHOLD,
-                                 skiptest, verbose);
-    
-            ///////////
-            // Test Qmo
-            ///////////
-            ret += RunTestMatrix(dft, "QMO",
-                                 batchsize, QGEN_QMO,
-                                 dir + "qmo", 
-                                 QMO_SUM_THRESHOLD, QMO_CHECKSUM_THRESHOLD, QMO_ELEMENT_THRESHOLD,
-                                 skiptest, verbose);
+            double qmo_sum_threshold = (singleprec ? QMOF_SUM_THRESHOLD : QMO_SUM_THRESHOLD);
+            double qmo_checksum_threshold = (singleprec ? QMOF_CHECKSUM_THRESHOLD : QMO_CHECKSUM_THRESHOLD);
+            double qmo_element_threshold = (singleprec ? QMOF_ELEMENT_THRESHOLD : QMO_ELEMENT_THRESHOLD);
+
+            if(!fastdf)
+            {
+                ///////////
+                // Test Qso
+                ///////////
+                ret += RunTestMatrix(dft, "QSO",
+                                     batchsize, prefetch, useview, QGEN_QSO,
+                                     dir + "qso", 
+                                     QSO_SUM_THRESHOLD, QSO_CHECKSUM_THRESHOLD, QSO_ELEMENT_THRESHOLD,
+                                     skiptest, verbose);
+        
+                ///////////
+                // Test Qmo
+                ///////////
+                ret += RunTestMatrix(dft, "QMO",
+                                     batchsize, prefetch, useview, QGEN_QMO,
+                                     dir + "qmo", 
+                                     qmo_sum_threshold, qmo_checksum_threshold, qmo_element_threshold,
+                                     skiptest, verbose);
+
+                ///////////////
+                // Test J and K
+                ///////////////
+                ret += TestJK(dft, "QSO", *cmat, transpose, nso, nocc,
+                              (singleprec ? JKF_THRESHOLD : JK_THRESHOLD), verbose);
+
+                ///////////////////////////////
+                // Test four-index integrals
+                ///////////////////////////////
+                ret += TestFourIndex(dft, "QMO", nocc, nmo - nocc,
+                                     (singleprec ? JKF_THRESHOLD : JK_THRESHOLD), verbose);
+            }
+            else
+            {
+                /////////////////////////////
+                // J and K need QGEN_QSO
+                /////////////////////////////
+                ret += TestJKNoQso(dft, "QSO", nso, verbose);
+            }
     
             ///////////
             // Test Qoo
             ///////////
             ret += RunTestMatrix(dft, "QOO",
-                                 batchsize, QGEN_QOO,
+                                 batchsize, prefetch, useview, QGEN_QOO,
                                  dir + "qoo", 
-                                 QMO_SUM_THRESHOLD, QMO_CHECKSUM_THRESHOLD, QMO_ELEMENT_THRESHOLD,
+                                 qmo_sum_threshold, qmo_checksum_threshold, qmo_element_threshold,
                                  skiptest, verbose);
     
             ///////////
             // Test Qov
             ///////////
             ret += RunTestMatrix(dft, "QOV",
-                                 batchsize, QGEN_QOV,
+                                 batchsize, prefetch, useview, QGEN_QOV,
                                  dir + "qov",
-                                 QMO_SUM_THRESHOLD, QMO_CHECKSUM_THRESHOLD, QMO_ELEMENT_THRESHOLD,
+                                 qmo_sum_threshold, qmo_checksum_threshold, qmo_element_threshold,
                                  skiptest, verbose);
+
+            /////////////////////
+            // Test MP2 energy
+            /////////////////////
+            ret += TestMP2(dft, "QOV", orben, nocc, nmo - nocc,
+                           (singleprec ? JKF_THRESHOLD : JK_THRESHOLD), verbose);
     
             ///////////
             // Test Qvv
             ///////////
             ret += RunTestMatrix(dft, "QVV",
-                                 batchsize, QGEN_QVV,
+                                 batchsize, prefetch, useview, QGEN_QVV,
                                  dir + "qvv",
-                                 QMO_SUM_THRESHOLD, QMO_CHECKSUM_THRESHOLD, QMO_ELEMENT_THRESHOLD,
+                                 qmo_sum_threshold, qmo_checksum_threshold, qmo_element_threshold,
                                  skiptest, verbose);
+
+            /////////////////////////////////
+            // Test MP2 without virtuals
+            /////////////////////////////////
+            ret += TestMP2NoVir(primary, dir + "basis.aux.gbs", dfdir, *cmat, transpose, nmo,
+                                orben, verbose);
     
             ///////////////////////
             // Test Cholesky QSO
@@ -943,7 +1499,7 @@ int main(int argc, char ** argv)
             if(docholesky)
             {
                 ret += RunTestMatrix(cht, "CHQSO",
-                                     batchsize, QGEN_QSO,
+                                     batchsize, prefetch, useview, QGEN_QSO,
                                      dir + "chqso",
                                      QSO_SUM_THRESHOLD, QSO_CHECKSUM_THRESHOLD, QSO_ELEMENT_THRESHOLD,
                                      skiptest, verbose);